@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "config_env.h"
+#include "logger.h"
+
+#define LOG_TAG "arena"
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+/* Allocations start past the block header, on an aligned address */
+#define ARENA_HEADER ARENA_ROUND(sizeof(arena_block_t))
+
+void arena_init(arena_t* a, const char* name)
+{
+    memset(a, 0, sizeof(*a));
+    snprintf(a->name, sizeof(a->name), "%s", name);
+    a->debug = configvar_int_default("AIC_PLAYER_ARENA_DEBUG", 0);
+}
+
+/**
+ * Move to the next block kept from a previous connection if it is large enough, or to a new one
+ */
+static arena_block_t* next_block(arena_t* a, size_t size)
+{
+    arena_block_t* next = a->cur != NULL ? a->cur->next : a->blocks;
+    if (next == NULL || next->size < size)
+    {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block_t* block;
+        if (posix_memalign((void**) &block, ARENA_ALIGN, ARENA_HEADER + block_size))
+            return NULL;
+        block->size = block_size;
+        /* Inserted in the place of the smaller one, which is kept for smaller allocations */
+        block->next = next;
+        if (a->cur != NULL)
+            a->cur->next = block;
+        else
+            a->blocks = block;
+        next = block;
+    }
+    next->used = 0;
+    a->cur = next;
+    return next;
+}
+
+/**
+ * Allocate from the arena, or with malloc without one
+ */
+void* arena_alloc(arena_t* a, size_t size)
+{
+    if (a == NULL)
+        return malloc(size);
+    size = ARENA_ROUND(size);
+    arena_block_t* block = a->cur;
+    if (block == NULL || block->size - block->used < size)
+    {
+        block = next_block(a, size);
+        if (block == NULL)
+            return NULL;
+    }
+    void* p = (uint8_t*) block + ARENA_HEADER + block->used;
+    block->used += size;
+    a->used += size;
+    if (a->used > a->high_water)
+        a->high_water = a->used;
+    return p;
+}
+
+void* arena_calloc(arena_t* a, size_t size)
+{
+    if (a == NULL)
+        return calloc(1, size);
+    void* p = arena_alloc(a, size);
+    if (p != NULL)
+        memset(p, 0, size);
+    return p;
+}
+
+char* arena_strdup(arena_t* a, const char* s)
+{
+    if (a == NULL)
+        return strdup(s);
+    size_t len = strlen(s) + 1;
+    char* p = arena_alloc(a, len);
+    if (p != NULL)
+        memcpy(p, s, len);
+    return p;
+}
+
+/**
+ * Release everything allocated, keeping the blocks for the next connection
+ */
+void arena_reset(arena_t* a)
+{
+    if (a->debug)
+    {
+        size_t reserved = 0;
+        int blocks = 0;
+        for (arena_block_t* block = a->blocks; block != NULL; block = block->next, blocks++)
+            reserved += block->size;
+        I("%s: %zu bytes allocated, high-water mark %zu bytes, %zu bytes in %d blocks", a->name,
+          a->used, a->high_water, reserved, blocks);
+    }
+    a->cur = NULL;
+    a->used = 0;
+}
+
+void arena_free(arena_t* a)
+{
+    while (a->blocks != NULL)
+    {
+        arena_block_t* next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+    a->cur = NULL;
+    a->used = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* Allocations are aligned on cache lines */
+#define ARENA_ALIGN 64
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct arena_block
+{
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+} arena_block_t;
+
+/**
+ * Allocations that live as long as a connection, released all at once when it is closed
+ * Allocation bumps a pointer in the current block. Blocks are kept across resets, so that the
+ * next connection of the same camera allocates from them without going through malloc again.
+ * Without an arena (NULL), the functions fall back to malloc, and the caller frees.
+ */
+typedef struct arena
+{
+    char name[64];
+    /* Blocks in allocation order, and the one allocations come from, NULL before the first */
+    arena_block_t* blocks;
+    arena_block_t* cur;
+    /* Bytes allocated since the last reset, and the most ever allocated */
+    size_t used;
+    size_t high_water;
+    /* Report the high-water mark on every reset */
+    int debug;
+} arena_t;
+
+void arena_init(arena_t* a, const char* name);
+void* arena_alloc(arena_t* a, size_t size);
+void* arena_calloc(arena_t* a, size_t size);
+char* arena_strdup(arena_t* a, const char* s);
+void arena_reset(arena_t* a);
+void arena_free(arena_t* a);
+#endif
@@ -1,17 +1,37 @@
 #include "camera-common.h"
 
+#include "arena.h"
 #include "logger.h"
 #include "camera-capture-ffmpeg.h"
+#include "camera-format-converters.h"
+#include "probe_cache.h"
 
+#include <libavutil/buffer.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/samplefmt.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LOG_TAG "camera-capture-ffmpeg"
 
+/* Distinct framebuffer dimensions a frame is scaled to: capture, and reduced preview */
+#define MAX_FB_DIMS 2
+
+enum prefetch_state
+{
+    PREFETCH_IDLE,
+    PREFETCH_QUEUED,
+    PREFETCH_RUNNING,
+    PREFETCH_DONE,
+};
+
 typedef struct video_dec
 {
     AVFormatContext* fmt_ctx;
@@ -25,32 +45,37 @@ typedef struct video_dec
     AVPacket pkt;
     int width;
     int height;
-} video_dec_t;
-
-typedef struct
-{
-    int pixel_format;
-    int width;
-    int height;
+    FrameScaler* scalers[MAX_FB_DIMS];
+    /* Fallback conversion context */
     struct SwsContext* resize;
-} resize_ctx;
+    /* File being played */
+    char filename[256];
+    /* Decoding of the next frame on the decode pool, while the previous one is being sent */
+    worker_job_t prefetch_job;
+    pthread_mutex_t prefetch_mtx;
+    pthread_cond_t prefetch_cond;
+    enum prefetch_state prefetch;
+    int prefetch_res;
+    /* Source shared with the other cameras playing the file, which then decodes it instead */
+    struct shared_source* source;
+} video_dec_t;
 
 /*******************************************************************************
- *                     CameraDevice API
+ *                     Decoding
  ******************************************************************************/
 
-extern pthread_mutex_t dec_mtx;
-
-static char camera_filename[256] = "default_camera.mpg";
 static const char default_filename[] = "default_camera.mpg";
 
-static int open_codec_context(int* stream_idx, AVFormatContext* fmt_ctx, enum AVMediaType type)
+static worker_pool_t* decode_pool = NULL;
+
+static int open_codec_context(int* stream_idx, AVFormatContext* fmt_ctx, enum AVMediaType type,
+                              int wanted_stream)
 {
     int ret;
     AVStream* st;
     AVCodecContext* dec_ctx = NULL;
     AVCodec* dec = NULL;
-    ret = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
+    ret = av_find_best_stream(fmt_ctx, type, wanted_stream, -1, NULL, 0);
     if (ret < 0)
     {
         return ret;
@@ -100,6 +125,78 @@ static int next_frame(video_dec_t* ctx)
     return got_frame;
 }
 
+/**
+ * Fill the video stream of a file opened without probing it, from its cached parameters
+ * Containers without a header get the stream created, the demuxer finds it by its identifier.
+ * Returns the index of the stream, or -1 if the container doesn't have it.
+ */
+static int apply_probe(AVFormatContext* fmt_ctx, const probe_info_t* probe)
+{
+    AVStream* st = NULL;
+    if (probe->stream_index < (int) fmt_ctx->nb_streams &&
+        fmt_ctx->streams[probe->stream_index]->id == probe->stream_id)
+        st = fmt_ctx->streams[probe->stream_index];
+    else if (fmt_ctx->ctx_flags & AVFMTCTX_NOHEADER)
+    {
+        st = avformat_new_stream(fmt_ctx, NULL);
+        if (st == NULL)
+            return -1;
+        st->id = probe->stream_id;
+        st->time_base = (AVRational){probe->time_base_num, probe->time_base_den};
+        /* Packets of these containers don't match frames, the demuxer has them parsed when it
+         * creates the stream itself */
+        st->need_parsing = AVSTREAM_PARSE_FULL;
+    }
+    if (st == NULL)
+        return -1;
+
+    AVCodecContext* c = st->codec;
+    c->codec_type = AVMEDIA_TYPE_VIDEO;
+    c->codec_id = probe->codec_id;
+    c->width = probe->width;
+    c->height = probe->height;
+    c->pix_fmt = probe->pix_fmt;
+    c->time_base = (AVRational){probe->time_base_num, probe->time_base_den};
+    st->avg_frame_rate = (AVRational){probe->frame_rate_num, probe->frame_rate_den};
+    st->r_frame_rate = st->avg_frame_rate;
+    if (probe->extradata_size > 0 && c->extradata == NULL)
+    {
+        c->extradata = av_mallocz(probe->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (c->extradata == NULL)
+            return -1;
+        memcpy(c->extradata, probe->extradata, probe->extradata_size);
+        c->extradata_size = probe->extradata_size;
+    }
+    return st->index;
+}
+
+/**
+ * Keep the parameters of the video stream of a file, for the next time it is opened
+ */
+static void remember_probe(const char* filename, AVFormatContext* fmt_ctx, AVStream* st)
+{
+    AVCodecContext* c = st->codec;
+    if (c->extradata_size > PROBE_EXTRADATA_MAX)
+        return;
+    AVRational rate = av_guess_frame_rate(fmt_ctx, st, NULL);
+    probe_info_t probe = {
+        .stream_index = st->index,
+        .stream_id = st->id,
+        .codec_id = c->codec_id,
+        .width = c->width,
+        .height = c->height,
+        .pix_fmt = c->pix_fmt,
+        .time_base_num = c->time_base.num,
+        .time_base_den = c->time_base.den,
+        .frame_rate_num = rate.num,
+        .frame_rate_den = rate.den,
+        .extradata_size = c->extradata_size,
+    };
+    if (c->extradata_size > 0)
+        memcpy(probe.extradata, c->extradata, c->extradata_size);
+    probe_cache_put(filename, &probe);
+}
+
 static int start_video_dec(video_dec_t* ctx, const char* const filename)
 {
     puts("start video dec");
@@ -113,18 +210,38 @@ static int start_video_dec(video_dec_t* ctx, const char* const filename)
         return -1;
     }
 
+    /* Files opened before go straight to the codec, probing can decode seconds of them */
+    probe_info_t probe;
+    int wanted_stream = -1;
+    if (probe_cache_get(filename, &probe) == 0)
+        wanted_stream = apply_probe(ctx->fmt_ctx, &probe);
+
     /* retrieve stream information */
-    if (avformat_find_stream_info(ctx->fmt_ctx, NULL) < 0)
+    if (wanted_stream < 0 && avformat_find_stream_info(ctx->fmt_ctx, NULL) < 0)
     {
         C("Could not find stream information");
         return -1;
     }
 
-    if (open_codec_context(&(ctx->video_stream_idx), ctx->fmt_ctx, AVMEDIA_TYPE_VIDEO) >= 0)
+    int ret = open_codec_context(&(ctx->video_stream_idx), ctx->fmt_ctx, AVMEDIA_TYPE_VIDEO,
+                                 wanted_stream);
+    if (ret < 0 && wanted_stream >= 0)
     {
-        ctx->video_stream = ctx->fmt_ctx->streams[ctx->video_stream_idx];
-        ctx->video_dec_ctx = ctx->video_stream->codec;
+        W("Cached stream parameters of %s don't fit, probing it", filename);
+        wanted_stream = -1;
+        if (avformat_find_stream_info(ctx->fmt_ctx, NULL) >= 0)
+            ret = open_codec_context(&(ctx->video_stream_idx), ctx->fmt_ctx, AVMEDIA_TYPE_VIDEO,
+                                     -1);
     }
+    if (ret < 0)
+    {
+        C("Could not open a video decoder for %s", filename);
+        return -1;
+    }
+    ctx->video_stream = ctx->fmt_ctx->streams[ctx->video_stream_idx];
+    ctx->video_dec_ctx = ctx->video_stream->codec;
+    if (wanted_stream < 0)
+        remember_probe(filename, ctx->fmt_ctx, ctx->video_stream);
 
     /* dump input information to stderr */
     av_dump_format(ctx->fmt_ctx, 0, filename, 0);
@@ -161,40 +278,857 @@ static void stop_video_dec(video_dec_t* ctx)
 }
 
 /**
- * Resize video frames to the right size and pixel format
+ * Map a V4L2 pixel format of a client framebuffer to the libav one
+ * YVU420 has no libav equivalent, it is laid out as YUV420P with the chroma planes swapped.
+ */
+static enum AVPixelFormat av_pixel_format(uint32_t pixel_format)
+{
+    switch (pixel_format)
+    {
+    case V4L2_PIX_FMT_YVU420:
+        return AV_PIX_FMT_YUV420P;
+    case V4L2_PIX_FMT_NV12:
+        return AV_PIX_FMT_NV12;
+    case V4L2_PIX_FMT_NV21:
+        return AV_PIX_FMT_NV21;
+    case V4L2_PIX_FMT_RGB32:
+        return AV_PIX_FMT_RGBA;
+    case V4L2_PIX_FMT_RGB565:
+        return AV_PIX_FMT_RGB565LE;
+    default:
+        return AV_PIX_FMT_YUV420P;
+    }
+}
+
+/**
+ * Describe a decoded frame for the scaling converter
+ * Returns -1 if the frame layout is not supported by it.
+ */
+static int planar_frame(const AVFrame* frame, PlanarFrame* planar)
+{
+    switch (frame->format)
+    {
+    case AV_PIX_FMT_YUV420P:
+        planar->pixel_format = V4L2_PIX_FMT_YUV420;
+        break;
+    case AV_PIX_FMT_NV12:
+        planar->pixel_format = V4L2_PIX_FMT_NV12;
+        break;
+    case AV_PIX_FMT_NV21:
+        planar->pixel_format = V4L2_PIX_FMT_NV21;
+        break;
+    case AV_PIX_FMT_YUV420P10LE:
+        planar->pixel_format = V4L2_PIX_FMT_YUV420P10;
+        break;
+    case AV_PIX_FMT_YUV420P12LE:
+        planar->pixel_format = V4L2_PIX_FMT_YUV420P12;
+        break;
+#ifdef AV_PIX_FMT_P010
+    case AV_PIX_FMT_P010LE:
+        planar->pixel_format = V4L2_PIX_FMT_P010;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    planar->width = frame->width;
+    planar->height = frame->height;
+    for (int i = 0; i < 3; i++)
+    {
+        planar->panes[i] = frame->data[i];
+        planar->linesize[i] = frame->linesize[i];
+    }
+    return 0;
+}
+
+/**
+ * Dimensions of a client framebuffer, defaulting to the capture ones
+ */
+static void fb_dim(const video_dec_t* dec, const ClientFrameBuffer* fb, int* width, int* height)
+{
+    *width = fb->width ? fb->width : dec->width;
+    *height = fb->height ? fb->height : dec->height;
+}
+
+/**
+ * Size of a client framebuffer, as the camera service allocates it
+ */
+static size_t fb_size(uint32_t pixel_format, int width, int height)
+{
+    switch (pixel_format)
+    {
+    case V4L2_PIX_FMT_RGB32:
+        return (size_t) width * height * 4;
+    case V4L2_PIX_FMT_RGB565:
+        return (size_t) width * height * 2;
+    default:
+        return (size_t) width * height * 12 / 8;
+    }
+}
+
+/**
+ * Scale, adjust and convert a decoded frame into every framebuffer in one pass.
+ * Framebuffers of the capture dimensions go through the first scaler, and the ones of other
+ * dimensions (a reduced preview) through the second one, so that both keep their tables.
+ * Returns -1 if the frame or one of the framebuffers can't go through the scaling converter.
+ */
+static int scale_frame(video_dec_t* dec, const AVFrame* frame, ClientFrameBuffer* framebuffers,
+                       int fbs_num, float r_scale, float g_scale, float b_scale, float exp_comp)
+{
+    if (fbs_num <= 0)
+        return 0;
+    PlanarFrame planar;
+    ClientFrameBuffer group[MAX_FB_DIMS][fbs_num];
+    int group_num[MAX_FB_DIMS] = {0};
+    int group_width[MAX_FB_DIMS] = {dec->width};
+    int group_height[MAX_FB_DIMS] = {dec->height};
+
+    if (planar_frame(frame, &planar))
+        return -1;
+    for (int i = 0; i < fbs_num; i++)
+    {
+        int width, height;
+        int g = 0;
+        if (!has_scaling_converter(planar.pixel_format, framebuffers[i].pixel_format))
+            return -1;
+        fb_dim(dec, &framebuffers[i], &width, &height);
+        if (width != dec->width || height != dec->height)
+        {
+            g = 1;
+            if (group_num[g] && (group_width[g] != width || group_height[g] != height))
+                return -1;
+            group_width[g] = width;
+            group_height[g] = height;
+        }
+        group[g][group_num[g]++] = framebuffers[i];
+    }
+
+    /* Both dimensions are scaled in one walk of the source frame */
+    FrameScaler* scalers[MAX_FB_DIMS];
+    ClientFrameBuffer* groups[MAX_FB_DIMS];
+    int groups_fbs[MAX_FB_DIMS];
+    int groups_num = 0;
+    for (int g = 0; g < MAX_FB_DIMS; g++)
+    {
+        if (!group_num[g])
+            continue;
+        dec->scalers[g] = frame_scaler_get(dec->scalers[g], planar.width, planar.height,
+                                           group_width[g], group_height[g]);
+        if (dec->scalers[g] == NULL)
+            return -1;
+        scalers[groups_num] = dec->scalers[g];
+        groups[groups_num] = group[g];
+        groups_fbs[groups_num++] = group_num[g];
+    }
+    return frame_scalers_convert(scalers, &planar, groups, groups_fbs, groups_num, r_scale,
+                                 g_scale, b_scale, exp_comp);
+}
+
+/**
+ * Resize a video frame to the right size and pixel format
  * Cache the resize context until another one is needed.
+ * Fallback for frames the scaling converter can't handle.
+ */
+static void resize(struct SwsContext** ctx, const AVFrame* frame, const ClientFrameBuffer* fb,
+                   int width, int height)
+{
+    int pixel_format = av_pixel_format(fb->pixel_format);
+    *ctx = sws_getCachedContext(*ctx, frame->width, frame->height, frame->format, width, height,
+                                pixel_format, SWS_BICUBIC, NULL, NULL, NULL);
+
+    /* Straight into the framebuffer, which has the packed layout of the format */
+    AVPicture dst;
+    avpicture_fill(&dst, fb->framebuffer, pixel_format, width, height);
+    if (fb->pixel_format == V4L2_PIX_FMT_YVU420)
+    {
+        uint8_t* u = dst.data[1];
+        dst.data[1] = dst.data[2];
+        dst.data[2] = u;
+    }
+    sws_scale(*ctx, (const uint8_t* const*) frame->data, frame->linesize, 0, frame->height,
+              dst.data, dst.linesize);
+}
+
+/**
+ * Decode the next video frame into dec->frame, looping over the file
  */
-static void resize(video_dec_t* dec, int pixel_format, void* framebuffer)
+static int decode_frame(video_dec_t* dec)
 {
-    static struct SwsContext* resize = NULL;
-    resize =
-        sws_getCachedContext(resize, dec->frame->width, dec->frame->height, dec->frame->format,
-                             dec->width, dec->height, pixel_format, SWS_BICUBIC, NULL, NULL, NULL);
+    int res = next_frame(dec);
+    if (res <= 0)
+    {
+        stop_video_dec(dec);
+        start_video_dec(dec, dec->filename);
+        while (res <= 0)
+            res = next_frame(dec);
+    }
+    return res;
+}
 
-    AVFrame* frame2 = av_frame_alloc();
-    int num_bytes = avpicture_get_size(pixel_format, dec->width, dec->height);
-    uint8_t* frame2_buffer = (uint8_t*) av_malloc(num_bytes * sizeof(uint8_t));
-    avpicture_fill((AVPicture*) frame2, frame2_buffer, pixel_format, dec->width, dec->height);
-    frame2->width = dec->width;
-    frame2->height = dec->height;
-    sws_scale(resize, (const uint8_t* const*) dec->frame->data, dec->frame->linesize, 0,
-              dec->frame->height, frame2->data, frame2->linesize);
+static video_dec_t* prefetch_dec(worker_job_t* job)
+{
+    return (video_dec_t*) ((char*) job - offsetof(video_dec_t, prefetch_job));
+}
 
-    memcpy(framebuffer, frame2->data[0], num_bytes);
-    free(frame2_buffer);
-    av_free(frame2);
+static void prefetch_run(worker_job_t* job)
+{
+    video_dec_t* dec = prefetch_dec(job);
+    pthread_mutex_lock(&dec->prefetch_mtx);
+    dec->prefetch = PREFETCH_RUNNING;
+    pthread_mutex_unlock(&dec->prefetch_mtx);
+    int res = decode_frame(dec);
+    pthread_mutex_lock(&dec->prefetch_mtx);
+    dec->prefetch_res = res;
+    dec->prefetch = PREFETCH_DONE;
+    pthread_cond_broadcast(&dec->prefetch_cond);
+    pthread_mutex_unlock(&dec->prefetch_mtx);
 }
 
-CameraDevice* camera_device_open(const char* name, int inp_channel)
+/**
+ * Start decoding the next frame on the decode pool, if there is one
+ */
+static void prefetch_start(video_dec_t* dec)
+{
+    if (decode_pool == NULL)
+        return;
+    pthread_mutex_lock(&dec->prefetch_mtx);
+    dec->prefetch = PREFETCH_QUEUED;
+    pthread_mutex_unlock(&dec->prefetch_mtx);
+    worker_pool_submit(decode_pool, &dec->prefetch_job);
+}
+
+/**
+ * Wait for the background decoding to be over, so that the decoder can be used
+ * A prefetch still queued is taken back, the caller decodes faster than waiting for a worker.
+ * Returns the prefetched decoding result, or 0 if nothing was prefetched.
+ */
+static int prefetch_wait(video_dec_t* dec)
+{
+    int res = 0;
+    pthread_mutex_lock(&dec->prefetch_mtx);
+    if (dec->prefetch == PREFETCH_QUEUED && worker_pool_cancel(decode_pool, &dec->prefetch_job))
+        dec->prefetch = PREFETCH_IDLE;
+    while (dec->prefetch == PREFETCH_QUEUED || dec->prefetch == PREFETCH_RUNNING)
+        pthread_cond_wait(&dec->prefetch_cond, &dec->prefetch_mtx);
+    if (dec->prefetch == PREFETCH_DONE)
+        res = dec->prefetch_res;
+    dec->prefetch = PREFETCH_IDLE;
+    pthread_mutex_unlock(&dec->prefetch_mtx);
+    return res;
+}
+
+/**
+ * Fill the framebuffers from a decoded frame, through the scaling converter when possible
+ */
+static void render_frame(video_dec_t* dec, const AVFrame* frame, ClientFrameBuffer* framebuffers,
+                         int fbs_num, float r_scale, float g_scale, float b_scale, float exp_comp)
+{
+    if (scale_frame(dec, frame, framebuffers, fbs_num, r_scale, g_scale, b_scale, exp_comp) == 0)
+        return;
+    for (int i = 0; i < fbs_num; i++)
+    {
+        int width, height;
+        fb_dim(dec, &framebuffers[i], &width, &height);
+        resize(&dec->resize, frame, &framebuffers[i], width, height);
+    }
+}
+
+static void video_dec_init(video_dec_t* dec, const char* filename)
+{
+    snprintf(dec->filename, sizeof(dec->filename), "%s", filename);
+    dec->prefetch_job.run = prefetch_run;
+    pthread_mutex_init(&dec->prefetch_mtx, NULL);
+    pthread_cond_init(&dec->prefetch_cond, NULL);
+}
+
+static void video_dec_free(video_dec_t* dec)
+{
+    prefetch_wait(dec);
+    pthread_mutex_destroy(&dec->prefetch_mtx);
+    pthread_cond_destroy(&dec->prefetch_cond);
+    stop_video_dec(dec);
+    for (int i = 0; i < MAX_FB_DIMS; i++)
+        frame_scaler_free(dec->scalers[i]);
+    sws_freeContext(dec->resize);
+}
+
+static double video_dec_frame_rate(video_dec_t* dec)
+{
+    if (dec->fmt_ctx == NULL || dec->video_stream == NULL)
+        return 0;
+    AVRational rate = av_guess_frame_rate(dec->fmt_ctx, dec->video_stream, NULL);
+    return rate.num > 0 && rate.den > 0 ? av_q2d(rate) : 0;
+}
+
+/**
+ * Have the next frames decoded on the given pool while the previous ones are sent
+ * Without a pool, frames are decoded when read.
+ */
+void camera_capture_set_pool(worker_pool_t* pool)
+{
+    decode_pool = pool;
+}
+
+/*******************************************************************************
+ *                     Preloading
+ ******************************************************************************/
+
+/* Decoders kept open for preloaded files at most */
+#define PRELOAD_MAX_DECODERS 8
+/* Packets read at most for the first frame of a preloaded file */
+#define PRELOAD_MAX_PACKETS 256
+
+/**
+ * File read ahead of a switch to it, with its decoder opened and its first frame decoded
+ */
+typedef struct preload
+{
+    struct preload* next;
+    /* Bytes of the file, counted against the budget */
+    size_t size;
+    /* Being read on the decode pool, neither taken nor freed until done */
+    int busy;
+    /* The decoder is open, and holds the first frame */
+    int ready;
+    worker_job_t job;
+    video_dec_t dec;
+} preload_t;
+
+static pthread_mutex_t preloads_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* Most recently asked for first, under preloads_mtx */
+static preload_t* preloads = NULL;
+static size_t preload_bytes = 0;
+static size_t preload_budget = 0;
+static int preload_decode = 0;
+
+/**
+ * Allow files to be preloaded, up to a budget of file bytes, and their decoders opened ahead too
+ * A budget of 0 disables preloading.
+ */
+void camera_capture_set_preload(size_t budget, int decode)
+{
+    preload_budget = budget;
+    preload_decode = decode;
+}
+
+static void preload_free(preload_t* p)
+{
+    video_dec_free(&p->dec);
+    free(p);
+}
+
+static void preload_run(worker_job_t* job)
+{
+    preload_t* p = (preload_t*) ((char*) job - offsetof(preload_t, job));
+    int fd = open(p->dec.filename, O_RDONLY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        /* The kernel reads the file into the page cache in the background */
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+    int res = 0;
+    /* Probing and opening the decoder takes a while, never on the thread of the caller */
+    if (preload_decode && decode_pool != NULL && start_video_dec(&p->dec, p->dec.filename) == 0)
+    {
+        for (int i = 0; res == 0 && i < PRELOAD_MAX_PACKETS; i++)
+            res = next_frame(&p->dec);
+    }
+    /* The first frame is handed over as if prefetched */
+    p->dec.prefetch = PREFETCH_DONE;
+    p->dec.prefetch_res = res;
+
+    pthread_mutex_lock(&preloads_mtx);
+    p->busy = 0;
+    p->ready = res > 0;
+    pthread_mutex_unlock(&preloads_mtx);
+    D("Preloaded %s%s", p->dec.filename, res > 0 ? ", decoder ready" : "");
+}
+
+/**
+ * Least recently asked for preload that isn't busy, under preloads_mtx
+ * Returns the link to it, or NULL if they are all busy.
+ */
+static preload_t** preload_oldest(void)
+{
+    preload_t** oldest = NULL;
+    for (preload_t** p = &preloads; *p != NULL; p = &(*p)->next)
+    {
+        if (!(*p)->busy)
+            oldest = p;
+    }
+    return oldest;
+}
+
+/**
+ * Read a file ahead of a switch to it, and have its decoder opened in the background
+ * Files preloaded before are forgotten, from the oldest, to stay within the budget.
+ */
+void camera_capture_preload(const char* filename)
+{
+    struct stat st;
+    if (preload_budget == 0)
+        return;
+    if (stat(filename, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        W("Unable to preload %s", filename);
+        return;
+    }
+    if ((size_t) st.st_size > preload_budget)
+    {
+        W("Not preloading %s, larger than the budget of %zu bytes", filename, preload_budget);
+        return;
+    }
+
+    preload_t* evicted = NULL;
+    pthread_mutex_lock(&preloads_mtx);
+    int num = 0;
+    for (preload_t** p = &preloads; *p != NULL; p = &(*p)->next, num++)
+    {
+        if (strcmp((*p)->dec.filename, filename))
+            continue;
+        /* Already there, kept the longest now */
+        preload_t* found = *p;
+        *p = found->next;
+        found->next = preloads;
+        preloads = found;
+        pthread_mutex_unlock(&preloads_mtx);
+        return;
+    }
+    preload_t** oldest;
+    while ((preload_bytes + st.st_size > preload_budget || num >= PRELOAD_MAX_DECODERS) &&
+           (oldest = preload_oldest()) != NULL)
+    {
+        preload_t* p = *oldest;
+        *oldest = p->next;
+        preload_bytes -= p->size;
+        num--;
+        p->next = evicted;
+        evicted = p;
+    }
+    preload_t* p = NULL;
+    if (preload_bytes + st.st_size <= preload_budget && num < PRELOAD_MAX_DECODERS)
+        p = calloc(1, sizeof(preload_t));
+    if (p != NULL)
+    {
+        video_dec_init(&p->dec, filename);
+        p->size = st.st_size;
+        p->busy = 1;
+        p->job.run = preload_run;
+        p->next = preloads;
+        preloads = p;
+        preload_bytes += p->size;
+    }
+    pthread_mutex_unlock(&preloads_mtx);
+
+    while (evicted != NULL)
+    {
+        preload_t* next = evicted->next;
+        D("Forgetting the preload of %s", evicted->dec.filename);
+        preload_free(evicted);
+        evicted = next;
+    }
+    if (p == NULL)
+    {
+        W("Not preloading %s, the budget is taken by files being preloaded", filename);
+        return;
+    }
+    I("Preloading %s", filename);
+    if (decode_pool != NULL)
+        worker_pool_submit(decode_pool, &p->job);
+    else
+        preload_run(&p->job);
+}
+
+/**
+ * Take the preloaded decoder of a file, if it is ready
+ */
+static preload_t* preload_take(const char* filename)
+{
+    preload_t* found = NULL;
+    pthread_mutex_lock(&preloads_mtx);
+    for (preload_t** p = &preloads; *p != NULL; p = &(*p)->next)
+    {
+        if ((*p)->ready && !(*p)->busy && !strcmp((*p)->dec.filename, filename))
+        {
+            found = *p;
+            *p = found->next;
+            preload_bytes -= found->size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&preloads_mtx);
+    return found;
+}
+
+/**
+ * Hand the decoder of a file over to another context, stopping the one it had
+ */
+static void video_dec_take(video_dec_t* dec, video_dec_t* from)
+{
+    if (dec->fmt_ctx != NULL)
+        stop_video_dec(dec);
+    dec->fmt_ctx = from->fmt_ctx;
+    dec->video_dec_ctx = from->video_dec_ctx;
+    dec->video_stream = from->video_stream;
+    dec->video_stream_idx = from->video_stream_idx;
+    dec->frame = from->frame;
+    dec->pkt = from->pkt;
+    from->fmt_ctx = NULL;
+    from->video_dec_ctx = NULL;
+    from->frame = NULL;
+}
+
+/**
+ * Start decoding a file, stopping the previous one, from its preloaded decoder when ready
+ * The decoder must not be prefetching. Returns -1 if the file can't be decoded, the previous one
+ * is kept then.
+ */
+static int video_dec_open(video_dec_t* dec, const char* filename)
+{
+    preload_t* p = preload_take(filename);
+    if (p == NULL)
+    {
+        video_dec_t opened;
+        memset(&opened, 0, sizeof(opened));
+        if (start_video_dec(&opened, filename))
+        {
+            stop_video_dec(&opened);
+            return -1;
+        }
+        video_dec_take(dec, &opened);
+        return 0;
+    }
+
+    video_dec_take(dec, &p->dec);
+    pthread_mutex_lock(&dec->prefetch_mtx);
+    dec->prefetch = PREFETCH_DONE;
+    dec->prefetch_res = p->dec.prefetch_res;
+    pthread_mutex_unlock(&dec->prefetch_mtx);
+    /* Handed over, the preload frees nothing but itself */
+    p->dec.prefetch = PREFETCH_IDLE;
+    preload_free(p);
+    I("Using the preloaded decoder of %s", filename);
+    return 0;
+}
+
+/*******************************************************************************
+ *                     Shared sources
+ ******************************************************************************/
+
+/* Sizes and formats a shared source renders for its subscribers at most */
+#define SOURCE_MAX_OUTPUTS 4
+/* Frames a shared source decodes at most to catch up with its clock, it skips ahead beyond */
+#define SOURCE_MAX_CATCHUP 8
+/* Playback rate of the files that don't tell theirs */
+#define SOURCE_DEFAULT_FPS 25
+
+/**
+ * Frame of a shared source rendered for one size and format, with neutral adjustments
+ */
+typedef struct source_output
+{
+    uint32_t pixel_format;
+    int width;
+    int height;
+    /* Rendered frame, referenced by the subscribers copying it, and the source frame it shows */
+    AVBufferRef* buf;
+    uint64_t seq;
+    FrameScaler* scaler;
+    struct SwsContext* resize;
+} source_output_t;
+
+/**
+ * File decoded once for every camera playing it
+ * The source advances on its own clock, the frame rate of the file, whoever reads it. Each
+ * output size and format is rendered once per frame as well; subscribers with other adjustments,
+ * or beyond SOURCE_MAX_OUTPUTS, only scale and convert the shared decoded frame themselves.
+ */
+typedef struct shared_source
+{
+    struct shared_source* next;
+    /* Subscribers, under sources_mtx */
+    int refs;
+    pthread_mutex_t mtx;
+    video_dec_t dec;
+    /* Decoded frame shared with the subscribers, and its sequence number from 1 */
+    AVFrame* frame;
+    uint64_t seq;
+    /* When the first frame was shown, and the period of a frame, in microseconds */
+    uint64_t start_us;
+    uint64_t period_us;
+    source_output_t outputs[SOURCE_MAX_OUTPUTS];
+    int output_num;
+} shared_source_t;
+
+static int share_sources = 0;
+static pthread_mutex_t sources_mtx = PTHREAD_MUTEX_INITIALIZER;
+static shared_source_t* sources = NULL;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Have the cameras playing the same file share its decoding, from the next device opened
+ */
+void camera_capture_share_sources(int share)
+{
+    share_sources = share;
+}
+
+static shared_source_t* source_find(const char* filename)
+{
+    for (shared_source_t* src = sources; src != NULL; src = src->next)
+    {
+        if (!strcmp(src->dec.filename, filename))
+            return src;
+    }
+    return NULL;
+}
+
+static void source_free(shared_source_t* src)
+{
+    video_dec_free(&src->dec);
+    av_frame_free(&src->frame);
+    for (int i = 0; i < src->output_num; i++)
+    {
+        av_buffer_unref(&src->outputs[i].buf);
+        frame_scaler_free(src->outputs[i].scaler);
+        sws_freeContext(src->outputs[i].resize);
+    }
+    pthread_mutex_destroy(&src->mtx);
+    free(src);
+}
+
+/**
+ * Subscribe to the source of a file, opening it if nobody plays it yet
+ */
+static shared_source_t* source_get(const char* filename)
+{
+    pthread_mutex_lock(&sources_mtx);
+    shared_source_t* src = source_find(filename);
+    if (src != NULL)
+    {
+        src->refs++;
+        pthread_mutex_unlock(&sources_mtx);
+        D("Sharing the decoding of %s", filename);
+        return src;
+    }
+    pthread_mutex_unlock(&sources_mtx);
+
+    /* Opened without the lock, probing a file takes a while */
+    shared_source_t* created = calloc(1, sizeof(shared_source_t));
+    if (created == NULL)
+        return NULL;
+    video_dec_init(&created->dec, filename);
+    pthread_mutex_init(&created->mtx, NULL);
+    created->frame = av_frame_alloc();
+    if (created->frame == NULL || video_dec_open(&created->dec, filename))
+    {
+        source_free(created);
+        return NULL;
+    }
+    double fps = video_dec_frame_rate(&created->dec);
+    created->period_us = 1000000 / (fps > 0 ? fps : SOURCE_DEFAULT_FPS);
+    created->refs = 1;
+
+    pthread_mutex_lock(&sources_mtx);
+    src = source_find(filename);
+    if (src != NULL)
+        src->refs++;
+    else
+    {
+        created->next = sources;
+        sources = created;
+    }
+    pthread_mutex_unlock(&sources_mtx);
+    if (src != NULL)
+    {
+        source_free(created);
+        return src;
+    }
+    I("Decoding %s once for every camera playing it", filename);
+    return created;
+}
+
+static void source_put(shared_source_t* src)
+{
+    pthread_mutex_lock(&sources_mtx);
+    int last = --src->refs == 0;
+    if (last)
+    {
+        shared_source_t** prev = &sources;
+        while (*prev != src)
+            prev = &(*prev)->next;
+        *prev = src->next;
+    }
+    pthread_mutex_unlock(&sources_mtx);
+    if (last)
+        source_free(src);
+}
+
+/**
+ * Decode up to the frame due on the clock of the source, under its lock
+ */
+static void source_advance(shared_source_t* src)
+{
+    uint64_t now = now_us();
+    if (src->seq == 0)
+        src->start_us = now;
+    uint64_t due = (now - src->start_us) / src->period_us + 1;
+    if (due <= src->seq)
+        return;
+    /* Nobody read it for a while: resume from the next frame rather than decoding the gap */
+    if (due - src->seq > SOURCE_MAX_CATCHUP)
+    {
+        src->start_us = now - src->seq * src->period_us;
+        due = src->seq + 1;
+    }
+    while (src->seq < due)
+    {
+        int res = prefetch_wait(&src->dec);
+        if (res <= 0)
+            decode_frame(&src->dec);
+        src->seq++;
+        if (src->seq < due)
+            continue;
+        av_frame_unref(src->frame);
+        av_frame_ref(src->frame, src->dec.frame);
+    }
+    /* The next frame is decoded while this one is rendered and sent */
+    prefetch_start(&src->dec);
+}
+
+/**
+ * Output of the source for a size and format, rendered from the current frame, under its lock
+ * Returns a reference to the rendered frame, or NULL when the source has no room for another
+ * output, or when ffmpeg lays it out in more bytes than the client framebuffer takes.
+ */
+static AVBufferRef* source_output(shared_source_t* src, uint32_t pixel_format, int width,
+                                  int height)
+{
+    /* Odd dimensions round the chroma planes up */
+    int size = avpicture_get_size(av_pixel_format(pixel_format), width, height);
+    if (size < 0 || (size_t) size != fb_size(pixel_format, width, height))
+        return NULL;
+    source_output_t* out = NULL;
+    for (int i = 0; i < src->output_num && out == NULL; i++)
+    {
+        if (src->outputs[i].pixel_format == pixel_format && src->outputs[i].width == width &&
+            src->outputs[i].height == height)
+            out = &src->outputs[i];
+    }
+    if (out == NULL)
+    {
+        if (src->output_num == SOURCE_MAX_OUTPUTS)
+            return NULL;
+        out = &src->outputs[src->output_num++];
+        out->pixel_format = pixel_format;
+        out->width = width;
+        out->height = height;
+    }
+    if (out->buf == NULL || out->seq != src->seq)
+    {
+        /* Subscribers may still be copying the previous frame */
+        if (out->buf != NULL && !av_buffer_is_writable(out->buf))
+            av_buffer_unref(&out->buf);
+        if (out->buf == NULL)
+            out->buf = av_buffer_alloc(size);
+        if (out->buf == NULL)
+            return NULL;
+        PlanarFrame planar;
+        ClientFrameBuffer fb = {pixel_format, out->buf->data, width, height};
+        if (planar_frame(src->frame, &planar) ||
+            !has_scaling_converter(planar.pixel_format, pixel_format) ||
+            (out->scaler = frame_scaler_get(out->scaler, planar.width, planar.height, width,
+                                            height)) == NULL ||
+            frame_scaler_convert(out->scaler, &planar, &fb, 1, 1.0f, 1.0f, 1.0f, 1.0f))
+            resize(&out->resize, src->frame, &fb, width, height);
+        out->seq = src->seq;
+    }
+    return av_buffer_ref(out->buf);
+}
+
+/**
+ * Read the current frame of the source of a device
+ * The outputs shared with other subscribers are copied, the framebuffers with adjustments of
+ * their own are rendered from the shared decoded frame, out of the lock of the source.
+ */
+static int source_read_frame(video_dec_t* dec, ClientFrameBuffer* framebuffers, int fbs_num,
+                             float r_scale, float g_scale, float b_scale, float exp_comp)
+{
+    shared_source_t* src = dec->source;
+    int neutral = r_scale == 1.0f && g_scale == 1.0f && b_scale == 1.0f && exp_comp == 1.0f;
+    AVBufferRef* shared[fbs_num > 0 ? fbs_num : 1];
+    ClientFrameBuffer own[fbs_num > 0 ? fbs_num : 1];
+    int own_num = 0;
+    AVFrame* frame = NULL;
+
+    pthread_mutex_lock(&src->mtx);
+    source_advance(src);
+    for (int i = 0; i < fbs_num; i++)
+    {
+        int width, height;
+        fb_dim(dec, &framebuffers[i], &width, &height);
+        shared[i] = neutral ? source_output(src, framebuffers[i].pixel_format, width, height)
+                            : NULL;
+        if (shared[i] == NULL)
+            own[own_num++] = framebuffers[i];
+    }
+    if (own_num && (frame = av_frame_alloc()) != NULL && av_frame_ref(frame, src->frame))
+        av_frame_free(&frame);
+    pthread_mutex_unlock(&src->mtx);
+
+    for (int i = 0; i < fbs_num; i++)
+    {
+        int width, height;
+        if (shared[i] == NULL)
+            continue;
+        fb_dim(dec, &framebuffers[i], &width, &height);
+        size_t size = fb_size(framebuffers[i].pixel_format, width, height);
+        memcpy(framebuffers[i].framebuffer, shared[i]->data,
+               size < (size_t) shared[i]->size ? size : (size_t) shared[i]->size);
+        av_buffer_unref(&shared[i]);
+    }
+    if (own_num && frame == NULL)
+        return -1;
+    if (own_num)
+        render_frame(dec, frame, own, own_num, r_scale, g_scale, b_scale, exp_comp);
+    av_frame_free(&frame);
+    return 0;
+}
+
+/*******************************************************************************
+ *                     CameraDevice API
+ ******************************************************************************/
+
+/**
+ * Open a device playing the given file, or the default one if NULL
+ */
+CameraDevice* camera_device_open_file(const char* filename)
 {
     I("Opening device");
     CameraDevice* cam = (CameraDevice*) malloc(sizeof(CameraDevice));
     video_dec_t* decoding_context = (video_dec_t*) calloc(1, sizeof(video_dec_t));
     cam->opaque = (void*) decoding_context;
-    start_video_dec((video_dec_t*) cam->opaque, camera_filename);
+    video_dec_init(decoding_context, filename != NULL ? filename : default_filename);
+    if (share_sources)
+        decoding_context->source = source_get(decoding_context->filename);
+    /* Without a shared source, the device decodes on its own */
+    if (decoding_context->source == NULL)
+        video_dec_open(decoding_context, decoding_context->filename);
     return cam;
 }
 
+CameraDevice* camera_device_open(const char* name, int inp_channel)
+{
+    return camera_device_open_file(NULL);
+}
+
 int camera_device_start_capturing(CameraDevice* ccd, uint32_t pixel_format, int frame_width,
                                   int frame_height)
 {
@@ -215,75 +1149,88 @@ int camera_device_read_frame(CameraDevice* ccd, ClientFrameBuffer* framebuffers,
                              float r_scale, float g_scale, float b_scale, float exp_comp)
 {
     video_dec_t* dec = (video_dec_t*) ccd->opaque;
-    int res = next_frame(dec);
+    if (dec->source != NULL)
+        return source_read_frame(dec, framebuffers, fbs_num, r_scale, g_scale, b_scale, exp_comp);
+    int res = prefetch_wait(dec);
     if (res <= 0)
-    {
-        stop_video_dec(dec);
-        start_video_dec(dec, camera_filename);
-        while (res <= 0)
-            res = next_frame(dec);
-    }
+        res = decode_frame(dec);
     if (res > 0)
-    {
-        int init_fb = 0;
-        do
-        {
-            resize(dec, (framebuffers + init_fb)->pixel_format,
-                   (framebuffers + init_fb)->framebuffer);
-        } while (init_fb + 1 < fbs_num);
-    }
+        render_frame(dec, dec->frame, framebuffers, fbs_num, r_scale, g_scale, b_scale, exp_comp);
+    /* The frame is out of the decoder, the next one is decoded while this one is sent */
+    prefetch_start(dec);
     return !res;
 }
 
+double camera_device_get_frame_rate(CameraDevice* ccd)
+{
+    video_dec_t* dec = (video_dec_t*) ccd->opaque;
+    if (dec->source != NULL)
+        return 1000000.0 / dec->source->period_us;
+    prefetch_wait(dec);
+    return video_dec_frame_rate(dec);
+}
+
 void camera_device_close(CameraDevice* ccd)
 {
     I("Closing device");
-    stop_video_dec((video_dec_t*) ccd->opaque);
+    video_dec_t* dec = (video_dec_t*) ccd->opaque;
+    if (dec->source != NULL)
+        source_put(dec->source);
+    video_dec_free(dec);
     free(ccd->opaque);
     ccd->opaque = NULL;
     return;
 }
 
-int enumerate_camera_devices(CameraInfo* cis, int max)
+/**
+ * Every camera plays files, there are as many of them as asked for
+ * The first one faces back, the others front.
+ */
+int enumerate_camera_devices(CameraInfo* cis, int max, arena_t* arena)
 {
-    cis[0].display_name = "toto";
-    cis[0].device_name = "toto";
-    char* direction = malloc(6);
-    strncpy(direction, "back", 6);
-    cis[0].direction = direction;
-    CameraFrameDim* fdim = malloc(sizeof(CameraFrameDim));
-    fdim->width = 640;
-    fdim->height = 480;
-    cis[0].frame_sizes = fdim;
-    cis[0].frame_sizes_num = 1;
-    cis[0].pixel_format = V4L2_PIX_FMT_YUV420;
-
-    return 1;
+    for (int i = 0; i < max; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), i ? "toto%d" : "toto", i);
+        cis[i].display_name = arena_strdup(arena, name);
+        cis[i].device_name = arena_strdup(arena, name);
+        cis[i].direction = arena_strdup(arena, i ? "front" : "back");
+        CameraFrameDim* fdim = arena_alloc(arena, sizeof(CameraFrameDim));
+        fdim->width = 640;
+        fdim->height = 480;
+        cis[i].frame_sizes = fdim;
+        cis[i].frame_sizes_num = 1;
+        cis[i].pixel_format = V4L2_PIX_FMT_YUV420;
+    }
+    return max;
 }
 
 /**
- * Called from AMQP thread
- * changes the filename and resets video state
- * The mutex ensures no other operations are done on video state until anything is complete.
+ * Have a device play another file, from its start
+ * Callers serialize this with the other operations on the device. Returns -1 if the file doesn't
+ * exist or can't be decoded, the device keeps playing the previous one then.
  */
-void switch_video_files(CameraDevice* cd, const char* const filename)
+int camera_device_switch_file(CameraDevice* cd, const char* filename)
 {
-    pthread_mutex_lock(&dec_mtx);
-    if (access(filename, F_OK) != -1)
-    {
-        strncpy(camera_filename, filename, sizeof(camera_filename));
-        if (cd != NULL)
-        {
-            video_dec_t* ctx = (video_dec_t*) cd->opaque;
-            stop_video_dec(ctx);
-            start_video_dec(ctx, camera_filename);
-            I("Camera file name changed to %s", filename);
-        }
-    }
-    else
+    if (access(filename, F_OK) == -1)
+        return -1;
+    video_dec_t* ctx = (video_dec_t*) cd->opaque;
+    if (ctx->source != NULL)
     {
-        W("File %s not found, resetting to default", filename);
-        strncpy(camera_filename, default_filename, sizeof(camera_filename));
+        shared_source_t* src = source_get(filename);
+        if (src == NULL)
+            return -1;
+        source_put(ctx->source);
+        ctx->source = src;
+        snprintf(ctx->filename, sizeof(ctx->filename), "%s", filename);
+        I("Camera file name changed to %s", filename);
+        return 0;
     }
-    pthread_mutex_unlock(&dec_mtx);
+    /* A frame prefetched from the previous file is dropped */
+    prefetch_wait(ctx);
+    if (video_dec_open(ctx, filename))
+        return -1;
+    snprintf(ctx->filename, sizeof(ctx->filename), "%s", filename);
+    I("Camera file name changed to %s", filename);
+    return 0;
 }
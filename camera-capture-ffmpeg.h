@@ -6,6 +6,12 @@
 #include <libavutil/samplefmt.h>
 #include <libavformat/avformat.h>
 #include "camera-common.h"
+#include "worker_pool.h"
 
-void switch_video_files(CameraDevice* cd, const char* const filename);
+CameraDevice* camera_device_open_file(const char* filename);
+int camera_device_switch_file(CameraDevice* cd, const char* filename);
+void camera_capture_set_pool(worker_pool_t* pool);
+void camera_capture_share_sources(int share);
+void camera_capture_set_preload(size_t budget, int decode);
+void camera_capture_preload(const char* filename);
 #endif
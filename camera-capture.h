@@ -91,6 +91,15 @@ extern int camera_device_read_frame(CameraDevice* cd,
                                     float b_scale,
                                     float exp_comp);
 
+/* Gets the rate at which the camera device produces frames.
+ * Param:
+ *  cd - Camera descriptor representing a camera device opened in
+ *    camera_device_open routine.
+ * Return:
+ *  Frames per second, or 0 if unknown.
+ */
+extern double camera_device_get_frame_rate(CameraDevice* cd);
+
 /* Closes camera device, opened in camera_device_open routine.
  * Param:
  *  cd - Camera descriptor representing a camera device opened in
@@ -98,6 +107,8 @@ extern int camera_device_read_frame(CameraDevice* cd,
  */
 extern void camera_device_close(CameraDevice* cd);
 
+struct arena;
+
 /* Enumerates camera devices connected to the host, and collects information
  * about each device.
  * Apparently, camera framework in the guest will only accept the the YV12
@@ -111,12 +122,14 @@ extern void camera_device_close(CameraDevice* cd);
  *  cis - An allocated array where to store informaion about found camera
  *      devices. For each found camera device an entry will be initialized in the
  *      array. It's responsibility of the caller to free the memory allocated for
- *      the entries.
+ *      the entries, unless they come from an arena.
  *  max - Maximum number of entries that can fit into the array.
+ *  arena - Arena to allocate the entries from, or NULL to use malloc.
  * Return:
  *  Number of entries added to the 'cis' array on success, or < 0 on failure.
  */
-extern int enumerate_camera_devices(CameraInfo* cis, int max);
+extern int enumerate_camera_devices(CameraInfo* cis, int max,
+                                    struct arena* arena);
 
 #endif  /* ANDROID_CAMERA_CAMERA_CAPTURE_H */
 // clang-format on
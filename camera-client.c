@@ -0,0 +1,520 @@
+/*
+ * Stand-in for the camera emulator of the guest, to exercise the daemon without a VM
+ * The daemon connects to the VM, so this listens on the camera port: run the daemon with
+ * AIC_PLAYER_VM_HOST=127.0.0.1, then queries frames the way the guest does and reports the
+ * throughput. With AIC_PLAYER_LISTEN=1, this connects to the daemon instead.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame_proto.h"
+#include "net_pack.h"
+#include "shm_ring.h"
+
+/* V4L2_PIX_FMT_YUV420 */
+#define PIX_YUV420 0x32315559
+/* Receive buffer of a slow reader, small enough for the daemon to feel it */
+#define SLOW_RCVBUF (64 * 1024)
+
+/* Bytes per second replies are read at, 0 for as fast as they come */
+static long read_rate = 0;
+
+typedef struct client
+{
+    int sock;
+    char* reply;
+    size_t reply_size;
+    /* Last reply carried a frame */
+    int frame;
+    /* Binary frame requests negotiated, and the sequence number of the last one */
+    int binary;
+    uint32_t seq;
+    /* Shared memory slot of the last binary reply */
+    int slot;
+    /* Shared memory frame ring, when used, and frames rewritten while read out of it */
+    uint8_t* shm;
+    size_t shm_size;
+    int torn;
+} client_t;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int wait_daemon(int port)
+{
+    int yes = 1;
+    struct sockaddr_in addr = {0};
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(lsock, (struct sockaddr*) &addr, sizeof(addr)) || listen(lsock, 1))
+    {
+        perror("listen");
+        return -1;
+    }
+    printf("Waiting for the daemon on port %d\n", port);
+    int sock = accept(lsock, NULL, NULL);
+    close(lsock);
+    if (sock != -1)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return sock;
+}
+
+/**
+ * Connect to a daemon in listen mode, trying again until it is up
+ */
+static int connect_daemon(const char* host, int port)
+{
+    int yes = 1;
+    char service[8];
+    struct addrinfo hints = {0};
+    struct addrinfo* result;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &result))
+    {
+        fprintf(stderr, "Unable to resolve %s\n", host);
+        return -1;
+    }
+    printf("Connecting to the daemon at %s:%d\n", host, port);
+    int sock = -1;
+    while (sock == -1)
+    {
+        sock = socket(result->ai_family, SOCK_STREAM, 0);
+        if (connect(sock, result->ai_addr, result->ai_addrlen) == -1)
+        {
+            close(sock);
+            sock = -1;
+            usleep(1000);
+        }
+    }
+    freeaddrinfo(result);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return sock;
+}
+
+static int read_all(int sock, void* buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        /* A slow reader takes a bit at a time, and waits as long as the rate asks for it */
+        size_t chunk = read_rate && len - got > SLOW_RCVBUF / 4 ? SLOW_RCVBUF / 4 : len - got;
+        ssize_t rec = recv(sock, (char*) buf + got, chunk, 0);
+        if (rec <= 0)
+            return -1;
+        got += rec;
+        if (read_rate)
+            usleep(rec * 1000000LL / read_rate);
+    }
+    return 0;
+}
+
+static int read_payload(client_t* c, size_t size)
+{
+    if (size > c->reply_size)
+    {
+        c->reply = realloc(c->reply, size);
+        c->reply_size = size;
+    }
+    return read_all(c->sock, c->reply, size);
+}
+
+/**
+ * Read the rest of a binary frame reply, whose first bytes are in hdr
+ */
+static long binary_reply(client_t* c, unsigned char* hdr)
+{
+    if (read_all(c->sock, hdr + 8, FRAME_REPLY_SIZE - 8))
+        return -1;
+    c->slot = unpacki32(hdr + 24);
+    /* Frames in a shared memory slot don't follow the header */
+    size_t frames_size = c->slot == -1 ? unpacku32(hdr + 16) + unpacku32(hdr + 20) : 0;
+    size_t msg_size = unpacku32(hdr + 28);
+    if (read_payload(c, frames_size + msg_size))
+        return -1;
+    if (hdr[1] != FRAME_STATUS_OK)
+    {
+        fprintf(stderr, "Frame %lu failed: %.*s\n", unpacku32(hdr + 4), (int) msg_size,
+                c->reply + frames_size);
+        return -1;
+    }
+    c->frame = 1;
+    return frames_size;
+}
+
+/**
+ * Read a reply into c->reply
+ * Returns the reply size, or -1 on failure or "ko" reply.
+ */
+static long reply(client_t* c, const char* q)
+{
+    unsigned char hdr[FRAME_REPLY_SIZE] = {0};
+    if (read_all(c->sock, hdr, 8))
+        return -1;
+    if (c->binary && hdr[0] == FRAME_PROTO_MARKER)
+        return binary_reply(c, hdr);
+    size_t size = strtoul((char*) hdr, NULL, 16);
+    if (read_payload(c, size))
+        return -1;
+    if (size < 3 || strncmp(c->reply, "ok", 2))
+    {
+        fprintf(stderr, "'%s' failed: %.*s\n", q, (int) size, c->reply);
+        return -1;
+    }
+    c->frame = c->reply[2] == ':';
+    return size;
+}
+
+static int send_query(client_t* c, const char* q)
+{
+    return send(c->sock, q, strlen(q) + 1, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static long query(client_t* c, const char* q)
+{
+    if (send_query(c, q))
+        return -1;
+    return reply(c, q);
+}
+
+/**
+ * Send a frame query, as a binary request when negotiated
+ */
+static int send_frame_query(client_t* c, const char* q, size_t video_size, size_t preview_size)
+{
+    if (!c->binary)
+        return send_query(c, q);
+    unsigned char req[FRAME_REQUEST_SIZE] = {FRAME_PROTO_MARKER};
+    packi32(req + 4, ++c->seq);
+    packi32(req + 8, video_size);
+    packi32(req + 12, preview_size);
+    /* Neutral white balance and exposure compensation */
+    for (int i = 16; i < FRAME_REQUEST_SIZE; i += 4)
+        packi32(req + i, pack754_32(1.0f));
+    return send(c->sock, req, sizeof(req), MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static int map_shm(client_t* c)
+{
+    char path[64];
+    int slots;
+    size_t size;
+    if (query(c, "shm") < 0 ||
+        sscanf(c->reply + 3, "path=%63s slots=%d size=%zu", path, &slots, &size) != 3)
+        return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    c->shm_size = lseek(fd, 0, SEEK_END);
+    c->shm = mmap(NULL, c->shm_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c->shm == MAP_FAILED || ((shm_ring_header_t*) c->shm)->magic != SHM_RING_MAGIC)
+    {
+        fprintf(stderr, "Unable to map the frame ring %s\n", path);
+        return -1;
+    }
+    printf("Frames through %s, %d slots of %zu bytes\n", path, slots, size);
+    return 0;
+}
+
+/**
+ * Get a frame out of its shared memory slot, touching it like a guest copy would
+ * A frame the daemon rewrites meanwhile is counted as torn, as the sequence lock of the slot tells.
+ */
+static int read_slot(client_t* c, uint32_t* sum)
+{
+    int slot = c->slot;
+    if (!c->binary && sscanf(c->reply + 3, "slot=%d", &slot) != 1)
+        return -1;
+    const shm_ring_header_t* hdr = (const shm_ring_header_t*) c->shm;
+    const shm_slot_header_t* sh = (const shm_slot_header_t*) (hdr + 1) + slot;
+    uint32_t seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0)
+        return -1;
+    const uint8_t* data = c->shm + hdr->data_offset + slot * hdr->slot_size;
+    uint32_t frame_sum = 0;
+    for (size_t i = 0; !(seq & 1) && i < sh->video_size + sh->preview_size; i += 64)
+        frame_sum += data[i];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((seq & 1) || __atomic_load_n(&sh->seq, __ATOMIC_RELAXED) != seq)
+        c->torn++;
+    else
+        *sum += frame_sum;
+    return 0;
+}
+
+/**
+ * Open the control connection of the camera, on the port of the camera plus 7800
+ */
+static int open_control(const char* host, int port)
+{
+    return host != NULL ? connect_daemon(host, port + 7800) : wait_daemon(port + 7800);
+}
+
+/**
+ * Have the daemon play another file, the way the VM does
+ */
+static int send_switch(int sock, const char* filename)
+{
+    unsigned char buf[256];
+    if (strlen(filename) + 3 > sizeof(buf))
+        return -1;
+    unsigned int len = pack(buf, "s", filename);
+    return send(sock, buf, len, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+ * Have the daemon read a file ahead of a switch to it
+ */
+static int send_preload(int sock, const char* filename)
+{
+    unsigned char buf[256];
+    if (strlen(filename) + 12 > sizeof(buf))
+        return -1;
+    unsigned int len = pack(buf, "ss", "preload", filename);
+    return send(sock, buf, len, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/**
+ * Get the switches the daemon applied so far for the camera, how long the last one took, and how
+ * many of them failed
+ */
+static int switch_stats(client_t* c, unsigned long long* applied, unsigned long long* latency_us,
+                        unsigned long long* failed)
+{
+    long size = query(c, "stats");
+    if (size < 0)
+        return -1;
+    char stats[512];
+    snprintf(stats, sizeof(stats), "%.*s", (int) size, c->reply);
+    const char* field = strstr(stats, "switches_applied=");
+    if (field == NULL ||
+        sscanf(field, "switches_applied=%llu switch_latency_us=%llu switches_failed=%llu",
+               applied, latency_us, failed) != 3)
+    {
+        fprintf(stderr, "The daemon doesn't report file switches\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [-p port] [-c host] [-n frames] [-d WxH] [-q depth] [-r KB/s] [-w file] "
+            "[-l] [-L ms] [-b] [-m] [-s]\n"
+            "  -p  port the daemon connects to (24800)\n"
+            "  -c  connect to the daemon at host, in listen mode\n"
+            "  -n  number of frames to query (300)\n"
+            "  -d  frame dimensions (640x480)\n"
+            "  -q  number of frame queries kept in flight (1)\n"
+            "  -r  read replies at this rate, in KB/s, like a slow guest\n"
+            "  -w  switch to this file halfway, through the control connection\n"
+            "  -l  have the file of -w preloaded when starting\n"
+            "  -L  fail when the switch of -w takes longer than this to be applied, in ms\n"
+            "  -b  use binary frame requests\n"
+            "  -m  transfer frames through shared memory\n"
+            "  -s  have the frames pushed instead of querying each of them\n",
+            name);
+}
+
+int main(int argc, char** argv)
+{
+    int port = 24800, frames = 300, width = 640, height = 480, use_shm = 0, stream = 0;
+    int depth = 1, binary = 0, opt;
+    const char* host = NULL;
+    const char* switch_file = NULL;
+    int preload = 0;
+    long max_switch_ms = -1;
+    while ((opt = getopt(argc, argv, "p:c:n:d:q:r:w:lL:bms")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            host = optarg;
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'd':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            if (depth < 1)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            read_rate = atol(optarg) * 1000;
+            break;
+        case 'w':
+            switch_file = optarg;
+            break;
+        case 'l':
+            preload = 1;
+            break;
+        case 'L':
+            max_switch_ms = atol(optarg);
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 'm':
+            use_shm = 1;
+            break;
+        case 's':
+            stream = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    client_t c = {0};
+    int64_t up = now_us();
+    c.sock = host != NULL ? connect_daemon(host, port) : wait_daemon(port);
+    if (c.sock == -1)
+        return 1;
+    if (read_rate)
+    {
+        int rcvbuf = SLOW_RCVBUF;
+        setsockopt(c.sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    int ctrl = switch_file != NULL ? open_control(host, port) : -1;
+    if (switch_file != NULL && ctrl == -1)
+        return 1;
+    if (preload && ctrl != -1 && send_preload(ctrl, switch_file))
+        return 1;
+
+    char q[128];
+    size_t video_size = width * height * 3 / 2, preview_size = width * height * 4;
+    snprintf(q, sizeof(q), "start dim=%dx%d pix=%d", width, height, PIX_YUV420);
+    if (query(&c, binary ? "connect version=1" : "connect") < 0)
+        return 1;
+    if (binary && strncmp(c.reply, "ok:version=1", 12))
+    {
+        fprintf(stderr, "The daemon doesn't support binary frame requests\n");
+        return 1;
+    }
+    c.binary = binary;
+    if (query(&c, q) < 0 || (use_shm && map_shm(&c)))
+        return 1;
+    /* The daemon counts the switches of the camera since it started, not since this connected */
+    unsigned long long applied_before = 0, applied, latency_us, failed_before = 0, failed;
+    if (ctrl != -1 && switch_stats(&c, &applied_before, &latency_us, &failed_before))
+        return 1;
+
+    snprintf(q, sizeof(q), "%s video=%zu preview=%zu whiteb=1,1,1 expcomp=1",
+             stream ? "stream" : "frame", video_size, preview_size);
+    uint32_t sum = 0;
+    int64_t start = now_us();
+    if (stream)
+    {
+        long size = query(&c, q);
+        if (size < 0)
+            return 1;
+        printf("Streaming at %.*s\n", (int) size - 3, c.reply + 3);
+    }
+    /* Pipelining: a query goes out as soon as a reply is in, keeping depth of them in flight */
+    int sent = 0;
+    for (; !stream && sent < depth && sent < frames; sent++)
+    {
+        if (send_frame_query(&c, q, video_size, preview_size))
+            return 1;
+    }
+    for (int i = 0; i < frames; i++)
+    {
+        if (reply(&c, q) < 0 || (use_shm && read_slot(&c, &sum)))
+            return 1;
+        if (i == 0)
+            printf("First frame %.1f ms after starting\n", (now_us() - up) / 1e3);
+        /* The daemon applies the switch right away, however slowly frames are read */
+        if (ctrl != -1 && i == frames / 2)
+        {
+            if (send_switch(ctrl, switch_file))
+                return 1;
+            printf("Switched to %s %.1f ms after starting\n", switch_file,
+                   (now_us() - up) / 1e3);
+        }
+        if (!stream && sent < frames)
+        {
+            if (send_frame_query(&c, q, video_size, preview_size))
+                return 1;
+            sent++;
+        }
+    }
+    int64_t elapsed = now_us() - start;
+
+    if (stream)
+    {
+        /* Skip the frames pushed until the stop went through, its reply has no data */
+        send(c.sock, "stop", 5, MSG_NOSIGNAL);
+        while (reply(&c, "stop") >= 0 && c.frame)
+            ;
+        long size = query(&c, "stats");
+        if (size > 3)
+            printf("Delivery: %.*s\n", (int) size - 3, c.reply + 3);
+    }
+    int switch_failed = 0;
+    if (ctrl != -1)
+    {
+        if (switch_stats(&c, &applied, &latency_us, &failed))
+            return 1;
+        if (applied == applied_before)
+        {
+            printf("Switch to %s not applied\n", switch_file);
+            switch_failed = 1;
+        }
+        else if (failed != failed_before)
+        {
+            printf("Switch to %s failed, the daemon couldn't play it\n", switch_file);
+            switch_failed = 1;
+        }
+        else
+        {
+            printf("Switch applied %.1f ms after it was received\n", latency_us / 1e3);
+            switch_failed = max_switch_ms >= 0 && latency_us > max_switch_ms * 1000ULL;
+        }
+    }
+    if (!stream)
+        query(&c, "stop");
+    query(&c, "disconnect");
+    double secs = elapsed / 1e6;
+    printf("%d frames in %.3f s: %.1f fps, %.1f MB/s (%u)\n", frames, secs, frames / secs,
+           frames * (video_size + preview_size) / secs / 1e6, sum);
+    if (c.torn)
+        printf("%d frames rewritten while read out of shared memory\n", c.torn);
+    return switch_failed;
+}
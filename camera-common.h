@@ -84,9 +84,29 @@
 #ifndef V4L2_PIX_FMT_SRGGB12
 #define V4L2_PIX_FMT_SRGGB12 v4l2_fourcc('R', 'G', '1', '2')
 #endif  /* V4L2_PIX_FMT_SRGGB12 */
+#ifndef V4L2_PIX_FMT_P010
+#define V4L2_PIX_FMT_P010    v4l2_fourcc('P', '0', '1', '0')
+#endif  /* V4L2_PIX_FMT_P010 */
+
+/*
+ * High bit depth planar 4:2:0 formats produced by video decoders have no V4L2
+ * fourcc. Use the ones libavcodec uses for raw YUV420P10LE / YUV420P12LE.
+ */
+
+#ifndef V4L2_PIX_FMT_YUV420P10
+#define V4L2_PIX_FMT_YUV420P10 v4l2_fourcc('Y', '3', 11, 10)
+#endif  /* V4L2_PIX_FMT_YUV420P10 */
+#ifndef V4L2_PIX_FMT_YUV420P12
+#define V4L2_PIX_FMT_YUV420P12 v4l2_fourcc('Y', '3', 11, 12)
+#endif  /* V4L2_PIX_FMT_YUV420P12 */
 
 typedef struct QemudClient {
     int socket;
+    /* Zero-copy send state of the connection, or NULL. */
+    struct zerocopy* zerocopy;
+    /* Queue replies are sent from without blocking, or NULL to send them
+     * right away. */
+    struct send_queue* sendq;
 } QemudClient;
 
 typedef struct QemudService {
@@ -107,6 +127,11 @@ typedef struct ClientFrameBuffer {
     uint32_t    pixel_format;
     /* Address of the client framebuffer. */
     void*       framebuffer;
+    /* Dimensions of the client framebuffer. Zero means the dimensions the
+     * capture has been started with. Only capture backends that scale the
+     * frames can fill framebuffers of other dimensions. */
+    int         width;
+    int         height;
 } ClientFrameBuffer;
 
 /* Describes frame dimensions.
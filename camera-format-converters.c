@@ -427,6 +427,7 @@ _change_white_balance_RGB_b(uint8_t* r,
 typedef struct RGBDesc RGBDesc;
 typedef struct YUVDesc YUVDesc;
 typedef struct BayerDesc BayerDesc;
+typedef struct YUV16Desc YUV16Desc;
 
 /* Prototype for a routine that loads RGB colors from an RGB/BRG stream.
  * Param:
@@ -536,6 +537,21 @@ struct BayerDesc {
     int         mask;
 };
 
+/* High bit depth YUV 4:2:0 format descriptor. Samples are stored in 16 bit
+ * words, in a Y pane followed either by separate U and V panes, or by an
+ * interleaved UV pane. */
+struct YUV16Desc {
+    /* Number of low bits to drop to get an 8 bit sample:
+     *  - 2 for a 10-bit format with samples in the low bits of the words
+     *  - 4 for a 12-bit format with samples in the low bits of the words
+     *  - 8 for a format with samples in the high bits of the words (P010)
+     */
+    int         shift;
+    /* Boolean: 1 if U and V samples are interleaved in a single UV pane, or
+     * 0 if U and V panes are separate, U pane first. */
+    int         uv_interleaved;
+};
+
 /********************************************************************************
  * RGB/BRG load / save routines.
  *******************************************************************************/
@@ -625,7 +641,7 @@ static const void*
 _load_RGB16(const void* rgb, uint8_t* r, uint8_t* g, uint8_t* b)
 {
     const uint16_t rgb16 = *(const uint16_t*)rgb;
-    *r = R16(rgb16); *g = G16(rgb16); *b = B16(rgb16);
+    *r = R16_32(rgb16); *g = G16_32(rgb16); *b = B16_32(rgb16);
     return (const uint8_t*)rgb + 2;
 }
 
@@ -633,7 +649,7 @@ _load_RGB16(const void* rgb, uint8_t* r, uint8_t* g, uint8_t* b)
 static void*
 _save_RGB16(void* rgb, uint8_t r, uint8_t g, uint8_t b)
 {
-    *(uint16_t*)rgb = RGB565(r & 0x1f, g & 0x3f, b & 0x1f);
+    *(uint16_t*)rgb = RGB565(r >> 3, g >> 2, b >> 3);
     return (uint8_t*)rgb + 2;
 }
 
@@ -642,7 +658,7 @@ static const void*
 _load_BRG16(const void* rgb, uint8_t* r, uint8_t* g, uint8_t* b)
 {
     const uint16_t rgb16 = *(const uint16_t*)rgb;
-    *r = B16(rgb16); *g = G16(rgb16); *b = R16(rgb16);
+    *r = B16_32(rgb16); *g = G16_32(rgb16); *b = R16_32(rgb16);
     return (const uint8_t*)rgb + 2;
 }
 
@@ -650,7 +666,7 @@ _load_BRG16(const void* rgb, uint8_t* r, uint8_t* g, uint8_t* b)
 static void*
 _save_BRG16(void* rgb, uint8_t r, uint8_t g, uint8_t b)
 {
-    *(uint16_t*)rgb = RGB565(b & 0x1f, g & 0x3f, r & 0x1f);
+    *(uint16_t*)rgb = RGB565(b >> 3, g >> 2, r >> 3);
     return (uint8_t*)rgb + 2;
 }
 
@@ -993,10 +1009,125 @@ _get_bayerRGB(const BayerDesc* desc,
     }
 }
 
+/********************************************************************************
+ * High bit depth YUV routines.
+ *******************************************************************************/
+
+/* Chroma dimension for the given luma dimension in a 4:2:0 frame. */
+#define CHROMA_DIM(dim) (((dim) + 1) / 2)
+
+/* Reduces a high bit depth sample to 8 bits, rounding to the nearest value.
+ * Param:
+ *  sample - Sample to reduce.
+ *  shift - Number of low bits to drop (see YUV16Desc).
+ * Return:
+ *  8 bit sample.
+ */
+static __inline__ uint8_t
+_reduce_sample(uint16_t sample, int shift)
+{
+    const int v = (sample + (1 << (shift - 1))) >> shift;
+    return (uint8_t)(v > 255 ? 255 : v);
+}
+
+/* Reduces a line of high bit depth samples to 8 bits.
+ * Iterations don't depend on each other, so the compiler vectorises this loop.
+ * Param:
+ *  dst - Line buffer where to save 8 bit samples.
+ *  src - High bit depth samples.
+ *  shift - Number of low bits to drop (see YUV16Desc).
+ *  num - Number of samples in the line.
+ */
+static void
+_reduce_line(uint8_t* dst, const uint16_t* src, int shift, int num)
+{
+    const int round = 1 << (shift - 1);
+    int n;
+    for (n = 0; n < num; n++) {
+        const int v = (src[n] + round) >> shift;
+        dst[n] = (uint8_t)(v > 255 ? 255 : v);
+    }
+}
+
+/* Reduces a line of an interleaved high bit depth UV pane to separate lines of
+ * 8 bit U and V samples.
+ * Param:
+ *  U, V - Line buffers where to save 8 bit U and V samples.
+ *  uv - Interleaved high bit depth U and V samples.
+ *  shift - Number of low bits to drop (see YUV16Desc).
+ *  num - Number of U/V sample pairs in the line, CHROMA_DIM of the frame
+ *      width: the last pair of an odd width line covers a single pixel.
+ */
+static void
+_reduce_line_UV(uint8_t* U, uint8_t* V, const uint16_t* uv, int shift, int num)
+{
+    const int round = 1 << (shift - 1);
+    int n;
+    for (n = 0; n < num; n++) {
+        const int u = (uv[2 * n] + round) >> shift;
+        const int v = (uv[2 * n + 1] + round) >> shift;
+        U[n] = (uint8_t)(u > 255 ? 255 : u);
+        V[n] = (uint8_t)(v > 255 ? 255 : v);
+    }
+}
+
+/* Gets U and V samples for a line of a high bit depth YUV 4:2:0 frame.
+ * Param:
+ *  desc - Frame format descriptor.
+ *  yuv - Frame.
+ *  line - Zero-based line number.
+ *  width, height - Frame dimensions.
+ *  pU, pV - Upon return contain addresses of the first U, and V samples.
+ * Return:
+ *  Increment between adjacent U/V samples.
+ */
+static int
+_get_YUV16_UV(const YUV16Desc* desc,
+              const void* yuv,
+              int line,
+              int width,
+              int height,
+              const uint16_t** pU,
+              const uint16_t** pV)
+{
+    const uint16_t* uv = (const uint16_t*)yuv + width * height;
+    const int cw = CHROMA_DIM(width);
+    if (desc->uv_interleaved) {
+        *pU = uv + (line / 2) * cw * 2;
+        *pV = *pU + 1;
+        return 2;
+    }
+    *pU = uv + (line / 2) * cw;
+    *pV = *pU + CHROMA_DIM(height) * cw;
+    return 1;
+}
+
 /********************************************************************************
  * Generic YUV/RGB/BAYER converters
  *******************************************************************************/
 
+/*
+ * The generic converters convert a range of lines [y_start, y_end) of a frame,
+ * so that a frame can be converted into several framebuffers one strip of lines
+ * at a time (see convert_frame).
+ */
+
+/* Gets byte size of a line in an RGB/BRG framebuffer, including the alignment
+ * to 16 bit the converters apply at the end of each line. */
+static __inline__ int
+_rgb_line_size(const RGBDesc* desc, int width)
+{
+    return (width * desc->rgb_inc + 1) & ~1;
+}
+
+/* Gets the distance between the first Y values of two adjacent lines in a YUV
+ * framebuffer. */
+static __inline__ int
+_yuv_line_size(const YUVDesc* desc, int width)
+{
+    return ((width + 1) / 2) * desc->Y_next_pair;
+}
+
 /* Generic converter from an RGB/BRG format to a YUV format. */
 static void
 RGBToYUV(const RGBDesc* rgb_fmt,
@@ -1005,6 +1136,8 @@ RGBToYUV(const RGBDesc* rgb_fmt,
          void* yuv,
          int width,
          int height,
+         int y_start,
+         int y_end,
          float r_scale,
          float g_scale,
          float b_scale,
@@ -1014,8 +1147,10 @@ RGBToYUV(const RGBDesc* rgb_fmt,
     const int Y_Inc = yuv_fmt->Y_inc;
     const int UV_inc = yuv_fmt->UV_inc;
     const int Y_next_pair = yuv_fmt->Y_next_pair;
-    uint8_t* pY = (uint8_t*)yuv + yuv_fmt->Y_offset;
-    for (y = 0; y < height; y++) {
+    uint8_t* pY = (uint8_t*)yuv + yuv_fmt->Y_offset +
+                  y_start * _yuv_line_size(yuv_fmt, width);
+    rgb = (const uint8_t*)rgb + y_start * _rgb_line_size(rgb_fmt, width);
+    for (y = y_start; y < y_end; y++) {
         uint8_t* pU =
             (uint8_t*)yuv + yuv_fmt->u_offset(yuv_fmt, y, width, height);
         uint8_t* pV =
@@ -1045,13 +1180,17 @@ RGBToRGB(const RGBDesc* src_rgb_fmt,
          void* dst_rgb,
          int width,
          int height,
+         int y_start,
+         int y_end,
          float r_scale,
          float g_scale,
          float b_scale,
          float exp_comp)
 {
     int x, y;
-    for (y = 0; y < height; y++) {
+    src_rgb = (const uint8_t*)src_rgb + y_start * _rgb_line_size(src_rgb_fmt, width);
+    dst_rgb = (uint8_t*)dst_rgb + y_start * _rgb_line_size(dst_rgb_fmt, width);
+    for (y = y_start; y < y_end; y++) {
         for (x = 0; x < width; x++) {
             uint8_t r, g, b;
             src_rgb = src_rgb_fmt->load_rgb(src_rgb, &r, &g, &b);
@@ -1073,6 +1212,8 @@ YUVToRGB(const YUVDesc* yuv_fmt,
          void* rgb,
          int width,
          int height,
+         int y_start,
+         int y_end,
          float r_scale,
          float g_scale,
          float b_scale,
@@ -1082,8 +1223,10 @@ YUVToRGB(const YUVDesc* yuv_fmt,
     const int Y_Inc = yuv_fmt->Y_inc;
     const int UV_inc = yuv_fmt->UV_inc;
     const int Y_next_pair = yuv_fmt->Y_next_pair;
-    const uint8_t* pY = (const uint8_t*)yuv + yuv_fmt->Y_offset;
-    for (y = 0; y < height; y++) {
+    const uint8_t* pY = (const uint8_t*)yuv + yuv_fmt->Y_offset +
+                        y_start * _yuv_line_size(yuv_fmt, width);
+    rgb = (uint8_t*)rgb + y_start * _rgb_line_size(rgb_fmt, width);
+    for (y = y_start; y < y_end; y++) {
         const uint8_t* pU =
             (const uint8_t*)yuv + yuv_fmt->u_offset(yuv_fmt, y, width, height);
         const uint8_t* pV =
@@ -1115,6 +1258,8 @@ YUVToYUV(const YUVDesc* src_fmt,
          void* dst,
          int width,
          int height,
+         int y_start,
+         int y_end,
          float r_scale,
          float g_scale,
          float b_scale,
@@ -1127,9 +1272,11 @@ YUVToYUV(const YUVDesc* src_fmt,
     const int Y_Inc_dst = dst_fmt->Y_inc;
     const int UV_inc_dst = dst_fmt->UV_inc;
     const int Y_next_pair_dst = dst_fmt->Y_next_pair;
-    const uint8_t* pYsrc = (const uint8_t*)src + src_fmt->Y_offset;
-    uint8_t* pYdst = (uint8_t*)dst + dst_fmt->Y_offset;
-    for (y = 0; y < height; y++) {
+    const uint8_t* pYsrc = (const uint8_t*)src + src_fmt->Y_offset +
+                           y_start * _yuv_line_size(src_fmt, width);
+    uint8_t* pYdst = (uint8_t*)dst + dst_fmt->Y_offset +
+                     y_start * _yuv_line_size(dst_fmt, width);
+    for (y = y_start; y < y_end; y++) {
         const uint8_t* pUsrc =
             (const uint8_t*)src + src_fmt->u_offset(src_fmt, y, width, height);
         const uint8_t* pVsrc =
@@ -1160,13 +1307,16 @@ BAYERToRGB(const BayerDesc* bayer_fmt,
            void* rgb,
            int width,
            int height,
+           int y_start,
+           int y_end,
            float r_scale,
            float g_scale,
            float b_scale,
            float exp_comp)
 {
     int y, x;
-    for (y = 0; y < height; y++) {
+    rgb = (uint8_t*)rgb + y_start * _rgb_line_size(rgb_fmt, width);
+    for (y = y_start; y < y_end; y++) {
         for (x = 0; x < width; x++) {
             int r, g, b;
             _get_bayerRGB(bayer_fmt, bayer, x, y, width, height, &r, &g, &b);
@@ -1192,6 +1342,8 @@ BAYERToYUV(const BayerDesc* bayer_fmt,
            void* yuv,
            int width,
            int height,
+           int y_start,
+           int y_end,
            float r_scale,
            float g_scale,
            float b_scale,
@@ -1201,8 +1353,9 @@ BAYERToYUV(const BayerDesc* bayer_fmt,
     const int Y_Inc = yuv_fmt->Y_inc;
     const int UV_inc = yuv_fmt->UV_inc;
     const int Y_next_pair = yuv_fmt->Y_next_pair;
-    uint8_t* pY = (uint8_t*)yuv + yuv_fmt->Y_offset;
-    for (y = 0; y < height; y++) {
+    uint8_t* pY = (uint8_t*)yuv + yuv_fmt->Y_offset +
+                  y_start * _yuv_line_size(yuv_fmt, width);
+    for (y = y_start; y < y_end; y++) {
         uint8_t* pU =
             (uint8_t*)yuv + yuv_fmt->u_offset(yuv_fmt, y, width, height);
         uint8_t* pV =
@@ -1222,6 +1375,103 @@ BAYERToYUV(const BayerDesc* bayer_fmt,
     }
 }
 
+/* Generic converter from a high bit depth YUV format to a RGB format. */
+static void
+YUV16ToRGB(const YUV16Desc* yuv_fmt,
+           const RGBDesc* rgb_fmt,
+           const void* yuv,
+           void* rgb,
+           int width,
+           int height,
+           int y_start,
+           int y_end,
+           float r_scale,
+           float g_scale,
+           float b_scale,
+           float exp_comp)
+{
+    int y, x;
+    const int shift = yuv_fmt->shift;
+    rgb = (uint8_t*)rgb + y_start * _rgb_line_size(rgb_fmt, width);
+    for (y = y_start; y < y_end; y++) {
+        const uint16_t* pY = (const uint16_t*)yuv + y * width;
+        const uint16_t* pU;
+        const uint16_t* pV;
+        const int UV_inc =
+            _get_YUV16_UV(yuv_fmt, yuv, y, width, height, &pU, &pV);
+        for (x = 0; x < width; x += 2, pY += 2, pU += UV_inc, pV += UV_inc) {
+            uint8_t r, g, b;
+            const uint8_t U = _reduce_sample(*pU, shift);
+            const uint8_t V = _reduce_sample(*pV, shift);
+            YUVToRGBPix(_reduce_sample(pY[0], shift), U, V, &r, &g, &b);
+            _change_white_balance_RGB_b(&r, &g, &b, r_scale, g_scale, b_scale);
+            _change_exposure_RGB(&r, &g, &b, exp_comp);
+            rgb = rgb_fmt->save_rgb(rgb, r, g, b);
+            if (x + 1 == width) {
+                /* Last pixel of an odd width line has no pair. */
+                break;
+            }
+            YUVToRGBPix(_reduce_sample(pY[1], shift), U, V, &r, &g, &b);
+            _change_white_balance_RGB_b(&r, &g, &b, r_scale, g_scale, b_scale);
+            _change_exposure_RGB(&r, &g, &b, exp_comp);
+            rgb = rgb_fmt->save_rgb(rgb, r, g, b);
+        }
+        /* Aling rgb_ptr to 16 bit */
+        if (((uintptr_t)rgb & 1) != 0) rgb = (uint8_t*)rgb + 1;
+    }
+}
+
+/* Generic converter from a high bit depth YUV format to a YUV format. */
+static void
+YUV16ToYUV(const YUV16Desc* src_fmt,
+           const YUVDesc* dst_fmt,
+           const void* src,
+           void* dst,
+           int width,
+           int height,
+           int y_start,
+           int y_end,
+           float r_scale,
+           float g_scale,
+           float b_scale,
+           float exp_comp)
+{
+    int y, x;
+    const int shift = src_fmt->shift;
+    const int Y_Inc_dst = dst_fmt->Y_inc;
+    const int UV_inc_dst = dst_fmt->UV_inc;
+    const int Y_next_pair_dst = dst_fmt->Y_next_pair;
+    uint8_t* pYdst = (uint8_t*)dst + dst_fmt->Y_offset +
+                     y_start * _yuv_line_size(dst_fmt, width);
+    for (y = y_start; y < y_end; y++) {
+        const uint16_t* pYsrc = (const uint16_t*)src + y * width;
+        const uint16_t* pUsrc;
+        const uint16_t* pVsrc;
+        const int UV_inc_src =
+            _get_YUV16_UV(src_fmt, src, y, width, height, &pUsrc, &pVsrc);
+        uint8_t* pUdst =
+            (uint8_t*)dst + dst_fmt->u_offset(dst_fmt, y, width, height);
+        uint8_t* pVdst =
+            (uint8_t*)dst + dst_fmt->v_offset(dst_fmt, y, width, height);
+        for (x = 0; x < width; x += 2, pYsrc += 2,
+                                       pUsrc += UV_inc_src,
+                                       pVsrc += UV_inc_src,
+                                       pYdst += Y_next_pair_dst,
+                                       pUdst += UV_inc_dst,
+                                       pVdst += UV_inc_dst) {
+            *pYdst = _reduce_sample(pYsrc[0], shift);
+            *pUdst = _reduce_sample(*pUsrc, shift);
+            *pVdst = _reduce_sample(*pVsrc, shift);
+            _change_white_balance_YUV(pYdst, pUdst, pVdst, r_scale, g_scale, b_scale);
+            *pYdst = _change_exposure(*pYdst, exp_comp);
+            if (x + 1 < width) {
+                pYdst[Y_Inc_dst] =
+                    _change_exposure(_reduce_sample(pYsrc[1], shift), exp_comp);
+            }
+        }
+    }
+}
+
 /********************************************************************************
  * RGB format descriptors.
  */
@@ -1412,6 +1662,31 @@ static const YUVDesc _NV21 =
     .v_offset       = &_VOffIntrlUV
 };
 
+/********************************************************************************
+ * YUV 4:2:0 high bit depth descriptors.
+ */
+
+/* Describes P010 format (10-bit NV12, samples in the high bits). */
+static const YUV16Desc _P010 =
+{
+    .shift          = 8,
+    .uv_interleaved = 1
+};
+
+/* Describes 10-bit YUV420 format (samples in the low bits). */
+static const YUV16Desc _YU12_10 =
+{
+    .shift          = 2,
+    .uv_interleaved = 0
+};
+
+/* Describes 12-bit YUV420 format (samples in the low bits). */
+static const YUV16Desc _YU12_12 =
+{
+    .shift          = 4,
+    .uv_interleaved = 0
+};
+
 /********************************************************************************
  * RGB bayer format descriptors.
  */
@@ -1512,14 +1787,16 @@ typedef enum PIXFormatSel {
     /* Pixel format is YUV */
     PIX_FMT_YUV,
     /* Pixel format is BAYER */
-    PIX_FMT_BAYER
+    PIX_FMT_BAYER,
+    /* Pixel format is high bit depth YUV */
+    PIX_FMT_YUV16
 } PIXFormatSel;
 
 /* Formats entry in the list of descriptors for supported formats. */
 typedef struct PIXFormat {
     /* "FOURCC" (V4L2_PIX_FMT_XXX) format type. */
     uint32_t        fourcc_type;
-    /* RGB/YUV/BAYER format selector */
+    /* RGB/YUV/BAYER/YUV16 format selector */
     PIXFormatSel    format_sel;
     union {
         /* References RGB format descriptor for that format. */
@@ -1528,6 +1805,8 @@ typedef struct PIXFormat {
         const YUVDesc*      yuv_desc;
         /* References BAYER format descriptor for that format. */
         const BayerDesc*    bayer_desc;
+        /* References high bit depth YUV format descriptor for that format. */
+        const YUV16Desc*    yuv16_desc;
     } desc;
 } PIXFormat;
 
@@ -1546,6 +1825,11 @@ static const PIXFormat _PIXFormats[] = {
     { V4L2_PIX_FMT_NV12,    PIX_FMT_YUV,    .desc.yuv_desc = &_NV12   },
     { V4L2_PIX_FMT_NV21,    PIX_FMT_YUV,    .desc.yuv_desc = &_NV21   },
 
+    /* YUV 4:2:0 high bit depth formats. */
+    { V4L2_PIX_FMT_P010,      PIX_FMT_YUV16, .desc.yuv16_desc = &_P010    },
+    { V4L2_PIX_FMT_YUV420P10, PIX_FMT_YUV16, .desc.yuv16_desc = &_YU12_10 },
+    { V4L2_PIX_FMT_YUV420P12, PIX_FMT_YUV16, .desc.yuv16_desc = &_YU12_12 },
+
     /* YUV 4:2:2 formats. */
     { V4L2_PIX_FMT_YUYV,    PIX_FMT_YUV,    .desc.yuv_desc = &_YUYV   },
     { V4L2_PIX_FMT_YYUV,    PIX_FMT_YUV,    .desc.yuv_desc = &_YYUV   },
@@ -1596,6 +1880,623 @@ _get_pixel_format_descriptor(uint32_t pixel_format)
     return NULL;
 }
 
+/********************************************************************************
+ * Scaling converter for decoded 4:2:0 frames
+ *******************************************************************************/
+
+/*
+ * Frames coming out of a video decoder rarely have the dimensions requested by
+ * the guest, so they need to be resampled before they are converted. Doing
+ * that with the generic converters means a full pass for scaling into a
+ * temporary frame, and then one more full pass over that frame per destination
+ * framebuffer.
+ * Instead, the scaling converter resamples the source panes straight into
+ * line buffers of the destination dimensions, applies white balance and
+ * exposure compensation to these lines once, and then writes them out to every
+ * destination framebuffer. Lines are produced in strips of SCALER_STRIP_LINES
+ * lines, so that the source lines, the line buffers, and the destination lines
+ * all stay in the cache while a strip is processed.
+ *
+ * Resampling is bilinear, with 8 bits of fractional precision. Chroma is
+ * resampled at the chroma resolution of the destination, and each chroma line
+ * is shared by the two lines of a 4:2:0 line pair, the same way it is in the
+ * destination YUV framebuffers.
+ *
+ * High bit depth frames are reduced to 8 bits, with rounding, as their lines
+ * are fetched for resampling, so that the rest of the pipeline is the same.
+ */
+
+/* Number of destination lines produced in one strip. Must be even. */
+#define SCALER_STRIP_LINES  16
+
+/* Amount of source frame data walked in one strip when scaling into
+ * framebuffers of several dimensions: every scaler produces the destination
+ * lines that come from it while it is still in the cache. */
+#define SCALER_STRIP_BYTES  (128 * 1024)
+
+/* Maximum number of framebuffers a frame can be scaled into at once, for each
+ * of the destination dimensions. */
+#define SCALER_MAX_FBS      4
+#define SCALER_MAX_DIMS     2
+
+/* Resampling table for one axis. */
+typedef struct ScaleAxis {
+    /* Index of the first source sample for each destination sample. */
+    int*    idx0;
+    /* Index of the second source sample for each destination sample. */
+    int*    idx1;
+    /* Weight (0 - 255 out of 256) of the second source sample. */
+    int*    frac;
+} ScaleAxis;
+
+struct FrameScaler {
+    /* Source frame dimensions. */
+    int         src_width;
+    int         src_height;
+    /* Destination framebuffers dimensions. */
+    int         dst_width;
+    int         dst_height;
+    /* Resampling tables for the Y pane. */
+    ScaleAxis   y_hor;
+    ScaleAxis   y_vert;
+    /* Resampling tables for the U and V panes. */
+    ScaleAxis   uv_hor;
+    ScaleAxis   uv_vert;
+    /* Line buffer for a vertically blended source line. */
+    uint8_t*    blend;
+    /* Line buffers for Y source lines that need reducing to 8 bits. Two lines
+     * are kept, one for each of the blended source lines. */
+    uint8_t*    src_y[2];
+    /* Line buffers for U and V source lines that need unpacking. Two lines
+     * are kept for each pane, one for each of the blended source lines. */
+    uint8_t*    src_u[2];
+    uint8_t*    src_v[2];
+    /* Line buffers for a strip of destination lines. */
+    uint8_t*    Y;
+    uint8_t*    U;
+    uint8_t*    V;
+    /* Exposure compensation table, and compensation it has been built for. */
+    uint8_t     exp_lut[256];
+    float       exp_lut_comp;
+    /* Descriptor of the frame being converted if it is a high bit depth one,
+     * or NULL for 8 bit frames. */
+    const YUV16Desc* src16;
+};
+
+/* Frees resampling tables for one axis. */
+static void
+_scale_axis_free(ScaleAxis* axis)
+{
+    free(axis->idx0);
+    free(axis->idx1);
+    free(axis->frac);
+    axis->idx0 = axis->idx1 = axis->frac = NULL;
+}
+
+/* Builds resampling tables for one axis.
+ * Param:
+ *  axis - Tables to build.
+ *  src_num, dst_num - Number of source, and destination samples.
+ * Return:
+ *  0 on success, or -1 on memory allocation failure.
+ */
+static int
+_scale_axis_init(ScaleAxis* axis, int src_num, int dst_num)
+{
+    int n;
+
+    axis->idx0 = (int*)malloc(dst_num * sizeof(int));
+    axis->idx1 = (int*)malloc(dst_num * sizeof(int));
+    axis->frac = (int*)malloc(dst_num * sizeof(int));
+    if (axis->idx0 == NULL || axis->idx1 == NULL || axis->frac == NULL) {
+        _scale_axis_free(axis);
+        return -1;
+    }
+
+    for (n = 0; n < dst_num; n++) {
+        /* Map the center of the destination sample onto the source. */
+        int64_t pos = ((int64_t)(2 * n + 1) * src_num * 256) / (2 * dst_num) - 128;
+        if (pos < 0) {
+            pos = 0;
+        }
+        axis->idx0[n] = (int)(pos >> 8);
+        axis->frac[n] = (int)(pos & 0xff);
+        if (axis->idx0[n] >= src_num - 1) {
+            axis->idx0[n] = src_num - 1;
+            axis->frac[n] = 0;
+        }
+        axis->idx1[n] = axis->frac[n] ? axis->idx0[n] + 1 : axis->idx0[n];
+    }
+    return 0;
+}
+
+/* Blends two source lines together.
+ * Param:
+ *  dst - Line buffer where to save the blended line.
+ *  a, b - Lines to blend.
+ *  frac - Weight (out of 256) of the 'b' line.
+ *  num - Number of samples in a line.
+ */
+static void
+_blend_lines(uint8_t* dst, const uint8_t* a, const uint8_t* b, int frac, int num)
+{
+    const int frac_a = 256 - frac;
+    int n;
+    for (n = 0; n < num; n++) {
+        dst[n] = (uint8_t)((a[n] * frac_a + b[n] * frac + 128) >> 8);
+    }
+}
+
+/* Resamples a line horizontally.
+ * Param:
+ *  dst - Line buffer where to save the resampled line.
+ *  src - Source line.
+ *  axis - Horizontal resampling tables.
+ *  num - Number of destination samples.
+ */
+static void
+_resample_line(uint8_t* dst, const uint8_t* src, const ScaleAxis* axis, int num)
+{
+    const int* idx0 = axis->idx0;
+    const int* idx1 = axis->idx1;
+    const int* frac = axis->frac;
+    int n;
+    for (n = 0; n < num; n++) {
+        dst[n] = (uint8_t)((src[idx0[n]] * (256 - frac[n]) +
+                            src[idx1[n]] * frac[n] + 128) >> 8);
+    }
+}
+
+/* Gets a line of the Y pane of the source frame.
+ * Param:
+ *  sc - Scaling converter.
+ *  frame - Source frame.
+ *  line - Line to get.
+ *  slot - Index (0 or 1) of the line buffer to use if the line must be
+ *      reduced to 8 bits.
+ * Return:
+ *  Address of the line.
+ */
+static const uint8_t*
+_scaler_src_Y(FrameScaler* sc, const PlanarFrame* frame, int line, int slot)
+{
+    const uint8_t* Y = frame->panes[0] + line * frame->linesize[0];
+    if (sc->src16 == NULL) {
+        return Y;
+    }
+    _reduce_line(sc->src_y[slot], (const uint16_t*)Y, sc->src16->shift,
+                 sc->src_width);
+    return sc->src_y[slot];
+}
+
+/* Gets a line of the U, and V panes of the source frame.
+ * Param:
+ *  sc - Scaling converter.
+ *  frame - Source frame.
+ *  line - Chroma line to get.
+ *  slot - Index (0 or 1) of the line buffers to use if the line must be
+ *      unpacked, or reduced to 8 bits.
+ *  pU, pV - Upon return contain addresses of the U, and V lines.
+ */
+static void
+_scaler_src_UV(FrameScaler* sc,
+               const PlanarFrame* frame,
+               int line,
+               int slot,
+               const uint8_t** pU,
+               const uint8_t** pV)
+{
+    const int num = CHROMA_DIM(sc->src_width);
+    const uint8_t* uv;
+    uint8_t* U;
+    uint8_t* V;
+    int n;
+
+    if (sc->src16 != NULL) {
+        const uint8_t* u = frame->panes[1] + line * frame->linesize[1];
+        if (sc->src16->uv_interleaved) {
+            _reduce_line_UV(sc->src_u[slot], sc->src_v[slot],
+                            (const uint16_t*)u, sc->src16->shift, num);
+        } else {
+            _reduce_line(sc->src_u[slot], (const uint16_t*)u,
+                         sc->src16->shift, num);
+            _reduce_line(sc->src_v[slot],
+                         (const uint16_t*)(frame->panes[2] +
+                                           line * frame->linesize[2]),
+                         sc->src16->shift, num);
+        }
+        *pU = sc->src_u[slot];
+        *pV = sc->src_v[slot];
+        return;
+    }
+
+    if (frame->pixel_format == V4L2_PIX_FMT_YUV420) {
+        *pU = frame->panes[1] + line * frame->linesize[1];
+        *pV = frame->panes[2] + line * frame->linesize[2];
+        return;
+    }
+
+    /* Interleaved UV pane: unpack U and V. */
+    uv = frame->panes[1] + line * frame->linesize[1];
+    if (frame->pixel_format == V4L2_PIX_FMT_NV12) {
+        U = sc->src_u[slot]; V = sc->src_v[slot];
+    } else {
+        U = sc->src_v[slot]; V = sc->src_u[slot];
+    }
+    for (n = 0; n < num; n++) {
+        U[n] = uv[2 * n];
+        V[n] = uv[2 * n + 1];
+    }
+    *pU = sc->src_u[slot];
+    *pV = sc->src_v[slot];
+}
+
+/* Resamples one destination line of a pane.
+ * Param:
+ *  sc - Scaling converter.
+ *  dst - Line buffer where to save the resampled line.
+ *  a, b - Source lines to blend vertically. Can be the same line.
+ *  frac - Weight (out of 256) of the 'b' line.
+ *  src_num, dst_num - Number of source, and destination samples in a line.
+ *  hor - Horizontal resampling tables.
+ */
+static void
+_scaler_resample_line(FrameScaler* sc,
+                      uint8_t* dst,
+                      const uint8_t* a,
+                      const uint8_t* b,
+                      int frac,
+                      int src_num,
+                      int dst_num,
+                      const ScaleAxis* hor)
+{
+    const uint8_t* src = a;
+    if (frac != 0 && a != b) {
+        _blend_lines(sc->blend, a, b, frac, src_num);
+        src = sc->blend;
+    }
+    if (src_num == dst_num) {
+        memcpy(dst, src, dst_num);
+    } else {
+        _resample_line(dst, src, hor, dst_num);
+    }
+}
+
+/* Resamples a strip of destination lines into the line buffers.
+ * Param:
+ *  sc - Scaling converter.
+ *  frame - Source frame.
+ *  first - First destination line of the strip. Must be even.
+ *  num - Number of lines in the strip.
+ */
+static void
+_scaler_resample_strip(FrameScaler* sc, const PlanarFrame* frame, int first, int num)
+{
+    const int src_cw = CHROMA_DIM(sc->src_width);
+    const int dst_cw = CHROMA_DIM(sc->dst_width);
+    int n;
+
+    for (n = 0; n < num; n++) {
+        const int line = first + n;
+        const uint8_t* Y0 = _scaler_src_Y(sc, frame, sc->y_vert.idx0[line], 0);
+        const uint8_t* Y1 = Y0;
+        if (sc->y_vert.idx1[line] != sc->y_vert.idx0[line]) {
+            Y1 = _scaler_src_Y(sc, frame, sc->y_vert.idx1[line], 1);
+        }
+        _scaler_resample_line(sc, sc->Y + n * sc->dst_width, Y0, Y1,
+                              sc->y_vert.frac[line], sc->src_width,
+                              sc->dst_width, &sc->y_hor);
+    }
+
+    for (n = 0; n < CHROMA_DIM(num); n++) {
+        const int line = first / 2 + n;
+        const uint8_t* U0; const uint8_t* V0;
+        const uint8_t* U1; const uint8_t* V1;
+        _scaler_src_UV(sc, frame, sc->uv_vert.idx0[line], 0, &U0, &V0);
+        if (sc->uv_vert.idx1[line] != sc->uv_vert.idx0[line]) {
+            _scaler_src_UV(sc, frame, sc->uv_vert.idx1[line], 1, &U1, &V1);
+        } else {
+            U1 = U0; V1 = V0;
+        }
+        _scaler_resample_line(sc, sc->U + n * dst_cw, U0, U1,
+                              sc->uv_vert.frac[line], src_cw, dst_cw, &sc->uv_hor);
+        _scaler_resample_line(sc, sc->V + n * dst_cw, V0, V1,
+                              sc->uv_vert.frac[line], src_cw, dst_cw, &sc->uv_hor);
+    }
+}
+
+/* Applies white balance to a pixel in the YUV space, the same way
+ * _change_white_balance_YUV does, using 16.16 fixed point scales. */
+static __inline__ void
+_white_balance_YUV_q16(int y, int u, int v, int r_q16, int g_q16, int b_q16,
+                       int* r, int* g, int* b)
+{
+    *r = clamp((YUV2R(y, u, v) * r_q16) >> 16);
+    *g = clamp((YUV2G(y, u, v) * g_q16) >> 16);
+    *b = clamp((YUV2B(y, u, v) * b_q16) >> 16);
+}
+
+/* Applies white balance and exposure compensation to a strip of lines in the
+ * line buffers.
+ * Param:
+ *  sc - Scaling converter.
+ *  num - Number of lines in the strip.
+ *  r_scale, g_scale, b_scale - White balance scale.
+ */
+static void
+_scaler_adjust_strip(FrameScaler* sc,
+                     int num,
+                     float r_scale,
+                     float g_scale,
+                     float b_scale)
+{
+    const int width = sc->dst_width;
+    const int cw = CHROMA_DIM(width);
+    const uint8_t* lut = sc->exp_lut;
+    int l, x;
+
+    if (r_scale != 1.0f || g_scale != 1.0f || b_scale != 1.0f) {
+        const int r_q16 = (int)(65536.0f / r_scale);
+        const int g_q16 = (int)(65536.0f / g_scale);
+        const int b_q16 = (int)(65536.0f / b_scale);
+        for (l = 0; l < num; l += 2) {
+            uint8_t* Y0 = sc->Y + l * width;
+            uint8_t* Y1 = (l + 1 < num) ? Y0 + width : NULL;
+            uint8_t* U = sc->U + (l / 2) * cw;
+            uint8_t* V = sc->V + (l / 2) * cw;
+            for (x = 0; x < cw; x++) {
+                const int u = U[x];
+                const int v = V[x];
+                const int x1 = (2 * x + 1 < width) ? 2 * x + 1 : 2 * x;
+                int r, g, b;
+                /* Chroma is balanced for the first pixel of the pair, like it
+                 * is done in YUVToYUV. */
+                _white_balance_YUV_q16(Y0[2 * x], u, v, r_q16, g_q16, b_q16, &r, &g, &b);
+                U[x] = RGB2U(r, g, b);
+                V[x] = RGB2V(r, g, b);
+                Y0[2 * x] = RGB2Y(r, g, b);
+                if (x1 != 2 * x) {
+                    _white_balance_YUV_q16(Y0[x1], u, v, r_q16, g_q16, b_q16, &r, &g, &b);
+                    Y0[x1] = RGB2Y(r, g, b);
+                }
+                if (Y1 != NULL) {
+                    _white_balance_YUV_q16(Y1[2 * x], u, v, r_q16, g_q16, b_q16, &r, &g, &b);
+                    Y1[2 * x] = RGB2Y(r, g, b);
+                    if (x1 != 2 * x) {
+                        _white_balance_YUV_q16(Y1[x1], u, v, r_q16, g_q16, b_q16, &r, &g, &b);
+                        Y1[x1] = RGB2Y(r, g, b);
+                    }
+                }
+            }
+        }
+    }
+
+    if (sc->exp_lut_comp != 1.0f) {
+        uint8_t* Y = sc->Y;
+        for (x = 0; x < num * width; x++) {
+            Y[x] = lut[Y[x]];
+        }
+    }
+}
+
+/* Checks if a YUV format descriptor describes a 4:2:0 format. */
+static int
+_is_yuv420_desc(const YUVDesc* desc)
+{
+    return desc->u_offset == &_UOffSepYUV || desc->u_offset == &_UOffIntrlUV;
+}
+
+/* Writes a strip of lines from the line buffers to a 4:2:0 YUV framebuffer.
+ * Param:
+ *  sc - Scaling converter.
+ *  desc - Destination YUV format descriptor.
+ *  yuv - Destination framebuffer.
+ *  first - First destination line of the strip. Must be even.
+ *  num - Number of lines in the strip.
+ */
+static void
+_scaler_write_YUV(const FrameScaler* sc,
+                  const YUVDesc* desc,
+                  void* yuv,
+                  int first,
+                  int num)
+{
+    const int width = sc->dst_width;
+    const int height = sc->dst_height;
+    const int cw = CHROMA_DIM(width);
+    const int UV_inc = desc->UV_inc;
+    int l, x;
+
+    memcpy((uint8_t*)yuv + desc->Y_offset + first * width, sc->Y, num * width);
+    for (l = 0; l < num; l += 2) {
+        const uint8_t* U = sc->U + (l / 2) * cw;
+        const uint8_t* V = sc->V + (l / 2) * cw;
+        uint8_t* pU = (uint8_t*)yuv + desc->u_offset(desc, first + l, width, height);
+        uint8_t* pV = (uint8_t*)yuv + desc->v_offset(desc, first + l, width, height);
+        if (UV_inc == 1) {
+            memcpy(pU, U, cw);
+            memcpy(pV, V, cw);
+        } else {
+            for (x = 0; x < cw; x++) {
+                pU[x * UV_inc] = U[x];
+                pV[x * UV_inc] = V[x];
+            }
+        }
+    }
+}
+
+/* Writes a strip of lines from the line buffers to an RGB framebuffer.
+ * Param:
+ *  sc - Scaling converter.
+ *  desc - Destination RGB format descriptor.
+ *  rgb - Destination framebuffer.
+ *  first - First destination line of the strip. Must be even.
+ *  num - Number of lines in the strip.
+ */
+static void
+_scaler_write_RGB(const FrameScaler* sc,
+                  const RGBDesc* desc,
+                  void* rgb,
+                  int first,
+                  int num)
+{
+    const int width = sc->dst_width;
+    const int cw = CHROMA_DIM(width);
+    /* Lines are aligned to 16 bit, see RGBToRGB. */
+    const int stride = (width * desc->rgb_inc + 1) & ~1;
+    int l, x;
+
+    for (l = 0; l < num; l++) {
+        const uint8_t* Y = sc->Y + l * width;
+        const uint8_t* U = sc->U + (l / 2) * cw;
+        const uint8_t* V = sc->V + (l / 2) * cw;
+        uint8_t* dst = (uint8_t*)rgb + (first + l) * stride;
+        if (desc == &_RGB32) {
+            /* Straight loop for the preview window format. */
+            for (x = 0; x < width; x++) {
+                const int c = 298 * (Y[x] - 16) + 128;
+                const int d = U[x >> 1] - 128;
+                const int e = V[x >> 1] - 128;
+                dst[4 * x + 0] = clamp((c + 409 * e) >> 8);
+                dst[4 * x + 1] = clamp((c - 100 * d - 208 * e) >> 8);
+                dst[4 * x + 2] = clamp((c + 516 * d) >> 8);
+                dst[4 * x + 3] = 0xff;
+            }
+        } else if (desc == &_RGB16) {
+            /* Straight loop for the reduced bandwidth preview format. */
+            uint16_t* pix = (uint16_t*)dst;
+            for (x = 0; x < width; x++) {
+                const int c = 298 * (Y[x] - 16) + 128;
+                const int d = U[x >> 1] - 128;
+                const int e = V[x >> 1] - 128;
+                pix[x] = RGB565(clamp((c + 409 * e) >> 8) >> 3,
+                                clamp((c - 100 * d - 208 * e) >> 8) >> 2,
+                                clamp((c + 516 * d) >> 8) >> 3);
+            }
+        } else {
+            void* pix = dst;
+            for (x = 0; x < width; x++) {
+                uint8_t r, g, b;
+                YUVToRGBPix(Y[x], U[x >> 1], V[x >> 1], &r, &g, &b);
+                pix = desc->save_rgb(pix, r, g, b);
+            }
+        }
+    }
+}
+
+/********************************************************************************
+ * Strip conversion
+ *******************************************************************************/
+
+/* Maximum number of framebuffers a frame can be converted into at once. */
+#define CONVERTER_MAX_FBS       4
+
+/* Amount of source frame data converted in one strip when converting into
+ * multiple framebuffers. This leaves room in a typical L2 cache for the
+ * destination lines that are written along. */
+#define CONVERTER_STRIP_BYTES   (128 * 1024)
+
+/* Gets the number of bytes a line of a frame takes in the given pixel format,
+ * including its share of the U/V panes for 4:2:0 formats. */
+static int
+_pixel_format_line_size(const PIXFormat* desc, int width)
+{
+    switch (desc->format_sel) {
+        case PIX_FMT_RGB:
+            return _rgb_line_size(desc->desc.rgb_desc, width);
+        case PIX_FMT_YUV:
+            if (desc->desc.yuv_desc->Y_next_pair == 2) {
+                /* 4:2:0: Y pane line, and half a line of U/V panes. */
+                return width * 3 / 2;
+            }
+            return _yuv_line_size(desc->desc.yuv_desc, width);
+        case PIX_FMT_YUV16:
+            /* 4:2:0: Y pane line, and half a line of U/V panes, 16 bit each. */
+            return width * 3;
+        default:
+            return (desc->desc.bayer_desc->mask == kBayer8) ? width : width * 2;
+    }
+}
+
+/* Converts a range of lines of a frame into a framebuffer.
+ * Param:
+ *  src_desc, dst_desc - Source and destination pixel format descriptors.
+ *  frame - Frame to convert.
+ *  framebuffer - Framebuffer where to convert the frame.
+ *  width, height - Frame dimensions.
+ *  y_start, y_end - Range of lines to convert.
+ *  r_scale, g_scale, b_scale - White balance scale.
+ *  exp_comp - Expsoure compensation.
+ * Return:
+ *  0 on success, or non-zero value on failure.
+ */
+static int
+_convert_lines(const PIXFormat* src_desc,
+               const PIXFormat* dst_desc,
+               const void* frame,
+               void* framebuffer,
+               int width,
+               int height,
+               int y_start,
+               int y_end,
+               float r_scale,
+               float g_scale,
+               float b_scale,
+               float exp_comp)
+{
+    switch (src_desc->format_sel) {
+        case PIX_FMT_RGB:
+            if (dst_desc->format_sel == PIX_FMT_RGB) {
+                RGBToRGB(src_desc->desc.rgb_desc, dst_desc->desc.rgb_desc,
+                         frame, framebuffer, width, height, y_start, y_end,
+                         r_scale, g_scale, b_scale, exp_comp);
+            } else {
+                RGBToYUV(src_desc->desc.rgb_desc, dst_desc->desc.yuv_desc,
+                         frame, framebuffer, width, height, y_start, y_end,
+                         r_scale, g_scale, b_scale, exp_comp);
+            }
+            break;
+        case PIX_FMT_YUV:
+            if (dst_desc->format_sel == PIX_FMT_RGB) {
+                YUVToRGB(src_desc->desc.yuv_desc, dst_desc->desc.rgb_desc,
+                         frame, framebuffer, width, height, y_start, y_end,
+                         r_scale, g_scale, b_scale, exp_comp);
+            } else {
+                YUVToYUV(src_desc->desc.yuv_desc, dst_desc->desc.yuv_desc,
+                         frame, framebuffer, width, height, y_start, y_end,
+                         r_scale, g_scale, b_scale, exp_comp);
+            }
+            break;
+        case PIX_FMT_BAYER:
+            if (dst_desc->format_sel == PIX_FMT_RGB) {
+                BAYERToRGB(src_desc->desc.bayer_desc, dst_desc->desc.rgb_desc,
+                           frame, framebuffer, width, height, y_start, y_end,
+                           r_scale, g_scale, b_scale, exp_comp);
+            } else {
+                BAYERToYUV(src_desc->desc.bayer_desc, dst_desc->desc.yuv_desc,
+                           frame, framebuffer, width, height, y_start, y_end,
+                           r_scale, g_scale, b_scale, exp_comp);
+            }
+            break;
+        case PIX_FMT_YUV16:
+            if (dst_desc->format_sel == PIX_FMT_RGB) {
+                YUV16ToRGB(src_desc->desc.yuv16_desc, dst_desc->desc.rgb_desc,
+                           frame, framebuffer, width, height, y_start, y_end,
+                           r_scale, g_scale, b_scale, exp_comp);
+            } else {
+                YUV16ToYUV(src_desc->desc.yuv16_desc, dst_desc->desc.yuv_desc,
+                           frame, framebuffer, width, height, y_start, y_end,
+                           r_scale, g_scale, b_scale, exp_comp);
+            }
+            break;
+        default:
+            E("%s: Unexpected source pixel format %d",
+              __FUNCTION__, src_desc->format_sel);
+            return -1;
+    }
+    return 0;
+}
+
 /********************************************************************************
  * Public API
  *******************************************************************************/
@@ -1603,12 +2504,17 @@ _get_pixel_format_descriptor(uint32_t pixel_format)
 int
 has_converter(uint32_t from, uint32_t to)
 {
+    const PIXFormat* dst_desc;
+
     if (from == to) {
         /* Same format: converter esists. */
         return 1;
     }
-    return _get_pixel_format_descriptor(from) != NULL &&
-           _get_pixel_format_descriptor(to) != NULL;
+    /* Converters only produce RGB, and YUV formats. */
+    dst_desc = _get_pixel_format_descriptor(to);
+    return _get_pixel_format_descriptor(from) != NULL && dst_desc != NULL &&
+           (dst_desc->format_sel == PIX_FMT_RGB ||
+            dst_desc->format_sel == PIX_FMT_YUV);
 }
 
 int
@@ -1624,76 +2530,340 @@ convert_frame(const void* frame,
               float b_scale,
               float exp_comp)
 {
-    int n;
+    const PIXFormat* dst_desc[CONVERTER_MAX_FBS];
+    int n, y, strip_lines;
     const PIXFormat* src_desc = _get_pixel_format_descriptor(pixel_format);
     if (src_desc == NULL) {
         E("%s: Source pixel format %.4s is unknown",
           __FUNCTION__, (const char*)&pixel_format);
         return -1;
     }
+    if (fbs_num > CONVERTER_MAX_FBS) {
+        E("%s: Too many framebuffers %d", __FUNCTION__, fbs_num);
+        return -1;
+    }
 
     for (n = 0; n < fbs_num; n++) {
-        /* Note that we need to apply white balance, exposure compensation, etc.
-         * when we transfer the captured frame to the user framebuffer. So, even
-         * if source and destination formats are the same, we will have to go
-         * thrugh the converters to apply these things. */
-        const PIXFormat* dst_desc =
-            _get_pixel_format_descriptor(framebuffers[n].pixel_format);
-        if (dst_desc == NULL) {
+        dst_desc[n] = _get_pixel_format_descriptor(framebuffers[n].pixel_format);
+        if (dst_desc[n] == NULL) {
             E("%s: Destination pixel format %.4s is unknown",
               __FUNCTION__, (const char*)&framebuffers[n].pixel_format);
             return -1;
         }
-        switch (src_desc->format_sel) {
-            case PIX_FMT_RGB:
-                if (dst_desc->format_sel == PIX_FMT_RGB) {
-                    RGBToRGB(src_desc->desc.rgb_desc, dst_desc->desc.rgb_desc,
-                             frame, framebuffers[n].framebuffer, width, height,
-                             r_scale, g_scale, b_scale, exp_comp);
-                } else if (dst_desc->format_sel == PIX_FMT_YUV) {
-                    RGBToYUV(src_desc->desc.rgb_desc, dst_desc->desc.yuv_desc,
-                             frame, framebuffers[n].framebuffer, width, height,
-                             r_scale, g_scale, b_scale, exp_comp);
-                } else {
-                    E("%s: Unexpected destination pixel format %d",
-                      __FUNCTION__, dst_desc->format_sel);
-                    return -1;
-                }
-                break;
-            case PIX_FMT_YUV:
-                if (dst_desc->format_sel == PIX_FMT_RGB) {
-                    YUVToRGB(src_desc->desc.yuv_desc, dst_desc->desc.rgb_desc,
-                             frame, framebuffers[n].framebuffer, width, height,
-                             r_scale, g_scale, b_scale, exp_comp);
-                } else if (dst_desc->format_sel == PIX_FMT_YUV) {
-                    YUVToYUV(src_desc->desc.yuv_desc, dst_desc->desc.yuv_desc,
-                             frame, framebuffers[n].framebuffer, width, height,
-                             r_scale, g_scale, b_scale, exp_comp);
-                } else {
-                    E("%s: Unexpected destination pixel format %d",
-                      __FUNCTION__, dst_desc->format_sel);
-                    return -1;
-                }
-                break;
-            case PIX_FMT_BAYER:
-                if (dst_desc->format_sel == PIX_FMT_RGB) {
-                    BAYERToRGB(src_desc->desc.bayer_desc, dst_desc->desc.rgb_desc,
-                              frame, framebuffers[n].framebuffer, width, height,
-                              r_scale, g_scale, b_scale, exp_comp);
-                } else if (dst_desc->format_sel == PIX_FMT_YUV) {
-                    BAYERToYUV(src_desc->desc.bayer_desc, dst_desc->desc.yuv_desc,
-                               frame, framebuffers[n].framebuffer, width, height,
-                               r_scale, g_scale, b_scale, exp_comp);
-                } else {
-                    E("%s: Unexpected destination pixel format %d",
-                      __FUNCTION__, dst_desc->format_sel);
-                    return -1;
-                }
-                break;
-            default:
-                E("%s: Unexpected source pixel format %d",
-                  __FUNCTION__, dst_desc->format_sel);
+        if (dst_desc[n]->format_sel != PIX_FMT_RGB &&
+            dst_desc[n]->format_sel != PIX_FMT_YUV) {
+            E("%s: Unexpected destination pixel format %d",
+              __FUNCTION__, dst_desc[n]->format_sel);
+            return -1;
+        }
+    }
+
+    /* When there is more than one framebuffer to convert to, go through the
+     * frame in strips of lines that fit in the cache, and convert each strip
+     * to all the framebuffers before moving on to the next one. This way the
+     * frame is read from the memory only once, whatever the number of
+     * framebuffers is. */
+    strip_lines = height;
+    if (fbs_num > 1) {
+        strip_lines = CONVERTER_STRIP_BYTES / _pixel_format_line_size(src_desc, width);
+        strip_lines &= ~1;
+        if (strip_lines < 2) {
+            strip_lines = 2;
+        }
+    }
+
+    for (y = 0; y < height; y += strip_lines) {
+        const int y_end = (height - y < strip_lines) ? height : y + strip_lines;
+        for (n = 0; n < fbs_num; n++) {
+            /* Note that we need to apply white balance, exposure compensation,
+             * etc. when we transfer the captured frame to the user framebuffer.
+             * So, even if source and destination formats are the same, we will
+             * have to go thrugh the converters to apply these things. */
+            if (_convert_lines(src_desc, dst_desc[n], frame,
+                               framebuffers[n].framebuffer, width, height, y,
+                               y_end, r_scale, g_scale, b_scale, exp_comp)) {
                 return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+has_scaling_converter(uint32_t from, uint32_t to)
+{
+    const PIXFormat* src_desc;
+    const PIXFormat* dst_desc;
+
+    if (from != V4L2_PIX_FMT_YUV420 && from != V4L2_PIX_FMT_NV12 &&
+        from != V4L2_PIX_FMT_NV21) {
+        /* High bit depth frames are reduced to 8 bits while resampled. */
+        src_desc = _get_pixel_format_descriptor(from);
+        if (src_desc == NULL || src_desc->format_sel != PIX_FMT_YUV16) {
+            return 0;
+        }
+    }
+    dst_desc = _get_pixel_format_descriptor(to);
+    if (dst_desc == NULL) {
+        return 0;
+    }
+    return dst_desc->format_sel == PIX_FMT_RGB ||
+           (dst_desc->format_sel == PIX_FMT_YUV &&
+            _is_yuv420_desc(dst_desc->desc.yuv_desc));
+}
+
+void
+frame_scaler_free(FrameScaler* sc)
+{
+    if (sc != NULL) {
+        _scale_axis_free(&sc->y_hor);
+        _scale_axis_free(&sc->y_vert);
+        _scale_axis_free(&sc->uv_hor);
+        _scale_axis_free(&sc->uv_vert);
+        free(sc->blend);
+        free(sc->src_y[0]);
+        free(sc->src_y[1]);
+        free(sc->src_u[0]);
+        free(sc->src_u[1]);
+        free(sc->src_v[0]);
+        free(sc->src_v[1]);
+        free(sc->Y);
+        free(sc->U);
+        free(sc->V);
+        free(sc);
+    }
+}
+
+FrameScaler*
+frame_scaler_get(FrameScaler* sc,
+                 int src_width,
+                 int src_height,
+                 int dst_width,
+                 int dst_height)
+{
+    int src_cw, dst_cw;
+
+    if (sc != NULL) {
+        if (sc->src_width == src_width && sc->src_height == src_height &&
+            sc->dst_width == dst_width && sc->dst_height == dst_height) {
+            return sc;
+        }
+        frame_scaler_free(sc);
+    }
+    if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0) {
+        return NULL;
+    }
+
+    sc = (FrameScaler*)calloc(1, sizeof(FrameScaler));
+    if (sc == NULL) {
+        E("%s: Unable to allocate scaler", __FUNCTION__);
+        return NULL;
+    }
+    sc->src_width = src_width;
+    sc->src_height = src_height;
+    sc->dst_width = dst_width;
+    sc->dst_height = dst_height;
+    /* Force the exposure table to be built on the first conversion. */
+    sc->exp_lut_comp = -1.0f;
+
+    src_cw = CHROMA_DIM(src_width);
+    dst_cw = CHROMA_DIM(dst_width);
+    sc->blend = (uint8_t*)malloc(src_width);
+    sc->src_y[0] = (uint8_t*)malloc(src_width);
+    sc->src_y[1] = (uint8_t*)malloc(src_width);
+    sc->src_u[0] = (uint8_t*)malloc(src_cw);
+    sc->src_u[1] = (uint8_t*)malloc(src_cw);
+    sc->src_v[0] = (uint8_t*)malloc(src_cw);
+    sc->src_v[1] = (uint8_t*)malloc(src_cw);
+    sc->Y = (uint8_t*)malloc(SCALER_STRIP_LINES * dst_width);
+    sc->U = (uint8_t*)malloc(SCALER_STRIP_LINES / 2 * dst_cw);
+    sc->V = (uint8_t*)malloc(SCALER_STRIP_LINES / 2 * dst_cw);
+    if (sc->blend == NULL || sc->src_y[0] == NULL || sc->src_y[1] == NULL ||
+        sc->src_u[0] == NULL || sc->src_u[1] == NULL ||
+        sc->src_v[0] == NULL || sc->src_v[1] == NULL || sc->Y == NULL ||
+        sc->U == NULL || sc->V == NULL ||
+        _scale_axis_init(&sc->y_hor, src_width, dst_width) ||
+        _scale_axis_init(&sc->y_vert, src_height, dst_height) ||
+        _scale_axis_init(&sc->uv_hor, src_cw, dst_cw) ||
+        _scale_axis_init(&sc->uv_vert, CHROMA_DIM(src_height),
+                         CHROMA_DIM(dst_height))) {
+        E("%s: Unable to allocate scaler tables", __FUNCTION__);
+        frame_scaler_free(sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+/* Checks that a frame can be scaled into framebuffers, and gets the scaler
+ * ready for it.
+ * Param:
+ *  sc - Scaling converter.
+ *  frame - Frame to convert.
+ *  framebuffers, fbs_num - Framebuffers where to convert the frame.
+ *  dst_desc - Upon success, contains the pixel format descriptors of the
+ *      framebuffers.
+ *  exp_comp - Expsoure compensation.
+ * Return:
+ *  0 on success, or non-zero value on failure.
+ */
+static int
+_scaler_prepare(FrameScaler* sc,
+                const PlanarFrame* frame,
+                const ClientFrameBuffer* framebuffers,
+                int fbs_num,
+                const PIXFormat** dst_desc,
+                float exp_comp)
+{
+    const PIXFormat* src_desc;
+    int n;
+
+    if (frame->width != sc->src_width || frame->height != sc->src_height) {
+        E("%s: Frame dimensions %dx%d don't match the scaler's %dx%d",
+          __FUNCTION__, frame->width, frame->height, sc->src_width,
+          sc->src_height);
+        return -1;
+    }
+    if (fbs_num > SCALER_MAX_FBS) {
+        E("%s: Too many framebuffers %d", __FUNCTION__, fbs_num);
+        return -1;
+    }
+    for (n = 0; n < fbs_num; n++) {
+        if (!has_scaling_converter(frame->pixel_format,
+                                   framebuffers[n].pixel_format)) {
+            E("%s: No scaling conversion from %.4s to %.4s", __FUNCTION__,
+              (const char*)&frame->pixel_format,
+              (const char*)&framebuffers[n].pixel_format);
+            return -1;
+        }
+        dst_desc[n] = _get_pixel_format_descriptor(framebuffers[n].pixel_format);
+    }
+    src_desc = _get_pixel_format_descriptor(frame->pixel_format);
+    sc->src16 = (src_desc != NULL && src_desc->format_sel == PIX_FMT_YUV16) ?
+                src_desc->desc.yuv16_desc : NULL;
+
+    if (sc->exp_lut_comp != exp_comp) {
+        for (n = 0; n < 256; n++) {
+            sc->exp_lut[n] = _change_exposure(n, exp_comp);
+        }
+        sc->exp_lut_comp = exp_comp;
+    }
+    return 0;
+}
+
+/* Scales a range of destination lines into framebuffers, SCALER_STRIP_LINES
+ * lines at a time.
+ * Param:
+ *  sc - Scaling converter, ready for the frame.
+ *  frame - Frame to convert.
+ *  framebuffers, dst_desc, fbs_num - Framebuffers where to convert the frame,
+ *      and their pixel format descriptors.
+ *  first, end - Range of destination lines. 'first' must be even.
+ *  r_scale, g_scale, b_scale - White balance scale.
+ */
+static void
+_scaler_convert_lines(FrameScaler* sc,
+                      const PlanarFrame* frame,
+                      ClientFrameBuffer* framebuffers,
+                      const PIXFormat** dst_desc,
+                      int fbs_num,
+                      int first,
+                      int end,
+                      float r_scale,
+                      float g_scale,
+                      float b_scale)
+{
+    int n;
+
+    for (; first < end; first += SCALER_STRIP_LINES) {
+        const int num = (end - first < SCALER_STRIP_LINES) ?
+                        end - first : SCALER_STRIP_LINES;
+        _scaler_resample_strip(sc, frame, first, num);
+        _scaler_adjust_strip(sc, num, r_scale, g_scale, b_scale);
+        for (n = 0; n < fbs_num; n++) {
+            if (dst_desc[n]->format_sel == PIX_FMT_RGB) {
+                _scaler_write_RGB(sc, dst_desc[n]->desc.rgb_desc,
+                                  framebuffers[n].framebuffer, first, num);
+            } else {
+                _scaler_write_YUV(sc, dst_desc[n]->desc.yuv_desc,
+                                  framebuffers[n].framebuffer, first, num);
+            }
+        }
+    }
+}
+
+int
+frame_scaler_convert(FrameScaler* sc,
+                     const PlanarFrame* frame,
+                     ClientFrameBuffer* framebuffers,
+                     int fbs_num,
+                     float r_scale,
+                     float g_scale,
+                     float b_scale,
+                     float exp_comp)
+{
+    const PIXFormat* dst_desc[SCALER_MAX_FBS];
+
+    if (_scaler_prepare(sc, frame, framebuffers, fbs_num, dst_desc, exp_comp)) {
+        return -1;
+    }
+    _scaler_convert_lines(sc, frame, framebuffers, dst_desc, fbs_num, 0,
+                          sc->dst_height, r_scale, g_scale, b_scale);
+
+    return 0;
+}
+
+int
+frame_scalers_convert(FrameScaler** scalers,
+                      const PlanarFrame* frame,
+                      ClientFrameBuffer** framebuffers,
+                      const int* fbs_num,
+                      int scalers_num,
+                      float r_scale,
+                      float g_scale,
+                      float b_scale,
+                      float exp_comp)
+{
+    const PIXFormat* dst_desc[SCALER_MAX_DIMS][SCALER_MAX_FBS];
+    int done[SCALER_MAX_DIMS] = {0};
+    int g, y, line_size, strip_lines;
+
+    if (scalers_num > SCALER_MAX_DIMS) {
+        E("%s: Too many destination dimensions %d", __FUNCTION__, scalers_num);
+        return -1;
+    }
+    for (g = 0; g < scalers_num; g++) {
+        if (_scaler_prepare(scalers[g], frame, framebuffers[g], fbs_num[g],
+                            dst_desc[g], exp_comp)) {
+            return -1;
+        }
+    }
+    if (scalers_num == 0) {
+        return 0;
+    }
+
+    /* The source panes are walked once, in strips of lines that fit in the
+     * cache. Each scaler produces the destination lines of a strip, rounded
+     * to line pairs, before moving on to the next strip. */
+    line_size = frame->width * 3 / 2 * (scalers[0]->src16 != NULL ? 2 : 1);
+    strip_lines = (SCALER_STRIP_BYTES / line_size) & ~1;
+    if (strip_lines < 2) {
+        strip_lines = 2;
+    }
+    for (y = 0; y < frame->height; y += strip_lines) {
+        const int y_end = (frame->height - y < strip_lines) ?
+                          frame->height : y + strip_lines;
+        for (g = 0; g < scalers_num; g++) {
+            FrameScaler* sc = scalers[g];
+            const int end = (y_end == frame->height) ? sc->dst_height :
+                (int)((int64_t)y_end * sc->dst_height / frame->height) & ~1;
+            if (end > done[g]) {
+                _scaler_convert_lines(sc, frame, framebuffers[g], dst_desc[g],
+                                      fbs_num[g], done[g], end, r_scale,
+                                      g_scale, b_scale);
+                done[g] = end;
+            }
         }
     }
 
@@ -43,7 +43,10 @@ extern int has_converter(uint32_t from, uint32_t to);
  * preview window. Since these two framebuffers have different pixel formats
  * (most of the time), we need to do two conversions for each frame received from
  * the camera. This is the main intention behind this routine: to have a one call
- * that produces as many conversions as needed.
+ * that produces as many conversions as needed. When there are several
+ * framebuffers, the frame is converted in strips of lines that fit in the
+ * cache, each strip being converted to all the framebuffers in turn, so that
+ * the frame is read from the memory only once.
  * Param:
  *  frame - Frame to convert.
  *  pixel_format - Defines pixel format for the converting framebuffer.
@@ -71,5 +74,109 @@ extern int convert_frame(const void* frame,
                          float b_scale,
                          float exp_comp);
 
+/* Describes a decoded 4:2:0 frame, whose panes may live in separate buffers
+ * with their own line sizes (as produced by a video decoder). Panes of high
+ * bit depth frames (P010, YUV420P10, and YUV420P12) contain 16 bit samples.
+ */
+typedef struct PlanarFrame {
+    /* Pixel format of the frame (V4L2_PIX_FMT_XXX). */
+    uint32_t        pixel_format;
+    /* Frame dimensions. */
+    int             width;
+    int             height;
+    /* Y, U and V panes. For formats with an interleaved UV pane the second
+     * entry addresses the UV pane, and the third one is ignored. */
+    const uint8_t*  panes[3];
+    /* Byte size of a line in each of the panes. */
+    int             linesize[3];
+} PlanarFrame;
+
+/* Scaling converter, caching the scaling tables and line buffers between
+ * frames. */
+typedef struct FrameScaler FrameScaler;
+
+/* Checks if a scaling conversion between two pixel formats is available.
+ * Param:
+ *  from - Pixel format of the source PlanarFrame.
+ *  to - Pixel format to convert to.
+ * Return:
+ *  boolean: 1 if converter is available, or 0 if no conversion exists.
+ */
+extern int has_scaling_converter(uint32_t from, uint32_t to);
+
+/* Gets a scaling converter for the given source and destination dimensions.
+ * Similarly to sws_getCachedContext, if 'scaler' already matches the
+ * dimensions it is returned as is, otherwise it is freed and a new one is
+ * allocated.
+ * Param:
+ *  scaler - Previously used scaler, or NULL.
+ *  src_width, src_height - Source frame dimensions.
+ *  dst_width, dst_height - Destination framebuffers dimensions.
+ * Return:
+ *  Scaling converter on success, or NULL on failure.
+ */
+extern FrameScaler* frame_scaler_get(FrameScaler* scaler,
+                                     int src_width,
+                                     int src_height,
+                                     int dst_width,
+                                     int dst_height);
+
+/* Frees a scaling converter obtained with frame_scaler_get. */
+extern void frame_scaler_free(FrameScaler* scaler);
+
+/* Scales a frame into multiple framebuffers in a single pass.
+ * The source panes are walked once, a strip of lines at a time: each
+ * destination line is resampled, white balanced and exposure compensated once,
+ * and then written out to every framebuffer while it is still in the cache.
+ * Param:
+ *  scaler - Scaling converter obtained with frame_scaler_get.
+ *  frame - Frame to convert. Its dimensions must match the ones the scaler
+ *      was obtained for.
+ *  framebuffers - Array of framebuffers where to convert the frame. Each
+ *      framebuffer must be large enough to contain a frame of the destination
+ *      dimensions the scaler was obtained for.
+ *  fbs_num - Number of entries in the 'framebuffers' array.
+ *  r_scale, g_scale, b_scale - White balance scale.
+ *  exp_comp - Expsoure compensation.
+ * Return:
+ *  0 on success, or non-zero value on failure.
+ */
+extern int frame_scaler_convert(FrameScaler* scaler,
+                                const PlanarFrame* frame,
+                                ClientFrameBuffer* framebuffers,
+                                int fbs_num,
+                                float r_scale,
+                                float g_scale,
+                                float b_scale,
+                                float exp_comp);
+
+/* Scales a frame into framebuffers of several destination dimensions in a
+ * single pass. The source panes are walked once, in strips of lines that fit
+ * in the cache, and every scaler produces the destination lines that come
+ * from a strip before moving on to the next one.
+ * Param:
+ *  scalers - Array of scaling converters obtained with frame_scaler_get, one
+ *      for each destination dimensions. All of them must have been obtained
+ *      for the frame's dimensions.
+ *  frame - Frame to convert.
+ *  framebuffers - Array of framebuffer arrays, one for each scaler, where to
+ *      convert the frame.
+ *  fbs_num - Number of entries in each of the 'framebuffers' arrays.
+ *  scalers_num - Number of entries in the 'scalers' array (at most 2).
+ *  r_scale, g_scale, b_scale - White balance scale.
+ *  exp_comp - Expsoure compensation.
+ * Return:
+ *  0 on success, or non-zero value on failure.
+ */
+extern int frame_scalers_convert(FrameScaler** scalers,
+                                 const PlanarFrame* frame,
+                                 ClientFrameBuffer** framebuffers,
+                                 const int* fbs_num,
+                                 int scalers_num,
+                                 float r_scale,
+                                 float g_scale,
+                                 float b_scale,
+                                 float exp_comp);
+
 #endif  /* ANDROID_CAMERA_CAMERA_FORMAT_CONVERTERS_H */
 // clang-format on
@@ -23,22 +23,39 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netdb.h>
-#include <libavformat/avformat.h>
+#include <linux/sockios.h>
 
+#include "arena.h"
 #include "camera-capture.h"
+#include "camera-capture-ffmpeg.h"
 #include "camera-format-converters.h"
 #include "camera-service.h"
 #include "config_env.h"
+#include "frame_pool.h"
+#include "frame_proto.h"
 #include "misc.h"
 #include "logger.h"
+#include "net_pack.h"
+#include "peer.h"
+#include "probe_cache.h"
+#include "query_reader.h"
 #include "remote_command.h"
+#include "send_queue.h"
+#include "shm_ring.h"
+#include "switch_mailbox.h"
+#include "worker_pool.h"
+#include "zerocopy.h"
 
 #define LOG_TAG "camera-service"
 #define  T(...) D(__VA_ARGS__)
@@ -51,6 +68,27 @@
 /* Maximum number of supported emulated cameras. */
 #define MAX_CAMERA      8
 
+/* Number of frame buffers rotated through when frames are sent without copy. */
+#define FRAME_RING_SIZE 4
+
+/* How long to wait for the kernel to release a frame buffer sent without
+ * copy, in milliseconds. */
+#define ZEROCOPY_WAIT_MS 1000
+
+/* Number of slots in the shared memory frame ring. */
+#define SHM_RING_SLOTS  4
+
+/* Frame rate of streams, when neither the client nor the source have one. */
+#define STREAM_DEFAULT_FPS 30
+
+/* Shortest period the rate replies are taken in is measured over, in
+ * microseconds. */
+#define DRAIN_SAMPLE_US 20000
+
+/* Shortest wait before retrying a streamed frame dropped for a slow guest, in
+ * microseconds. */
+#define STREAM_RETRY_MIN_US 1000
+
 /* Camera sevice descriptor. */
 typedef struct CameraServiceDesc CameraServiceDesc;
 struct CameraServiceDesc {
@@ -60,14 +98,113 @@ struct CameraServiceDesc {
     CameraInfo  camera_info[MAX_CAMERA];
     /* Number of camera devices connected to the host. */
     int         camera_count;
+    /* Arena the camera information is allocated from, or NULL to use malloc.
+     */
+    arena_t*    arena;
 };
 
-static void qemud_client_send(QemudClient* qc, const uint8_t* buf, size_t size)
+/* Sends a reply made of several buffers to the client with as few syscalls as
+ * possible, and without interleaving it with anything else. With a send queue,
+ * the reply is queued instead, and goes out as the socket takes it.
+ * Param:
+ *  qc - Qemu client to send the reply to.
+ *  iov, iovcnt - Buffers to send. Note that the array is modified on short
+ *      writes.
+ *  borrowed - Number of buffers, at the end of iov, the send queue may use
+ *      until the reply is done rather than copy them. See
+ *      _qemu_client_wait_sent.
+ * Return:
+ *  0 on success, or -1 on failure.
+ */
+static int qemud_client_sendv(QemudClient* qc, struct iovec* iov, int iovcnt,
+                              int borrowed)
+{
+    struct msghdr msg;
+    size_t len = 0;
+    int n;
+
+    if (qc->sendq != NULL) {
+        return send_queue_push(qc->sendq, iov, iovcnt, borrowed);
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    for (n = 0; n < iovcnt; n++) {
+        len += iov[n].iov_len;
+    }
+
+    while (msg.msg_iovlen > 0) {
+        /* Large replies go out without copy when enabled for the connection. */
+        ssize_t sent = (qc->zerocopy != NULL) ?
+            zerocopy_sendmsg(qc->zerocopy, &msg, len, MSG_NOSIGNAL) :
+            sendmsg(qc->socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("%s: Unable to send the reply: %s", __FUNCTION__, strerror(errno));
+            return -1;
+        }
+        /* Skip what has been sent, and resume from there on a short write. */
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+        len = 0;
+        for (n = 0; n < (int)msg.msg_iovlen; n++) {
+            len += msg.msg_iov[n].iov_len;
+        }
+    }
+    return 0;
+}
+
+/* Gets a token to wait on for the replies sent so far to be done with their
+ * buffers.
+ * Param:
+ *  qc - Qemu client the replies are sent to.
+ */
+static uint32_t _qemu_client_sent_token(QemudClient* qc)
+{
+    if (qc->sendq != NULL) {
+        return send_queue_token(qc->sendq);
+    }
+    return qc->zerocopy != NULL ? zerocopy_token(qc->zerocopy) : 0;
+}
+
+/* Waits until the replies sent before a token are done with their buffers.
+ * With a send queue, nothing is waited for, so that a slow client never holds
+ * the thread: the replies that are not out yet get their own copy of the
+ * buffers instead.
+ * Param:
+ *  qc - Qemu client the replies are sent to.
+ *  token - Token out of _qemu_client_sent_token.
+ *  timeout_ms - How long to wait for replies sent right away, in
+ *      milliseconds.
+ * Return:
+ *  0 once the replies are done with the buffers, 1 if the buffers can be
+ *  reused all the same as the replies copied them, or -1 while the kernel
+ *  still reads them for replies sent without copy.
+ */
+static int _qemu_client_wait_sent(QemudClient* qc, uint32_t token,
+                                  int timeout_ms)
 {
-    send(qc->socket, buf, size, 0);
+    if (qc->sendq != NULL) {
+        if (send_queue_wait(qc->sendq, token, 0) == 0) {
+            return 0;
+        }
+        return send_queue_release(qc->sendq, token) ? -1 : 1;
+    }
+    if (qc->zerocopy != NULL) {
+        return zerocopy_wait(qc->zerocopy, token, timeout_ms);
+    }
+    return 0;
 }
 
-pthread_mutex_t dec_mtx;
 //
 //#define qemud_client_send(...) (void*)(0)
 #define qemud_client_new(...) (void*)(0)
@@ -306,10 +443,12 @@ _wecam_setup(CameraServiceDesc* csd,
     /* This camera is taken. */
     found->in_use = 1;
     /* Update direction parameter. */
-    if (csd->camera_info[csd->camera_count].direction != NULL) {
+    if (csd->camera_info[csd->camera_count].direction != NULL &&
+        csd->arena == NULL) {
         free(csd->camera_info[csd->camera_count].direction);
     }
-    csd->camera_info[csd->camera_count].direction = ASTRDUP(dir);
+    csd->camera_info[csd->camera_count].direction =
+        arena_strdup(csd->arena, dir);
     D("Camera %d '%s' connected to '%s' facing %s using %.4s pixel format",
       csd->camera_count, csd->camera_info[csd->camera_count].display_name,
       csd->camera_info[csd->camera_count].device_name,
@@ -319,12 +458,18 @@ _wecam_setup(CameraServiceDesc* csd,
 }
 
 /* Initializes camera service descriptor.
+ * Param:
+ *  csd - Camera service descriptor to initialize. Camera information comes
+ *      from its arena, if it has one.
+ *  camera_num - Number of cameras to emulate, up to MAX_CAMERA.
  */
 static void
-_camera_service_init(CameraServiceDesc* csd)
+_camera_service_init(CameraServiceDesc* csd, int camera_num)
 {
     CameraInfo ci[MAX_CAMERA];
+    char dir[16];
     int connected_cnt;
+    int n;
 
     /* Enumerate camera devices connected to the host. */
     memset(ci, 0, sizeof(CameraInfo) * MAX_CAMERA);
@@ -332,12 +477,18 @@ _camera_service_init(CameraServiceDesc* csd)
     csd->camera_count = 0;
 
     /* Enumerate web cameras connected to the host. */
-    connected_cnt = enumerate_camera_devices(ci, MAX_CAMERA);
+    connected_cnt = enumerate_camera_devices(ci, camera_num, csd->arena);
     if (connected_cnt <= 0) {
         /* Nothing is connected - nothing to emulate. */
         return;
     }
-    _wecam_setup(csd, "toto", "toto", ci, connected_cnt);
+    /* Each of them gets a record of its own, facing the direction it was
+     * enumerated with. */
+    for (n = 0; n < connected_cnt; n++) {
+        snprintf(dir, sizeof(dir), "%s",
+                 ci[n].direction != NULL ? ci[n].direction : "back");
+        _wecam_setup(csd, ci[n].display_name, dir, ci, connected_cnt);
+    }
 }
 
 /* Gets camera information for the given camera device name.
@@ -360,19 +511,18 @@ _camera_service_get_camera_info_by_device_name(CameraServiceDesc* cs,
  * Helpers for handling camera client queries
  *******************************************************************************/
 
-/* Formats paload size according to the protocol, and sends it to the client.
+/* Formats paload size according to the protocol.
  * To simplify endianess handling we convert payload size to an eight characters
  * string, representing payload size value in hexadecimal format.
  * Param:
- *  qc - Qemu client to send the payload size to.
+ *  payload_size_str - Buffer where to format the payload size. The first 8
+ *      characters are to be sent to the client.
  *  payload_size - Payload size to report to the client.
  */
 static void
-_qemu_client_reply_payload(QemudClient* qc, size_t payload_size)
+_qemu_client_format_payload(char payload_size_str[9], size_t payload_size)
 {
-    char payload_size_str[9];
-    snprintf(payload_size_str, sizeof(payload_size_str), "%08zx", payload_size);
-    qemud_client_send(qc, (const uint8_t*)payload_size_str, 8);
+    snprintf(payload_size_str, 9, "%08x", (unsigned int)payload_size);
 }
 
 /*
@@ -387,6 +537,9 @@ _qemu_client_reply_payload(QemudClient* qc, size_t payload_size)
 #define OK_REPLY_DATA   OK_REPLY ":"
 /* Failure, there are data to send in reply. */
 #define KO_REPLY_DATA   KO_REPLY ":"
+/* Size of the header of a text reply: 8 hexadecimal characters of payload
+ * size, and the 3 bytes of the 'ok:'/'ko:' prefix. */
+#define REPLY_HEADER_SIZE   11
 
 /* Builds and sends a reply to a query.
  * All replies to a query in camera service have a prefix indicating whether the
@@ -407,6 +560,8 @@ _qemu_client_query_reply(QemudClient* qc,
 {
     const char* ok_ko_str;
     size_t payload_size;
+    char payload_size_str[9];
+    struct iovec iov[3];
 
     /* Make sure extra_size is 0 if extra is NULL. */
     if (extra == NULL && extra_size != 0) {
@@ -426,16 +581,20 @@ _qemu_client_query_reply(QemudClient* qc,
         ok_ko_str = ok_ko ? OK_REPLY : KO_REPLY;
     }
 
-    /* Send payload size first. */
-    _qemu_client_reply_payload(qc, payload_size);
-    /* Send 'ok[:]'/'ko[:]' next. Note that if there is no extra data, we still
+    /* Payload size goes first. */
+    _qemu_client_format_payload(payload_size_str, payload_size);
+    iov[0].iov_base = payload_size_str;
+    iov[0].iov_len = 8;
+    /* 'ok[:]'/'ko[:]' next. Note that if there is no extra data, we still
      * need to send a zero-terminator for 'ok'/'ko' string instead of the ':'
      * separator. So, one way or another, the prefix is always 3 bytes. */
-    qemud_client_send(qc, (const uint8_t*)ok_ko_str, 3);
-    /* Send extra data (if present). */
-    if (extra != NULL) {
-        qemud_client_send(qc, (const uint8_t*)extra, extra_size);
-    }
+    iov[1].iov_base = (void*)ok_ko_str;
+    iov[1].iov_len = 3;
+    /* Extra data (if present). */
+    iov[2].iov_base = (void*)extra;
+    iov[2].iov_len = extra_size;
+
+    qemud_client_sendv(qc, iov, extra_size ? 3 : 2, 0);
 }
 
 /* Replies query success ("OK") back to the client.
@@ -568,11 +727,35 @@ _factory_client_close(void*  opaque)
  * Camera client API
  *******************************************************************************/
 
+/* Frame query, out of a text 'frame' query or a binary request.
+ */
+typedef struct FrameQuery FrameQuery;
+struct FrameQuery
+{
+    /* Byte size of the requested video, and preview frames. Zero means that
+     * this particular frame is not requested. */
+    int                 video_size;
+    int                 preview_size;
+    /* White balance scales. */
+    float               r_scale;
+    float               g_scale;
+    float               b_scale;
+    /* Exposure compensation. */
+    float               exp_comp;
+    /* Whether the reply goes with a binary header. */
+    int                 binary;
+    /* Sequence number echoed in the binary reply header. */
+    uint32_t            seq;
+};
+
 /* Describes an emulated camera client.
  */
 typedef struct CameraClient CameraClient;
 struct CameraClient
 {
+    /* Arena the client and its name are allocated from, or NULL to use
+     * malloc. */
+    arena_t*            arena;
     /* Client name.
      *  On Linux this is the name of the camera device.
      *  On Windows this is the name of capturing window.
@@ -584,10 +767,39 @@ struct CameraClient
     const CameraInfo*   camera_info;
     /* Emulated camera device descriptor. */
     CameraDevice*       camera;
+    /* File the camera plays once connected, or NULL or empty for the default
+     * one. */
+    const char*         video_file;
+    /* Slot of the owner of the client where the device is kept open between
+     * connections, or NULL to close it with the client. The client takes the
+     * device from there on connect, and puts it back when freed. */
+    CameraDevice**      warm_camera;
+    /* Lock of the owner of the client, held around the operations on the
+     * device only, never around socket I/O, so that the owner can switch
+     * files from another thread without waiting for replies to go out. NULL
+     * if the owner doesn't share the device with other threads. */
+    pthread_mutex_t*    device_lock;
     /* Buffer allocated for video frames.
      * Note that memory allocated for this buffer
-     * also contains preview framebuffer. */
+     * also contains preview framebuffer. This is the current buffer of the
+     * 'frame_ring'. */
     uint8_t*            video_frame;
+    /* Ring of buffers for video and preview frames. Frames sent without copy
+     * can't be overwritten until the kernel has released them, so capture
+     * rotates through several buffers in that case, and uses only one
+     * otherwise. */
+    uint8_t*            frame_ring[FRAME_RING_SIZE];
+    /* Zero-copy token to wait on before reusing each buffer of the ring. */
+    uint32_t            frame_ring_token[FRAME_RING_SIZE];
+    /* Number of buffers in the ring, and the size they were taken from the
+     * frame pool with. */
+    int                 frame_ring_num;
+    size_t              frame_ring_size;
+    /* Index of the current buffer in the ring. */
+    int                 frame_ring_cur;
+    /* Shared memory ring frames are transferred through, or NULL if frames
+     * are sent over the connection. */
+    shm_ring_t*         shm;
     /* Preview frame buffer.
      * This address points inside the 'video_frame' buffer. */
     uint8_t*           preview_frame;
@@ -603,10 +815,116 @@ struct CameraClient
     int                 height;
     /* Number of pixels in a frame buffer. */
     int                 pixel_num;
+    /* Pixel format of the preview frames, negotiated on start. */
+    uint32_t            preview_pixel_format;
+    /* Preview frame width. */
+    int                 preview_width;
+    /* Preview frame height. */
+    int                 preview_height;
     /* Status of video and preview frame cache. */
     int                 frames_cached;
+    /* Whether the client negotiated binary frame requests on connect. */
+    int                 binary_frames;
+    /* Whether frames are streamed. */
+    int                 streaming;
+    /* Frame query the stream answers for every frame. */
+    FrameQuery          stream_query;
+    /* Interval between streamed frames, in microseconds. */
+    uint64_t            stream_interval;
+    /* Timestamp the next streamed frame is due at. */
+    uint64_t            stream_next;
+    /* Byte size of a streamed frame reply. */
+    size_t              stream_reply_size;
+    /* Bytes of replies not sent yet when last measured, and bytes of replies
+     * queued since. */
+    int                 backlog;
+    size_t              backlog_queued;
+    /* Timestamp the backlog was last measured at. */
+    uint64_t            backlog_at;
+    /* Rate the guest takes replies in, in bytes per second. */
+    uint64_t            drain_rate;
+    /* Streamed frames skipped because the guest was a frame behind. */
+    uint64_t            frames_dropped;
+    /* Streamed frames that became due while the send buffer was full, and went
+     * out as a single one. */
+    uint64_t            frames_coalesced;
+    /* File switches of the camera, or NULL if it has none. */
+    switch_mailbox_t*   switches;
 };
 
+/* Takes the lock on the device of a camera client, if it has one. */
+static void
+_camera_client_lock_device(CameraClient* cc)
+{
+    if (cc->device_lock != NULL) {
+        pthread_mutex_lock(cc->device_lock);
+    }
+}
+
+/* Releases the lock on the device of a camera client, if it has one. */
+static void
+_camera_client_unlock_device(CameraClient* cc)
+{
+    if (cc->device_lock != NULL) {
+        pthread_mutex_unlock(cc->device_lock);
+    }
+}
+
+/* Frees the frame buffers of a camera client.
+ * Param:
+ *  cc - Camera client descriptor.
+ *  qc - Qemu client the frames have been sent to, or NULL if the connection is
+ *      gone. Frames still queued are copied before going back to the pool.
+ */
+static void
+_camera_client_free_frames(CameraClient* cc, QemudClient* qc)
+{
+    int n;
+
+    /* The kernel only holds references on the pages, it can't read freed
+     * memory: at worst, a retransmission carries the next frame written. */
+    if (qc != NULL &&
+        _qemu_client_wait_sent(qc, _qemu_client_sent_token(qc),
+                               ZEROCOPY_WAIT_MS) < 0) {
+        D("%s: Frames of camera '%s' are still read by the kernel, reusing "
+          "them anyway", __FUNCTION__, cc->device_name);
+    }
+    for (n = 0; n < cc->frame_ring_num; n++) {
+        frame_pool_put(cc->frame_ring[n], cc->frame_ring_size);
+        cc->frame_ring[n] = NULL;
+    }
+    cc->frame_ring_num = 0;
+    cc->video_frame = NULL;
+}
+
+/* Stops pushing frames to a camera client.
+ * Param:
+ *  cc - Camera client descriptor.
+ *  qc - Qemu client the frames were pushed to, or NULL if the connection is
+ *      gone.
+ */
+static void
+_camera_client_stop_stream(CameraClient* cc, QemudClient* qc)
+{
+    int lowat = 0;
+
+    if (!cc->streaming) {
+        return;
+    }
+    cc->streaming = 0;
+    if (cc->frames_dropped != 0 || cc->frames_coalesced != 0) {
+        I("%s: Camera '%s' dropped %llu and coalesced %llu streamed frames",
+          __FUNCTION__, cc->device_name,
+          (unsigned long long)cc->frames_dropped,
+          (unsigned long long)cc->frames_coalesced);
+    }
+    /* Back to the system wide send buffer low mark. */
+    if (qc != NULL) {
+        setsockopt(qc->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                   sizeof(lowat));
+    }
+}
+
 /* Frees emulated camera client descriptor. */
 static void
 _camera_client_free(CameraClient* cc)
@@ -617,10 +935,24 @@ _camera_client_free(CameraClient* cc)
         ((CameraInfo*)cc->camera_info)->in_use = 0;
     }
     if (cc->camera != NULL) {
-        camera_device_close(cc->camera);
+        /* Keep the device, its decoder and playback position for the next
+         * connection, unless one is kept already. */
+        if (cc->warm_camera != NULL && *cc->warm_camera == NULL) {
+            *cc->warm_camera = cc->camera;
+        } else {
+            camera_device_close(cc->camera);
+        }
+    }
+    _camera_client_stop_stream(cc, NULL);
+    if (cc->shm != NULL) {
+        shm_ring_destroy(cc->shm);
     }
     if (cc->video_frame != NULL) {
-        free(cc->video_frame);
+        _camera_client_free_frames(cc, NULL);
+    }
+    /* What comes from an arena goes away with the rest of the connection. */
+    if (cc->arena != NULL) {
+        return;
     }
     if (cc->device_name != NULL) {
         free(cc->device_name);
@@ -645,17 +977,26 @@ _camera_client_create(CameraServiceDesc* csd, const char* param)
 {
     CameraClient* cc;
     CameraInfo* ci;
+    char name[64];
     int res;
-    ANEW0(cc);
+
+    cc = (CameraClient*)arena_calloc(csd->arena, sizeof(CameraClient));
+    if (cc == NULL) {
+        E("%s: Not enough memory for the camera client", __FUNCTION__);
+        return NULL;
+    }
+    cc->arena = csd->arena;
 
     /*
      * Parse parameter string, containing camera client properties.
      */
 
     /* Pull required device name. */
-    if (get_token_value_alloc(param, "name", &cc->device_name)) {
+    if (get_token_value(param, "name", name, sizeof(name)) ||
+        (cc->device_name = arena_strdup(cc->arena, name)) == NULL) {
         E("%s: Allocation failure, or required 'name' parameter is missing, or misformed in '%s'",
           __FUNCTION__, param);
+        _camera_client_free(cc);
         return NULL;
     }
 
@@ -701,6 +1042,8 @@ _camera_client_create(CameraServiceDesc* csd, const char* param)
     ci->in_use = 1;
     cc->camera_info = ci;
     cc->video_frame = NULL;
+    cc->frame_ring_num = 0;
+    cc->shm = NULL;
     cc->camera = NULL;
 
     D("%s: Camera service is created for device '%s' using input channel %d",
@@ -717,20 +1060,54 @@ _camera_client_create(CameraServiceDesc* csd, const char* param)
  * Param:
  *  cc - Queried camera client descriptor.
  *  qc - Qemu client for the emulated camera.
- *  param - Query parameters. There are no parameters expected for this query.
+ *  param - Query parameters. Parameters for this query are optional, and
+ *      formatted as such:
+ *          version=<version>
+ *      where 'version' is the highest protocol version the client supports
+ *      (see frame_proto.h). When present, reply data is formatted as such:
+ *          version=<version>
+ *      where 'version' is the protocol version used from then on.
  */
 static void
 _camera_client_query_connect(CameraClient* cc, QemudClient* qc, const char* param)
 {
+    int version = -1;
+    char reply[32];
+
+    /* Negotiate the protocol: the highest version both ends support. */
+    if (param != NULL && !get_token_value_int(param, "version", &version)) {
+        if (version > FRAME_PROTO_VERSION) {
+            version = FRAME_PROTO_VERSION;
+        } else if (version < FRAME_PROTO_TEXT) {
+            version = FRAME_PROTO_TEXT;
+        }
+        cc->binary_frames = (version >= FRAME_PROTO_BINARY);
+        snprintf(reply, sizeof(reply), "version=%d", version);
+        D("%s: Camera '%s' uses protocol %s", __FUNCTION__, cc->device_name,
+          reply);
+    }
+
     if (cc->camera != NULL) {
         /* Already connected. */
         W("%s: Camera '%s' is already connected", __FUNCTION__, cc->device_name);
-        _qemu_client_reply_ok(qc, "Camera is already connected");
+        _qemu_client_reply_ok(qc, version >= 0 ? reply :
+                                  "Camera is already connected");
         return;
     }
 
-    /* Open camera device. */
-    cc->camera = camera_device_open(cc->device_name, cc->inp_channel);
+    /* Take the device kept warm since the previous connection, or open it. */
+    _camera_client_lock_device(cc);
+    if (cc->warm_camera != NULL && *cc->warm_camera != NULL) {
+        cc->camera = *cc->warm_camera;
+        *cc->warm_camera = NULL;
+        D("%s: Camera device '%s' is reattached", __FUNCTION__,
+          cc->device_name);
+    } else if (cc->video_file != NULL && cc->video_file[0] != '\0') {
+        cc->camera = camera_device_open_file(cc->video_file);
+    } else {
+        cc->camera = camera_device_open(cc->device_name, cc->inp_channel);
+    }
+    _camera_client_unlock_device(cc);
     if (cc->camera == NULL) {
         E("%s: Unable to open camera device '%s'", __FUNCTION__, cc->device_name);
         _qemu_client_reply_ko(qc, "Unable to open camera device.");
@@ -739,7 +1116,7 @@ _camera_client_query_connect(CameraClient* cc, QemudClient* qc, const char* para
 
     D("%s: Camera device '%s' is now connected", __FUNCTION__, cc->device_name);
 
-    _qemu_client_reply_ok(qc, NULL);
+    _qemu_client_reply_ok(qc, version >= 0 ? reply : NULL);
 }
 
 /* Client has queried disconection from the camera.
@@ -770,14 +1147,40 @@ _camera_client_query_disconnect(CameraClient* cc,
     }
 
     /* Close camera device. */
+    _camera_client_lock_device(cc);
     camera_device_close(cc->camera);
     cc->camera = NULL;
+    _camera_client_unlock_device(cc);
 
     D("Camera device '%s' is now disconnected", cc->device_name);
 
     _qemu_client_reply_ok(qc, NULL);
 }
 
+/* Parses frame dimensions formatted as "<width>x<height>".
+ * Param:
+ *  dim - Dimensions string. Note that this string is modified by the routine.
+ *  width, height - Upon success contain the parsed frame width and height.
+ * Return:
+ *  0 on success, or -1 if the string is not a valid frame dimension.
+ */
+static int
+_parse_frame_dim(char* dim, int* width, int* height)
+{
+    char* w = strchr(dim, 'x');
+    if (w == NULL || w[1] == '\0') {
+        return -1;
+    }
+    *w = '\0'; w++;
+    errno = 0;
+    *width = strtoi(dim, NULL, 10);
+    *height = strtoi(w, NULL, 10);
+    if (errno || *width <= 0 || *height <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
 /* Client has queried the client to start capturing video.
  * Param:
  *  cc - Queried camera client descriptor.
@@ -788,13 +1191,19 @@ _camera_client_query_disconnect(CameraClient* cc,
  *      values for the capturing video frame width, and height, and 'format' must
  *      be a numerical value for the pixel format of the video frames expected by
  *      the client. 'format' must be one of the V4L2_PIX_FMT_XXX values.
+ *      Parameters may also contain an optional 'prevpix', and an optional
+ *      'prevdim' parameter, negotiating the preview frames: 'prevpix' must be
+ *      "prevpix=<format>", where 'format' is either V4L2_PIX_FMT_RGB32 (the
+ *      default), or V4L2_PIX_FMT_RGB565, and 'prevdim' must be
+ *      "prevdim=<width>x<height>", no larger than 'dim' (which is the default).
  */
 static void
 _camera_client_query_start(CameraClient* cc, QemudClient* qc, const char* param)
 {
-    char* w;
     char dim[64];
     int width, height, pix_format;
+    int prev_format, prev_width, prev_height;
+    int res, n;
 
     /* Sanity check. */
     if (cc->camera == NULL) {
@@ -829,19 +1238,34 @@ _camera_client_query_start(CameraClient* cc, QemudClient* qc, const char* param)
     }
 
     /* Parse 'dim' parameter, and get requested frame width and height. */
-    w = strchr(dim, 'x');
-    if (w == NULL || w[1] == '\0') {
+    if (_parse_frame_dim(dim, &width, &height)) {
         E("%s: Invalid 'dim' parameter in '%s'", __FUNCTION__, param);
         _qemu_client_reply_ko(qc, "Invalid 'dim' parameter");
         return;
     }
-    *w = '\0'; w++;
-    errno = 0;
-    width = strtoi(dim, NULL, 10);
-    height = strtoi(w, NULL, 10);
-    if (errno) {
-        E("%s: Invalid 'dim' parameter in '%s'", __FUNCTION__, param);
-        _qemu_client_reply_ko(qc, "Invalid 'dim' parameter");
+
+    /* Pull optional 'prevpix' parameter. */
+    res = get_token_value_int(param, "prevpix", &prev_format);
+    if (res == -1) {
+        /* Omitted: preview window is fed with RGB32 frames. */
+        prev_format = V4L2_PIX_FMT_RGB32;
+    } else if (res != 0 || (prev_format != V4L2_PIX_FMT_RGB32 &&
+                            prev_format != V4L2_PIX_FMT_RGB565)) {
+        E("%s: Invalid 'prevpix' parameter in '%s'", __FUNCTION__, param);
+        _qemu_client_reply_ko(qc, "Invalid 'prevpix' parameter");
+        return;
+    }
+
+    /* Pull optional 'prevdim' parameter. */
+    res = get_token_value(param, "prevdim", dim, sizeof(dim));
+    if (res == -1) {
+        /* Omitted: preview frames have the video frame dimensions. */
+        prev_width = width;
+        prev_height = height;
+    } else if (res != 0 || _parse_frame_dim(dim, &prev_width, &prev_height) ||
+               prev_width > width || prev_height > height) {
+        E("%s: Invalid 'prevdim' parameter in '%s'", __FUNCTION__, param);
+        _qemu_client_reply_ko(qc, "Invalid 'prevdim' parameter");
         return;
     }
 
@@ -875,6 +1299,9 @@ _camera_client_query_start(CameraClient* cc, QemudClient* qc, const char* param)
     cc->width = width;
     cc->height = height;
     cc->pixel_num = cc->width * cc->height;
+    cc->preview_pixel_format = prev_format;
+    cc->preview_width = prev_width;
+    cc->preview_height = prev_height;
     cc->frames_cached = 1;
 
     switch (cc->pixel_format) {
@@ -912,50 +1339,67 @@ _camera_client_query_start(CameraClient* cc, QemudClient* qc, const char* param)
 
     /* Make sure that we have a converters between the original camera pixel
      * format and the one that the client expects. Also a converter must exist
-     * for the preview window pixel format (RGB32) */
+     * for the preview window pixel format (RGB32, or RGB565) */
     if (!has_converter(cc->camera_info->pixel_format, cc->pixel_format) ||
-        !has_converter(cc->camera_info->pixel_format, V4L2_PIX_FMT_RGB32)) {
-        E("%s: No conversion exist between %.4s and %.4s (or RGB32) pixel formats",
-          __FUNCTION__, (char*)&cc->camera_info->pixel_format, (char*)&cc->pixel_format);
+        !has_converter(cc->camera_info->pixel_format, cc->preview_pixel_format)) {
+        E("%s: No conversion exist between %.4s and %.4s (or %.4s) pixel formats",
+          __FUNCTION__, (char*)&cc->camera_info->pixel_format, (char*)&cc->pixel_format,
+          (char*)&cc->preview_pixel_format);
         _qemu_client_reply_ko(qc, "No conversion exist for the requested pixel format");
         return;
     }
 
-    /* TODO: At the moment camera framework in the emulator requires RGB32 pixel
-     * format for preview window. So, we need to keep two framebuffers here: one
-     * for the video, and another for the preview window. Watch out when this
-     * changes (if changes). */
-    cc->preview_frame_size = cc->pixel_num * 4;
-
-    /* Allocate buffer large enough to contain both, video and preview
-     * framebuffers. */
-    cc->video_frame =
-        (uint8_t*)malloc(cc->video_frame_size + cc->preview_frame_size);
-    if (cc->video_frame == NULL) {
-        E("%s: Not enough memory for framebuffers %lu + %lu",
-          __FUNCTION__, cc->video_frame_size, cc->preview_frame_size);
-        _qemu_client_reply_ko(qc, "Out of memory");
-        return;
+    /* We need to keep two framebuffers here: one for the video, and another
+     * for the preview window, which is 4 bytes per pixel for RGB32, and 2 bytes
+     * per pixel for RGB565. */
+    cc->preview_frame_size = cc->preview_width * cc->preview_height *
+        (cc->preview_pixel_format == V4L2_PIX_FMT_RGB565 ? 2 : 4);
+
+    /* Allocate buffers large enough to contain both, video and preview
+     * framebuffers. Several of them are needed if frames are queued, or sent
+     * without copy. They come from the frame pool, which recycles them across
+     * start and stop, and across connections. */
+    cc->frame_ring_num = (qc->sendq != NULL ||
+        (qc->zerocopy != NULL && qc->zerocopy->threshold)) ?
+        FRAME_RING_SIZE : 1;
+    cc->frame_ring_cur = 0;
+    cc->frame_ring_size = cc->video_frame_size + cc->preview_frame_size;
+    for (n = 0; n < cc->frame_ring_num; n++) {
+        cc->frame_ring[n] = (uint8_t*)frame_pool_get(cc->frame_ring_size);
+        cc->frame_ring_token[n] = 0;
+        if (cc->frame_ring[n] == NULL) {
+            E("%s: Not enough memory for framebuffers %lu + %lu",
+              __FUNCTION__, cc->video_frame_size, cc->preview_frame_size);
+            cc->frame_ring_num = n;
+            _camera_client_free_frames(cc, NULL);
+            _qemu_client_reply_ko(qc, "Out of memory");
+            return;
+        }
     }
+    cc->video_frame = cc->frame_ring[0];
 
     /* Set framebuffer pointers. */
     cc->preview_frame = (uint8_t*)(cc->video_frame + cc->video_frame_size);
 
     /* Start the camera. */
-    if (camera_device_start_capturing(cc->camera, cc->camera_info->pixel_format,
-                                      cc->width, cc->height)) {
+    _camera_client_lock_device(cc);
+    res = camera_device_start_capturing(cc->camera,
+                                        cc->camera_info->pixel_format,
+                                        cc->width, cc->height);
+    _camera_client_unlock_device(cc);
+    if (res) {
         E("%s: Cannot start camera '%s' for %.4s[%dx%d]: %s",
           __FUNCTION__, cc->device_name, (const char*)&cc->pixel_format,
           cc->width, cc->height, strerror(errno));
-        free(cc->video_frame);
-        cc->video_frame = NULL;
+        _camera_client_free_frames(cc, NULL);
         _qemu_client_reply_ko(qc, "Cannot start the camera");
         return;
     }
 
-    D("%s: Camera '%s' is now started for %.4s[%dx%d]",
+    D("%s: Camera '%s' is now started for %.4s[%dx%d], preview %.4s[%dx%d]",
       __FUNCTION__, cc->device_name, (char*)&cc->pixel_format, cc->width,
-      cc->height);
+      cc->height, (char*)&cc->preview_pixel_format, cc->preview_width,
+      cc->preview_height);
 
     _qemu_client_reply_ok(qc, NULL);
 }
@@ -969,6 +1413,8 @@ _camera_client_query_start(CameraClient* cc, QemudClient* qc, const char* param)
 static void
 _camera_client_query_stop(CameraClient* cc, QemudClient* qc, const char* param)
 {
+    int res;
+
     if (cc->video_frame == NULL) {
         /* Not started. */
         W("%s: Camera '%s' is not started", __FUNCTION__, cc->device_name);
@@ -977,48 +1423,46 @@ _camera_client_query_stop(CameraClient* cc, QemudClient* qc, const char* param)
     }
 
     /* Stop the camera. */
-    if (camera_device_stop_capturing(cc->camera)) {
+    _camera_client_lock_device(cc);
+    res = camera_device_stop_capturing(cc->camera);
+    _camera_client_unlock_device(cc);
+    if (res) {
         E("%s: Cannot stop camera device '%s': %s",
           __FUNCTION__, cc->device_name, strerror(errno));
         _qemu_client_reply_ko(qc, "Cannot stop camera device");
         return;
     }
 
-    free(cc->video_frame);
-    cc->video_frame = NULL;
+    _camera_client_stop_stream(cc, qc);
+    if (cc->shm != NULL) {
+        shm_ring_destroy(cc->shm);
+        cc->shm = NULL;
+    }
+    _camera_client_free_frames(cc, qc);
 
     D("%s: Camera device '%s' is now stopped.", __FUNCTION__, cc->device_name);
     _qemu_client_reply_ok(qc, NULL);
 }
 
-/* Client has queried next frame.
+/* Client has queried frames to be transferred through shared memory.
+ * Once this query succeeds, frames are written into a ring of slots in a memfd
+ * that the client maps, and replies to 'frame' queries contain "slot=<index>"
+ * instead of the frames. See shm_ring.h for the layout of the ring. This only
+ * works for clients running on the same host.
  * Param:
  *  cc - Queried camera client descriptor.
  *  qc - Qemu client for the emulated camera.
- *  param - Query parameters. Parameters for this query are formatted as such:
- *          video=<size> preview=<size> whiteb=<red>,<green>,<blue> expcomp=<comp>
- *      where:
- *       - 'video', and 'preview' both must be decimal values, defining size of
- *         requested video, and preview frames respectively. Zero value for any
- *         of these parameters means that this particular frame is not requested.
- *       - whiteb contains float values required to calculate whilte balance.
- *       - expcomp contains a float value required to calculate exposure
- *         compensation.
+ *  param - Query parameters. There are no parameters expected for this query.
+ *      Reply data is formatted as such:
+ *          path=<path> slots=<num> size=<size>
+ *      where 'path' is the path the client opens to map the ring, 'num' is the
+ *      number of slots in the ring, and 'size' is the byte size of a slot.
  */
 static void
-_camera_client_query_frame(CameraClient* cc, QemudClient* qc, const char* param)
+_camera_client_query_shm(CameraClient* cc, QemudClient* qc, const char* param)
 {
-    int video_size = 0;
-    int preview_size = 0;
-    int repeat;
-    ClientFrameBuffer fbs[2];
-    int fbs_num = 0;
-    size_t payload_size;
-    uint64_t tick;
-    float r_scale = 1.0f, g_scale = 1.0f, b_scale = 1.0f, exp_comp = 1.0f;
-    char tmp[256];
+    char reply[128];
 
-    /* Sanity check. */
     if (cc->video_frame == NULL) {
         /* Not started. */
         E("%s: Camera '%s' is not started", __FUNCTION__, cc->device_name);
@@ -1026,31 +1470,147 @@ _camera_client_query_frame(CameraClient* cc, QemudClient* qc, const char* param)
         return;
     }
 
+    if (cc->shm == NULL) {
+        cc->shm = shm_ring_create(SHM_RING_SLOTS,
+                                  cc->video_frame_size + cc->preview_frame_size);
+        if (cc->shm == NULL) {
+            E("%s: Unable to create frame ring for camera '%s'",
+              __FUNCTION__, cc->device_name);
+            _qemu_client_reply_ko(qc, "Unable to create shared memory");
+            return;
+        }
+    }
+
+    snprintf(reply, sizeof(reply), "path=%s slots=%d size=%zu",
+             cc->shm->path, cc->shm->slot_num, cc->shm->slot_size);
+    D("%s: Camera '%s' frames go through %s", __FUNCTION__, cc->device_name,
+      reply);
+    _qemu_client_reply_ok(qc, reply);
+}
+
+/* Parses the parameters of a text 'frame' query.
+ * Param:
+ *  param - Query parameters. See _camera_client_query_frame.
+ *  fq - Upon success contains the parsed frame query.
+ * Return:
+ *  0 on success, or -1 if 'video' or 'preview' is missing.
+ */
+static int
+_parse_frame_query(const char* param, FrameQuery* fq)
+{
+    char tmp[256];
+
+    memset(fq, 0, sizeof(*fq));
+    fq->r_scale = fq->g_scale = fq->b_scale = fq->exp_comp = 1.0f;
+
     /* Pull required parameters. */
-    if (get_token_value_int(param, "video", &video_size) ||
-        get_token_value_int(param, "preview", &preview_size)) {
-        E("%s: Invalid or missing 'video', or 'preview' parameter in '%s'",
-          __FUNCTION__, param);
-        _qemu_client_reply_ko(qc,
-            "Invalid or missing 'video', or 'preview' parameter");
-        return;
+    if (param == NULL ||
+        get_token_value_int(param, "video", &fq->video_size) ||
+        get_token_value_int(param, "preview", &fq->preview_size)) {
+        return -1;
     }
 
     /* Pull white balance values. */
     if (!get_token_value(param, "whiteb", tmp, sizeof(tmp))) {
-        if (sscanf(tmp, "%g,%g,%g", &r_scale, &g_scale, &b_scale) != 3) {
+        if (sscanf(tmp, "%g,%g,%g", &fq->r_scale, &fq->g_scale,
+                   &fq->b_scale) != 3) {
             D("Invalid value '%s' for parameter 'whiteb'", tmp);
-            r_scale = g_scale = b_scale = 1.0f;
+            fq->r_scale = fq->g_scale = fq->b_scale = 1.0f;
         }
     }
 
     /* Pull exposure compensation. */
     if (!get_token_value(param, "expcomp", tmp, sizeof(tmp))) {
-        if (sscanf(tmp, "%g", &exp_comp) != 1) {
+        if (sscanf(tmp, "%g", &fq->exp_comp) != 1) {
             D("Invalid value '%s' for parameter 'whiteb'", tmp);
-            exp_comp = 1.0f;
+            fq->exp_comp = 1.0f;
         }
     }
+    return 0;
+}
+
+/* Fills the binary header of a frame reply. See frame_proto.h for its layout.
+ * Param:
+ *  hdr - Header to fill.
+ *  fq - Frame query replied to.
+ *  status - FRAME_STATUS_OK, or FRAME_STATUS_KO.
+ *  tick - Capture timestamp.
+ *  slot - Shared memory slot holding the frames, or -1.
+ *  msg_size - Byte size of the error message following the frames.
+ */
+static void
+_frame_reply_header(unsigned char hdr[FRAME_REPLY_SIZE], const FrameQuery* fq,
+                    int status, uint64_t tick, int slot, size_t msg_size)
+{
+    memset(hdr, 0, FRAME_REPLY_SIZE);
+    hdr[0] = FRAME_PROTO_MARKER;
+    hdr[1] = status;
+    packi32(hdr + 4, fq->seq);
+    packi64(hdr + 8, tick);
+    packi32(hdr + 16, status == FRAME_STATUS_OK ? fq->video_size : 0);
+    packi32(hdr + 20, status == FRAME_STATUS_OK ? fq->preview_size : 0);
+    packi32(hdr + 24, (uint32_t)slot);
+    packi32(hdr + 28, msg_size);
+}
+
+/* Replies a failed frame query, in the protocol it has been made with.
+ * Param:
+ *  qc - Qemu client to send the reply to.
+ *  fq - Frame query replied to.
+ *  ko_str - Error message.
+ */
+static void
+_camera_client_frame_reply_ko(QemudClient* qc, const FrameQuery* fq,
+                              const char* ko_str)
+{
+    unsigned char hdr[FRAME_REPLY_SIZE];
+    struct iovec iov[2];
+
+    if (!fq->binary) {
+        _qemu_client_reply_ko(qc, ko_str);
+        return;
+    }
+    _frame_reply_header(hdr, fq, FRAME_STATUS_KO, _get_timestamp(), -1,
+                        strlen(ko_str));
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = FRAME_REPLY_SIZE;
+    iov[1].iov_base = (void*)ko_str;
+    iov[1].iov_len = strlen(ko_str);
+    qemud_client_sendv(qc, iov, 2, 0);
+}
+
+/* Captures a frame, and sends it to the client.
+ * Param:
+ *  cc - Queried camera client descriptor.
+ *  qc - Qemu client for the emulated camera.
+ *  fq - Frame query, out of a text or a binary query.
+ */
+static void
+_camera_client_capture_frame(CameraClient* cc, QemudClient* qc,
+                             const FrameQuery* fq)
+{
+    const int video_size = fq->video_size;
+    const int preview_size = fq->preview_size;
+    int repeat;
+    ClientFrameBuffer fbs[2];
+    int fbs_num = 0;
+    size_t payload_size;
+    char payload_size_str[9];
+    unsigned char hdr[FRAME_REPLY_SIZE];
+    struct iovec iov[4];
+    int iovcnt = 0;
+    int n;
+    uint8_t* prev_frame;
+    int slot = 0;
+    uint64_t tick;
+
+    /* Sanity check. */
+    if (cc->video_frame == NULL) {
+        /* Not started. */
+        E("%s: Camera '%s' is not started", __FUNCTION__, cc->device_name);
+        _camera_client_frame_reply_ko(qc, fq, "Camera is not started");
+        return;
+    }
 
     /* Verify that framebuffer sizes match the ones that the started camera
      * operates with. */
@@ -1060,42 +1620,59 @@ _camera_client_query_frame(CameraClient* cc, QemudClient* qc, const char* param)
           "Expected %lu for video, and %lu for preview. Requested %d, and %d",
           __FUNCTION__, cc->device_name, cc->video_frame_size,
           cc->preview_frame_size, video_size, preview_size);
-        _qemu_client_reply_ko(qc, "Frame size mismatch");
+        _camera_client_frame_reply_ko(qc, fq, "Frame size mismatch");
         return;
     }
 
+    /* Move on to the next buffer of the ring, once the frames it holds are
+     * sent or copied. The kernel may still read a buffer sent without copy, so
+     * the frame is skipped rather than written over it. With the shared memory
+     * transport, frames go straight into the next slot of the shared ring
+     * instead. */
+    prev_frame = cc->video_frame;
+    if (cc->shm != NULL) {
+        slot = shm_ring_next(cc->shm);
+        cc->video_frame = shm_ring_slot(cc->shm, slot);
+        cc->preview_frame = cc->video_frame + cc->video_frame_size;
+    } else if (cc->frame_ring_num > 1) {
+        const int next = (cc->frame_ring_cur + 1) % cc->frame_ring_num;
+        if (_qemu_client_wait_sent(qc, cc->frame_ring_token[next],
+                                   ZEROCOPY_WAIT_MS) < 0) {
+            W("%s: Frame buffer of camera '%s' is still in flight, skipping "
+              "the frame", __FUNCTION__, cc->device_name);
+            _camera_client_frame_reply_ko(qc, fq, "Frame buffer in flight");
+            return;
+        }
+        cc->frame_ring_cur = next;
+        cc->video_frame = cc->frame_ring[next];
+        cc->preview_frame = cc->video_frame + cc->video_frame_size;
+    }
+
     /*
      * Initialize framebuffer array for frame read.
      */
 
     if (video_size) {
-        int pix_fmt = AV_PIX_FMT_YUV420P;
-        switch (cc->pixel_format) {
-            case V4L2_PIX_FMT_YUV420:
-                pix_fmt = AV_PIX_FMT_YUV420P;
-                break;
-            case V4L2_PIX_FMT_NV21:
-                pix_fmt = AV_PIX_FMT_NV21;
-                break;
-        }
-        fbs[fbs_num].pixel_format = pix_fmt;
+        fbs[fbs_num].pixel_format = cc->pixel_format;
         fbs[fbs_num].framebuffer = cc->video_frame;
+        fbs[fbs_num].width = cc->width;
+        fbs[fbs_num].height = cc->height;
         fbs_num++;
     }
     if (preview_size) {
-        /* TODO: Watch out for preview format changes! */
-        fbs[fbs_num].pixel_format = AV_PIX_FMT_RGBA;
+        fbs[fbs_num].pixel_format = cc->preview_pixel_format;
         fbs[fbs_num].framebuffer = cc->preview_frame;
+        fbs[fbs_num].width = cc->preview_width;
+        fbs[fbs_num].height = cc->preview_height;
         fbs_num++;
-    } else
-    {
-        memset(&(fbs[fbs_num]), 0, sizeof(fbs[fbs_num]));
     }
 
     /* Capture new frame. */
     tick = _get_timestamp();
-    repeat = camera_device_read_frame(cc->camera, fbs, fbs_num,
-                                      r_scale, g_scale, b_scale, exp_comp);
+    _camera_client_lock_device(cc);
+    repeat = camera_device_read_frame(cc->camera, fbs, fbs_num, fq->r_scale,
+                                      fq->g_scale, fq->b_scale, fq->exp_comp);
+    _camera_client_unlock_device(cc);
 
     /* Note that there is no (known) way how to wait on next frame being
      * available, so we could dequeue frame buffer from the device only when we
@@ -1113,73 +1690,434 @@ _camera_client_query_frame(CameraClient* cc, QemudClient* qc, const char* param)
         E("REPEAT");
         /* Sleep for 10 millisec before repeating the attempt. */
         _camera_sleep(10);
+        _camera_client_lock_device(cc);
         repeat = camera_device_read_frame(cc->camera, fbs, fbs_num,
-                                          r_scale, g_scale, b_scale, exp_comp);
+                                          fq->r_scale, fq->g_scale,
+                                          fq->b_scale, fq->exp_comp);
+        _camera_client_unlock_device(cc);
     }
     if (repeat == 1 && !cc->frames_cached) {
         /* Waited too long for the first frame. */
         E("%s: Unable to obtain first video frame from the camera '%s' in %d milliseconds: %s.",
           __FUNCTION__, cc->device_name,
           (uint32_t)(_get_timestamp() - tick) / 1000, strerror(errno));
-        _qemu_client_reply_ko(qc, "Unable to obtain video frame from the camera");
+        _camera_client_frame_reply_ko(qc, fq,
+            "Unable to obtain video frame from the camera");
         return;
     } else if (repeat < 0) {
         /* An I/O error. */
         E("%s: Unable to obtain video frame from the camera '%s': %s.",
           __FUNCTION__, cc->device_name, strerror(errno));
-        _qemu_client_reply_ko(qc, strerror(errno));
+        _camera_client_frame_reply_ko(qc, fq, strerror(errno));
         return;
     }
 
+    /* The device had nothing new: carry the cached frames over to the current
+     * buffer of the ring. */
+    if (repeat == 1 && cc->video_frame != prev_frame) {
+        memcpy(cc->video_frame, prev_frame,
+               cc->video_frame_size + cc->preview_frame_size);
+    }
+
     /* We have cached something... */
     cc->frames_cached = 1;
 
+    /* Shared memory transport: hand the slot over, and only send its index. */
+    if (cc->shm != NULL) {
+        char slot_str[32];
+        shm_ring_publish(cc->shm, slot, video_size, preview_size);
+        if (fq->binary) {
+            _frame_reply_header(hdr, fq, FRAME_STATUS_OK, tick, slot, 0);
+            iov[0].iov_base = hdr;
+            iov[0].iov_len = FRAME_REPLY_SIZE;
+            qemud_client_sendv(qc, iov, 1, 0);
+            cc->backlog_queued += FRAME_REPLY_SIZE;
+            return;
+        }
+        snprintf(slot_str, sizeof(slot_str), "slot=%d", slot);
+        _qemu_client_reply_ok(qc, slot_str);
+        cc->backlog_queued += REPLY_HEADER_SIZE + strlen(slot_str) + 1;
+        return;
+    }
+
     /*
      * Build the reply.
      */
 
-    /* Payload includes "ok:" + requested video and preview frames. */
-    payload_size = 3 + video_size + preview_size;
+    if (fq->binary) {
+        /* Binary header, straight followed by the frames. */
+        _frame_reply_header(hdr, fq, FRAME_STATUS_OK, tick, -1, 0);
+        iov[iovcnt].iov_base = hdr;
+        iov[iovcnt++].iov_len = FRAME_REPLY_SIZE;
+    } else {
+        /* Payload includes "ok:" + requested video and preview frames. */
+        payload_size = 3 + video_size + preview_size;
 
-    /* Send payload size first. */
-    _qemu_client_reply_payload(qc, payload_size);
+        /* Payload size goes first. */
+        _qemu_client_format_payload(payload_size_str, payload_size);
+        iov[iovcnt].iov_base = payload_size_str;
+        iov[iovcnt++].iov_len = 8;
 
-    /* After that send the 'ok:'. Note that if there is no frames sent, we should
-     * use prefix "ok" instead of "ok:" */
-    if (video_size || preview_size) {
-        qemud_client_send(qc, (const uint8_t*)"ok:", 3);
-    } else {
-        /* Still 3 bytes: zero terminator is required in this case. */
-        qemud_client_send(qc, (const uint8_t*)"ok", 3);
+        /* After that the 'ok:'. Note that if there is no frames sent, we
+         * should use prefix "ok" instead of "ok:". Still 3 bytes: zero
+         * terminator is required in this case. */
+        iov[iovcnt].iov_base = (video_size || preview_size) ? "ok:" : "ok";
+        iov[iovcnt++].iov_len = 3;
     }
 
-    /* After that send video frame (if requested). */
+    /* After that video frame (if requested). */
     if (video_size) {
-        qemud_client_send(qc, cc->video_frame, video_size);
+        iov[iovcnt].iov_base = cc->video_frame;
+        iov[iovcnt++].iov_len = video_size;
     }
 
-    /* After that send preview frame (if requested). */
+    /* After that preview frame (if requested). */
     if (preview_size) {
-        qemud_client_send(qc, (const uint8_t*)cc->preview_frame, preview_size);
+        iov[iovcnt].iov_base = cc->preview_frame;
+        iov[iovcnt++].iov_len = preview_size;
     }
+
+    /* The whole reply goes out with a single syscall (short writes aside), so
+     * small headers don't leave in packets of their own. */
+    for (n = 0; n < iovcnt; n++) {
+        cc->backlog_queued += iov[n].iov_len;
+    }
+    qemud_client_sendv(qc, iov, iovcnt,
+                       (video_size != 0) + (preview_size != 0));
+
+    /* Remember when this buffer will be free again. */
+    cc->frame_ring_token[cc->frame_ring_cur] = _qemu_client_sent_token(qc);
 }
 
-/* Handles a message received from the emulated camera client.
- * Queries received here are represented as strings:
- * - 'connect' - Connects to the camera device (opens it).
- * - 'disconnect' - Disconnexts from the camera device (closes it).
- * - 'start' - Starts capturing video from the connected camera device.
- * - 'stop' - Stop capturing video from the connected camera device.
- * - 'frame' - Queries video and preview frames captured from the camera.
+/* Client has queried next frame.
  * Param:
- *  opaque - Camera service descriptor.
- *  msg, msglen - Message received from the camera factory client.
- *  client - Camera factory client pipe.
+ *  cc - Queried camera client descriptor.
+ *  qc - Qemu client for the emulated camera.
+ *  param - Query parameters. Parameters for this query are formatted as such:
+ *          video=<size> preview=<size> whiteb=<red>,<green>,<blue> expcomp=<comp>
+ *      where:
+ *       - 'video', and 'preview' both must be decimal values, defining size of
+ *         requested video, and preview frames respectively. Zero value for any
+ *         of these parameters means that this particular frame is not requested.
+ *       - whiteb contains float values required to calculate whilte balance.
+ *       - expcomp contains a float value required to calculate exposure
+ *         compensation.
  */
 static void
-_camera_client_recv(void*         opaque,
-                    uint8_t*      msg,
-                    int           msglen,
+_camera_client_query_frame(CameraClient* cc, QemudClient* qc, const char* param)
+{
+    FrameQuery fq;
+
+    if (_parse_frame_query(param, &fq)) {
+        E("%s: Invalid or missing 'video', or 'preview' parameter in '%s'",
+          __FUNCTION__, param ? param : "");
+        _qemu_client_reply_ko(qc,
+            "Invalid or missing 'video', or 'preview' parameter");
+        return;
+    }
+    _camera_client_capture_frame(cc, qc, &fq);
+}
+
+/* Client has queried next frame with a binary request.
+ * Param:
+ *  cc - Queried camera client descriptor.
+ *  qc - Qemu client for the emulated camera.
+ *  req - FRAME_REQUEST_SIZE bytes request, see frame_proto.h for its layout.
+ */
+static void
+_camera_client_query_frame_bin(CameraClient* cc, QemudClient* qc,
+                               unsigned char* req)
+{
+    FrameQuery fq;
+
+    fq.binary = 1;
+    fq.seq = unpacku32(req + 4);
+    fq.video_size = unpacku32(req + 8);
+    fq.preview_size = unpacku32(req + 12);
+    fq.r_scale = unpack754_32(unpacku32(req + 16));
+    fq.g_scale = unpack754_32(unpacku32(req + 20));
+    fq.b_scale = unpack754_32(unpacku32(req + 24));
+    fq.exp_comp = unpack754_32(unpacku32(req + 28));
+    _camera_client_capture_frame(cc, qc, &fq);
+}
+
+/* Client has queried frames to be pushed to it.
+ * Once this query succeeds, frames are sent as replies to the given 'frame'
+ * query as they become due, without the client querying them, until the
+ * client queries 'stop'. A frame is held back while the previous one is still
+ * waiting in the send buffer, and the schedule then resumes from the time it
+ * goes out, rather than catching up with a burst of frames. Since streamed
+ * frames always carry data, the reply to 'stop' is the first one without.
+ * Clients that negotiated binary frames get them with a binary header, and
+ * sequence numbers counting from 1.
+ * Param:
+ *  cc - Queried camera client descriptor.
+ *  qc - Qemu client for the emulated camera.
+ *  param - Query parameters. Parameters for this query are the ones of the
+ *      'frame' query, plus an optional one:
+ *          fps=<rate>
+ *      where 'rate' is the number of frames to push per second. It defaults
+ *      to the frame rate of the source. Reply data is formatted as such:
+ *          fps=<rate>
+ *      where 'rate' is the frame rate of the stream.
+ */
+static void
+_camera_client_query_stream(CameraClient* cc, QemudClient* qc, const char* param)
+{
+    FrameQuery fq;
+    int video_size;
+    int preview_size;
+    int lowat;
+    double fps = 0;
+    char tmp[64];
+
+    if (cc->video_frame == NULL) {
+        /* Not started. */
+        E("%s: Camera '%s' is not started", __FUNCTION__, cc->device_name);
+        _qemu_client_reply_ko(qc, "Camera is not started");
+        return;
+    }
+
+    if (_parse_frame_query(param, &fq) ||
+        (fq.video_size == 0 && fq.preview_size == 0)) {
+        E("%s: Invalid or missing 'video', or 'preview' parameter in '%s'",
+          __FUNCTION__, param ? param : "");
+        _qemu_client_reply_ko(qc,
+            "Invalid or missing 'video', or 'preview' parameter");
+        return;
+    }
+    video_size = fq.video_size;
+    preview_size = fq.preview_size;
+    if ((video_size != 0 && cc->video_frame_size != video_size) ||
+        (preview_size != 0 && cc->preview_frame_size != preview_size)) {
+        E("%s: Frame sizes don't match for camera '%s':\n"
+          "Expected %lu for video, and %lu for preview. Requested %d, and %d",
+          __FUNCTION__, cc->device_name, cc->video_frame_size,
+          cc->preview_frame_size, video_size, preview_size);
+        _qemu_client_reply_ko(qc, "Frame size mismatch");
+        return;
+    }
+
+    if (!get_token_value(param, "fps", tmp, sizeof(tmp)) &&
+        (sscanf(tmp, "%lg", &fps) != 1 || fps <= 0)) {
+        D("Invalid value '%s' for parameter 'fps'", tmp);
+        fps = 0;
+    }
+    if (fps <= 0) {
+        _camera_client_lock_device(cc);
+        fps = camera_device_get_frame_rate(cc->camera);
+        _camera_client_unlock_device(cc);
+    }
+    if (fps <= 0) {
+        fps = STREAM_DEFAULT_FPS;
+    }
+
+    fq.binary = cc->binary_frames;
+    cc->stream_query = fq;
+    cc->streaming = 1;
+    cc->stream_interval = (uint64_t)(1000000 / fps);
+    cc->stream_next = _get_timestamp();
+
+    /* Have the socket reported writable only once less than a frame is left
+     * unsent, which is when the next frame can be pushed. */
+    lowat = (fq.binary ? FRAME_REPLY_SIZE : REPLY_HEADER_SIZE) + video_size +
+            preview_size;
+    cc->stream_reply_size = lowat;
+    if (setsockopt(qc->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                   sizeof(lowat))) {
+        W("%s: No send buffer low mark (%s), frames won't be held back",
+          __FUNCTION__, strerror(errno));
+    }
+
+    snprintf(tmp, sizeof(tmp), "fps=%g", fps);
+    D("%s: Camera '%s' streams at %s", __FUNCTION__, cc->device_name, tmp);
+    _qemu_client_reply_ok(qc, tmp);
+}
+
+/* Gets how long until the next streamed frame is due.
+ * Param:
+ *  cc - Camera client descriptor.
+ * Return:
+ *  Milliseconds until the next frame is due, 0 if it is due, or -1 if frames
+ *  are not streamed.
+ */
+static int
+_camera_client_stream_timeout(const CameraClient* cc)
+{
+    uint64_t now;
+
+    if (!cc->streaming) {
+        return -1;
+    }
+    now = _get_timestamp();
+    if (now >= cc->stream_next) {
+        return 0;
+    }
+    return (int)((cc->stream_next - now + 999) / 1000);
+}
+
+/* Measures how far behind the guest is.
+ * The rate the guest takes replies in is updated along, out of how much of the
+ * replies left the send buffer since the last measure.
+ * Param:
+ *  cc - Camera client descriptor.
+ *  qc - Qemu client for the emulated camera.
+ * Return:
+ *  Bytes of replies still queued, or in the send buffer, not sent yet.
+ */
+static int
+_camera_client_backlog(CameraClient* cc, QemudClient* qc)
+{
+    int unsent;
+    uint64_t now = _get_timestamp();
+    uint64_t drained;
+
+    if (ioctl(qc->socket, SIOCOUTQNSD, &unsent)) {
+        return 0;
+    }
+    if (qc->sendq != NULL) {
+        unsent += qc->sendq->pending;
+    }
+    if (cc->backlog_at != 0 && now - cc->backlog_at < DRAIN_SAMPLE_US) {
+        return unsent;
+    }
+    if (cc->backlog_at != 0) {
+        drained = cc->backlog + cc->backlog_queued > (size_t)unsent ?
+            cc->backlog + cc->backlog_queued - unsent : 0;
+        drained = drained * 1000000 / (now - cc->backlog_at);
+        /* Smoothed over the last few measures. */
+        cc->drain_rate = cc->drain_rate ?
+            (cc->drain_rate * 7 + drained) / 8 : drained;
+    }
+    cc->backlog = unsent;
+    cc->backlog_queued = 0;
+    cc->backlog_at = now;
+    return unsent;
+}
+
+/* Pushes the next frame of the stream.
+ * The freshest frame goes out: a frame is skipped rather than queued behind a
+ * whole one the guest has not taken yet, and frames that became due while
+ * waiting for the send buffer go out as a single one.
+ * Param:
+ *  cc - Camera client descriptor.
+ *  qc - Qemu client for the emulated camera.
+ */
+static void
+_camera_client_stream_frame(CameraClient* cc, QemudClient* qc)
+{
+    uint64_t now = _get_timestamp();
+    uint64_t wait;
+    int backlog = _camera_client_backlog(cc, qc);
+
+    if (now >= cc->stream_next + cc->stream_interval) {
+        cc->frames_coalesced += (now - cc->stream_next) / cc->stream_interval;
+    }
+    if (backlog >= (int)cc->stream_reply_size) {
+        /* Try again once the guest is expected to have caught up. */
+        cc->frames_dropped++;
+        wait = cc->drain_rate ?
+            (uint64_t)backlog * 1000000 / cc->drain_rate : cc->stream_interval;
+        if (wait > cc->stream_interval) {
+            wait = cc->stream_interval;
+        } else if (wait < STREAM_RETRY_MIN_US) {
+            wait = STREAM_RETRY_MIN_US;
+        }
+        cc->stream_next = now + wait;
+        return;
+    }
+
+    cc->stream_query.seq++;
+    _camera_client_capture_frame(cc, qc, &cc->stream_query);
+
+    /* Frames that went out late don't make the following ones early. */
+    now = _get_timestamp();
+    cc->stream_next += cc->stream_interval;
+    if (cc->stream_next < now) {
+        cc->stream_next = now + cc->stream_interval;
+    }
+}
+
+/* Client has queried how frames are delivered.
+ * Param:
+ *  cc - Queried camera client descriptor.
+ *  qc - Qemu client for the emulated camera.
+ *  param - Query parameters. There are no parameters expected for this query.
+ *      Reply data is formatted as such:
+ *          dropped=<num> coalesced=<num> rate=<rate> pool_used=<bytes>
+ *          pool_idle=<bytes> pool_reused=<num> pool_huge_mapped=<num>
+ *          superseded=<num> switches_applied=<num> switch_latency_us=<us>
+ *          switches_failed=<num>
+ *          probe_hits=<num> probe_misses=<num>
+ *      where 'dropped' is the number of streamed frames skipped because the
+ *      guest was a frame behind, 'coalesced' the number of streamed frames
+ *      that went out as a single one after waiting for the send buffer, and
+ *      'rate' the rate the guest takes replies in, in bytes per second. The
+ *      'pool' values are about the frame pool shared by every camera: bytes
+ *      of buffers in use and kept for reuse, then since the start, buffers
+ *      reused rather than allocated, and buffers mapped with hugepages.
+ *      'superseded' is the number of file switches replaced by a later one
+ *      before being applied, 'switches_applied' the number of them applied,
+ *      'switch_latency_us' how long the last one applied took from its
+ *      receipt, in microseconds, and 'switches_failed' the number of them
+ *      applied to a file that couldn't be played. The 'probe' values are the number of files
+ *      opened with their cached stream parameters, and probed instead, by
+ *      every camera.
+ */
+static void
+_camera_client_query_stats(CameraClient* cc, QemudClient* qc, const char* param)
+{
+    char stats[512];
+    frame_pool_stats_t pool;
+    probe_cache_stats_t probes;
+    switch_mailbox_stats_t switches;
+
+    _camera_client_backlog(cc, qc);
+    frame_pool_get_stats(&pool);
+    probe_cache_get_stats(&probes);
+    memset(&switches, 0, sizeof(switches));
+    if (cc->switches != NULL) {
+        switch_mailbox_get_stats(cc->switches, &switches);
+    }
+    snprintf(stats, sizeof(stats), "dropped=%llu coalesced=%llu rate=%llu "
+             "pool_used=%zu pool_idle=%zu pool_reused=%zu "
+             "pool_huge_mapped=%zu superseded=%llu switches_applied=%llu "
+             "switch_latency_us=%llu switches_failed=%llu probe_hits=%llu "
+             "probe_misses=%llu",
+             (unsigned long long)cc->frames_dropped,
+             (unsigned long long)cc->frames_coalesced,
+             (unsigned long long)cc->drain_rate, pool.used_bytes,
+             pool.idle_bytes, pool.reused, pool.huge_mapped,
+             (unsigned long long)switches.superseded,
+             (unsigned long long)switches.applied,
+             (unsigned long long)switches.latency_us,
+             (unsigned long long)switches.failed,
+             (unsigned long long)probes.hits,
+             (unsigned long long)probes.misses);
+    _qemu_client_reply_ok(qc, stats);
+}
+
+/* Handles a message received from the emulated camera client.
+ * Queries received here are represented as strings:
+ * - 'connect' - Connects to the camera device (opens it).
+ * - 'disconnect' - Disconnexts from the camera device (closes it).
+ * - 'start' - Starts capturing video from the connected camera device.
+ * - 'stop' - Stop capturing video from the connected camera device.
+ * - 'frame' - Queries video and preview frames captured from the camera.
+ * - 'shm' - Transfers frames through shared memory.
+ * - 'stream' - Pushes frames to the client until it queries 'stop'.
+ * - 'stats' - Reports frames dropped for a slow client.
+ * Once negotiated on 'connect', binary frame requests are accepted as well,
+ * see frame_proto.h.
+ * Param:
+ *  opaque - Camera service descriptor.
+ *  msg, msglen - Message received from the camera factory client.
+ *  client - Camera factory client pipe.
+ */
+static void
+_camera_client_recv(void*         opaque,
+                    uint8_t*      msg,
+                    int           msglen,
                     QemudClient*  client)
 {
     /*
@@ -1196,11 +2134,24 @@ _camera_client_recv(void*         opaque,
     static const char _query_stop[]       = "stop";
     /* Query frame(s). */
     static const char _query_frame[]      = "frame";
+    /* Transfer frames through shared memory. */
+    static const char _query_shm[]        = "shm";
+    /* Push frames. */
+    static const char _query_stream[]     = "stream";
+    /* Frame delivery counters. */
+    static const char _query_stats[]      = "stats";
 
     char query_name[64];
     const char* query_param = NULL;
     CameraClient* cc = (CameraClient*)opaque;
 
+    /* Binary frame request, no parsing needed. */
+    if (cc->binary_frames && msglen == FRAME_REQUEST_SIZE &&
+        msg[0] == FRAME_PROTO_MARKER) {
+        _camera_client_query_frame_bin(cc, client, msg);
+        return;
+    }
+
     /*
      * Emulated camera queries are formatted as such:
      *  "<query name> [<parameters>]"
@@ -1230,6 +2181,15 @@ _camera_client_recv(void*         opaque,
     } else if (!strcmp(query_name, _query_stop)) {
         /* Stop capturing is queried. */
         _camera_client_query_stop(cc, client, query_param);
+    } else if (!strcmp(query_name, _query_shm)) {
+        /* Shared memory transport is queried. */
+        _camera_client_query_shm(cc, client, query_param);
+    } else if (!strcmp(query_name, _query_stream)) {
+        /* Frame stream is queried. */
+        _camera_client_query_stream(cc, client, query_param);
+    } else if (!strcmp(query_name, _query_stats)) {
+        /* Frame delivery counters are queried. */
+        _camera_client_query_stats(cc, client, query_param);
     } else {
         E("%s: Unknown query '%s'", __FUNCTION__, (char*)msg);
         _qemu_client_reply_ko(client, "Unknown query");
@@ -1299,7 +2259,7 @@ android_list_web_cameras(void)
     int i;
 
     /* Enumerate camera devices connected to the host. */
-    connected_cnt = enumerate_camera_devices(ci, MAX_CAMERA);
+    connected_cnt = enumerate_camera_devices(ci, MAX_CAMERA, NULL);
     if (connected_cnt <= 0) {
         return;
     }
@@ -1315,43 +2275,986 @@ android_list_web_cameras(void)
 // clang-format on
 
 
-int main(int argc, char** argv)
+/*******************************************************************************
+ * Multi-tenant mode: the cameras of all the VMs of a session list, served by a
+ * single process from an epoll loop and a pool of workers
+ ******************************************************************************/
+
+/* How long the device of a disconnected camera is kept open for the guest to reconnect, in
+ * milliseconds */
+#define WARM_GRACE_MS 10000
+
+/**
+ * Close a device kept warm once its grace period is over
+ * Returns when to check again, or UINT64_MAX if no device is kept.
+ */
+static uint64_t warm_device_expire(CameraDevice** warm, uint64_t until, uint64_t now)
 {
-    init_logger();
-    char* vmip = configvar_string("AIC_PLAYER_VM_HOST");
+    if (*warm == NULL)
+        return UINT64_MAX;
+    if (now < until)
+        return until;
+    D("Closing the device kept warm since the camera disconnected");
+    camera_device_close(*warm);
+    *warm = NULL;
+    return UINT64_MAX;
+}
 
-    start_amqp_thread();
-    start_socket_thread();
-    pthread_mutex_init(&dec_mtx, NULL);
+/**
+ * Have a device kept warm follow a file switch of its camera
+ * Back to the default file, it is closed instead, the next connection opens that one.
+ */
+static void warm_device_switch(CameraDevice** warm, const char* filename)
+{
+    if (*warm == NULL)
+        return;
+    if (filename[0] == '\0' || camera_device_switch_file(*warm, filename))
+    {
+        camera_device_close(*warm);
+        *warm = NULL;
+    }
+}
 
+/* Budget of the files read ahead of a switch to them, in megabytes */
+#define PRELOAD_MB 256
+/* Index of the probe results kept across restarts, "none" to keep them in memory only */
+#define PROBE_CACHE_PATH "/var/tmp/aic-player-probe.cache"
+
+/**
+ * Read a file ahead of a switch to it, for any camera of any VM
+ */
+static void preload_file(void* opaque, const char* filename)
+{
+    camera_capture_preload(filename);
+}
+
+/**
+ * Set up preloading from AIC_PLAYER_PRELOAD_MB and AIC_PLAYER_PRELOAD_DECODE, and the probe
+ * cache from AIC_PLAYER_PROBE_CACHE
+ */
+static void setup_media_caches(void)
+{
+    size_t budget = configvar_int_default("AIC_PLAYER_PRELOAD_MB", PRELOAD_MB);
+    camera_capture_set_preload(budget * 1024 * 1024,
+                               configvar_int_default("AIC_PLAYER_PRELOAD_DECODE", 1));
+    char* path = configvar_string_default("AIC_PLAYER_PROBE_CACHE", PROBE_CACHE_PATH);
+    probe_cache_init(strcmp(path, "none") ? path : NULL);
+}
+
+/* Longest wait of the epoll loop, in microseconds */
+#define SESSION_TICK_US 1000000
+#define SESSION_MAX_EVENTS 64
+
+typedef struct camera_session camera_session_t;
+typedef struct session_server session_server_t;
+
+/**
+ * Socket of a session watched by the epoll loop, or listening socket of a camera without session
+ */
+typedef struct session_fd
+{
+    camera_session_t* session;
+    int ctrl;
+    int camera;
+} session_fd_t;
+
+/**
+ * State of one camera of a VM
+ * Everything but the fields guarded by the server lock belongs to the session job, which runs on
+ * one worker at a time.
+ */
+struct camera_session
+{
+    worker_job_t job;
+    session_server_t* server;
+    char vmid[64];
+    char host[256];
+    /* Index of the camera in the VM */
+    int camera;
+    peer_t cam_peer;
+    peer_t ctrl_peer;
+    /* Camera connection, -1 while disconnected */
+    int sock;
+    session_fd_t sock_ref;
+    /* Camera connection in progress, -1 if none, and when to give up on it */
+    int connecting;
+    uint64_t connect_deadline;
+    CameraServiceDesc desc;
+    CameraClient* cc;
+    /* Allocations of the connection, released when it is closed */
+    arena_t arena;
+    zerocopy_t zc;
+    send_queue_t sendq;
+    QemudClient qd;
+    query_reader_t reader;
+    /* File the camera plays, empty for the default one */
+    char filename[256];
+    /* Device kept open since the camera disconnected, or NULL, and until when */
+    CameraDevice* warm;
+    uint64_t warm_until;
+    /* Latest file switch received, applied when the job runs next */
+    switch_mailbox_t switches;
+    /* What to do with the control messages of the session */
+    const amqp_target_t* target;
+
+    /* Guarded by the server lock */
+    /* Control connection for file switches, -1 while disconnected */
+    int ctrl_sock;
+    session_fd_t ctrl_ref;
+    /* Camera connection accepted in listen mode, not taken up yet */
+    int accepted;
+    /* The job is queued or running, and has to run again once done */
+    int busy;
+    int rerun;
+    /* When to connect again, 0 while connected, UINT64_MAX when waiting for the VM */
+    uint64_t retry_at;
+    /* When the next streamed frame is due, 0 if not streaming or waiting for the socket */
+    uint64_t stream_due;
+};
+
+struct session_server
+{
+    int epfd;
+    pthread_mutex_t mtx;
+    worker_pool_t pool;
+    camera_session_t* sessions;
+    int session_num;
+    amqp_target_t* amqp_targets;
+    int camera_num;
+    int zerocopy_threshold;
+    int warm_grace_ms;
+    /* Listen mode: the VMs connect to the camera and control ports of each camera, -1 otherwise */
+    int listen_sock[MAX_CAMERA];
+    int ctrl_listen_sock[MAX_CAMERA];
+    session_fd_t listen_ref[MAX_CAMERA];
+    session_fd_t ctrl_listen_ref[MAX_CAMERA];
+};
+
+/**
+ * Have the session job run, or run again once it is done
+ * Called with the server lock held.
+ */
+static void schedule_session(camera_session_t* s)
+{
+    if (s->busy)
+    {
+        s->rerun = 1;
+        return;
+    }
+    s->busy = 1;
+    worker_pool_submit(&s->server->pool, &s->job);
+}
+
+/**
+ * Record a file switch for the session, from the AMQP thread or the control connection
+ * A connected session runs right away to apply it, whatever its guest is doing, otherwise it is
+ * applied when the camera connects.
+ */
+static void session_switch_file(void* opaque, const char* filename)
+{
+    camera_session_t* s = opaque;
+    switch_mailbox_post(&s->switches, filename);
+    pthread_mutex_lock(&s->server->mtx);
+    if (s->retry_at == 0)
+        schedule_session(s);
+    pthread_mutex_unlock(&s->server->mtx);
+}
+
+static void session_apply_switch(camera_session_t* s)
+{
+    char filename[256];
+    if (!switch_mailbox_take(&s->switches, filename, sizeof(filename)))
+        return;
+
+    int failed = 1;
+    if (access(filename, F_OK) == -1)
+    {
+        W("%s: file %s not found, resetting to default", s->vmid, filename);
+        s->filename[0] = '\0';
+        warm_device_switch(&s->warm, s->filename);
+    }
+    else if (s->cc != NULL && s->cc->camera != NULL &&
+             camera_device_switch_file(s->cc->camera, filename))
+        W("%s: unable to play %s, keeping the previous file", s->vmid, filename);
+    else
+    {
+        snprintf(s->filename, sizeof(s->filename), "%s", filename);
+        warm_device_switch(&s->warm, s->filename);
+        failed = 0;
+    }
+    switch_mailbox_applied(&s->switches, failed);
+}
+
+/**
+ * Use a control connection, replacing the previous one
+ * Called with the server lock held.
+ */
+static void session_set_ctrl(camera_session_t* s, int sock)
+{
+    struct epoll_event ev = {EPOLLIN, {.ptr = &s->ctrl_ref}};
+    if (s->ctrl_sock != -1)
+    {
+        epoll_ctl(s->server->epfd, EPOLL_CTL_DEL, s->ctrl_sock, NULL);
+        close(s->ctrl_sock);
+    }
+    s->ctrl_sock = sock;
+    epoll_ctl(s->server->epfd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+static void session_connect_ctrl(camera_session_t* s)
+{
+    /* In listen mode, the VM connects it */
+    if (s->ctrl_peer.listen_sock != -1)
+        return;
+    int sock = peer_open(&s->ctrl_peer);
+    if (sock == -1)
+        return;
+    pthread_mutex_lock(&s->server->mtx);
+    session_set_ctrl(s, sock);
+    pthread_mutex_unlock(&s->server->mtx);
+}
+
+/**
+ * Serve the camera of the VM on a new connection
+ * Returns 0 on success, or -1 to try again later.
+ */
+static int session_setup(camera_session_t* s, int sock)
+{
+    char param[64];
+    _camera_service_init(&s->desc, s->server->camera_num);
+    snprintf(param, sizeof(param), "name=%s", s->desc.camera_info[s->camera].device_name);
+    s->cc = _camera_client_create(&s->desc, param);
+    if (s->cc == NULL || query_reader_init(&s->reader, sock))
+    {
+        if (s->cc != NULL)
+            _camera_client_free(s->cc);
+        s->cc = NULL;
+        arena_reset(&s->arena);
+        close(sock);
+        return -1;
+    }
+    s->cc->video_file = s->filename;
+    s->cc->warm_camera = s->server->warm_grace_ms > 0 ? &s->warm : NULL;
+    s->cc->switches = &s->switches;
+    zerocopy_init(&s->zc, sock, s->server->zerocopy_threshold);
+    send_queue_init(&s->sendq, sock, &s->zc);
+    s->qd.socket = sock;
+    s->qd.zerocopy = &s->zc;
+    s->qd.sendq = &s->sendq;
+    s->sock = sock;
+
+    struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = &s->sock_ref}};
+    epoll_ctl(s->server->epfd, EPOLL_CTL_ADD, sock, &ev);
+    I("%s: connected to camera %d at %s", s->vmid, s->camera, s->host);
+    session_connect_ctrl(s);
+    return 0;
+}
+
+/**
+ * Get the camera connection going, without waiting on it
+ * Returns 0 once connected, or when to run again otherwise.
+ */
+static uint64_t session_connect(camera_session_t* s)
+{
+    uint64_t now = _get_timestamp();
+    if (s->cam_peer.listen_sock != -1)
+    {
+        pthread_mutex_lock(&s->server->mtx);
+        int sock = s->accepted;
+        s->accepted = -1;
+        pthread_mutex_unlock(&s->server->mtx);
+        /* The epoll loop has the job run again when the VM connects */
+        if (sock == -1 || session_setup(s, sock))
+            return UINT64_MAX;
+        return 0;
+    }
+
+    if (s->connecting == -1)
+    {
+        s->connecting = peer_connect_start(&s->cam_peer);
+        if (s->connecting == -1)
+            return now + peer_backoff(&s->cam_peer) * 1000ULL;
+        s->connect_deadline = now + s->cam_peer.timeout_ms * 1000ULL;
+        /* Writable once connected, or once the connection failed */
+        struct epoll_event ev = {EPOLLOUT | EPOLLONESHOT, {.ptr = &s->sock_ref}};
+        epoll_ctl(s->server->epfd, EPOLL_CTL_ADD, s->connecting, &ev);
+    }
+    int sock = s->connecting;
+    int status = peer_connect_finish(&s->cam_peer, sock);
+    if (status == 1 && now < s->connect_deadline)
+        return s->connect_deadline;
+    s->connecting = -1;
+    if (status == 1)
+    {
+        D("%s: connection to %s timed out", s->vmid, s->host);
+        peer_connect_abort(&s->cam_peer, sock);
+    }
+    /* Failed connections are closed, which takes them out of the epoll set */
+    if (status != 0)
+        return now + peer_backoff(&s->cam_peer) * 1000ULL;
+    epoll_ctl(s->server->epfd, EPOLL_CTL_DEL, sock, NULL);
+    if (session_setup(s, sock))
+        return now + peer_backoff(&s->cam_peer) * 1000ULL;
+    return 0;
+}
+
+static void session_close(camera_session_t* s)
+{
+    I("%s: camera %d disconnected", s->vmid, s->camera);
+    epoll_ctl(s->server->epfd, EPOLL_CTL_DEL, s->sock, NULL);
+    /* Queued replies borrow the frame buffers of the client */
+    send_queue_free(&s->sendq);
+    _camera_client_free(s->cc);
+    s->cc = NULL;
+    arena_reset(&s->arena);
+    if (s->warm != NULL)
+        s->warm_until = _get_timestamp() + s->server->warm_grace_ms * 1000ULL;
+    query_reader_free(&s->reader);
+    close(s->sock);
+    s->sock = -1;
+
+    /* In listen mode, the control connection is the VM's to close */
+    pthread_mutex_lock(&s->server->mtx);
+    if (s->ctrl_sock != -1 && s->ctrl_peer.listen_sock == -1)
+    {
+        epoll_ctl(s->server->epfd, EPOLL_CTL_DEL, s->ctrl_sock, NULL);
+        close(s->ctrl_sock);
+        s->ctrl_sock = -1;
+    }
+    pthread_mutex_unlock(&s->server->mtx);
+}
+
+/**
+ * Answer the queries received so far, and push a frame if one is due
+ * Returns the events to wait for on the camera connection, or 0 if it is closed.
+ */
+static int session_serve(camera_session_t* s)
+{
     while (1)
     {
-        int sock = connect_socket(vmip, 24800);
+        char* query;
+        /* A full queue takes no more queries until the socket takes replies, the job is run
+         * again then rather than waiting on a worker every session shares */
+        if (send_queue_flush(&s->sendq) < 0)
+        {
+            session_close(s);
+            return 0;
+        }
+        if (send_queue_full(&s->sendq))
+            break;
+        if (query_reader_pending(&s->reader))
+        {
+            int len = query_reader_next(&s->reader, &query);
+            _camera_client_recv(s->cc, (uint8_t*) query, len, &s->qd);
+            query_reader_set_binary(&s->reader, FRAME_PROTO_MARKER,
+                                    s->cc->binary_frames ? FRAME_REQUEST_SIZE : 0);
+            continue;
+        }
+        int rec = query_reader_fill(&s->reader);
+        if (rec > 0)
+            continue;
+        if (rec == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            session_close(s);
+            return 0;
+        }
+        break;
+    }
+
+    /* Zero-copy completions are reported as errors, which wake the session up */
+    if (zerocopy_token(&s->zc) != s->zc.done)
+        zerocopy_wait(&s->zc, zerocopy_token(&s->zc), 0);
+
+    int unsent = send_queue_flush(&s->sendq);
+    if (unsent < 0)
+    {
+        session_close(s);
+        return 0;
+    }
+    int events = EPOLLIN | EPOLLONESHOT;
+    if (unsent == 0 && !send_queue_full(&s->sendq) && _camera_client_stream_timeout(s->cc) == 0)
+    {
+        /* Due frames wait for the previous one to be out of the send buffer */
+        struct pollfd pfd = {s->sock, POLLOUT, 0};
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT))
+            _camera_client_stream_frame(s->cc, &s->qd);
+        else
+            events |= EPOLLOUT;
+    }
+    /* What the socket didn't take yet goes out once it is writable */
+    if (s->sendq.head != s->sendq.tail)
+        events |= EPOLLOUT;
+    return events;
+}
+
+static void session_run(worker_job_t* job)
+{
+    camera_session_t* s = (camera_session_t*) job;
+    int events = 0;
+    uint64_t retry_at = 0;
+    uint64_t stream_due = 0;
+
+    session_apply_switch(s);
+    /* The latest connection from the VM wins, the previous one is most likely dead */
+    pthread_mutex_lock(&s->server->mtx);
+    int replaced = s->accepted != -1 && s->sock != -1;
+    pthread_mutex_unlock(&s->server->mtx);
+    if (replaced)
+        session_close(s);
+
+    if (s->sock == -1)
+    {
+        retry_at = session_connect(s);
+        /* Run again in time to close the device kept warm, if the VM isn't back by then */
+        uint64_t expire_at = warm_device_expire(&s->warm, s->warm_until, _get_timestamp());
+        if (s->sock == -1 && expire_at < retry_at)
+            retry_at = expire_at;
+    }
+    if (s->sock != -1)
+    {
+        events = session_serve(s);
+        if (events == 0)
+            retry_at = s->cam_peer.listen_sock != -1
+                           ? UINT64_MAX
+                           : _get_timestamp() + peer_backoff(&s->cam_peer) * 1000ULL;
+        else if (!(events & EPOLLOUT) && s->cc->streaming)
+            stream_due = s->cc->stream_next;
+    }
+
+    pthread_mutex_lock(&s->server->mtx);
+    s->retry_at = retry_at;
+    s->stream_due = stream_due;
+    if (s->rerun)
+    {
+        s->rerun = 0;
+        worker_pool_submit(&s->server->pool, &s->job);
+    }
+    else
+        s->busy = 0;
+    pthread_mutex_unlock(&s->server->mtx);
+
+    /* Rearmed once not busy anymore, so that the event can't be missed */
+    if (events != 0)
+    {
+        struct epoll_event ev = {events, {.ptr = &s->sock_ref}};
+        epoll_ctl(s->server->epfd, EPOLL_CTL_MOD, s->sock, &ev);
+    }
+}
+
+/**
+ * Read the session list: one "<vm id> <vm host>" per line, # starts comments
+ * Every camera of a VM gets a session of its own. Returns the number of sessions, or -1 on error.
+ */
+static int load_sessions(session_server_t* srv, const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        C("Unable to open the session list %s: %s", path, strerror(errno));
+        return -1;
+    }
+    char line[512];
+    int size = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char vmid[64], host[256];
+        if (line[0] == '#' || sscanf(line, "%63s %255s", vmid, host) != 2)
+            continue;
+        for (int camera = 0; camera < srv->camera_num; camera++)
+        {
+            if (srv->session_num == size)
+            {
+                size = size ? size * 2 : 16;
+                camera_session_t* sessions =
+                    realloc(srv->sessions, size * sizeof(camera_session_t));
+                if (sessions == NULL)
+                {
+                    C("Unable to allocate %d sessions", size);
+                    fclose(f);
+                    return -1;
+                }
+                srv->sessions = sessions;
+            }
+            camera_session_t* s = &srv->sessions[srv->session_num++];
+            memset(s, 0, sizeof(*s));
+            s->job.run = session_run;
+            s->server = srv;
+            snprintf(s->vmid, sizeof(s->vmid), "%s", vmid);
+            snprintf(s->host, sizeof(s->host), "%s", host);
+            s->camera = camera;
+            peer_init(&s->cam_peer, host, 24800 + camera, srv->listen_sock[camera]);
+            peer_init(&s->ctrl_peer, host, 32600 + camera, srv->ctrl_listen_sock[camera]);
+            s->sock = -1;
+            s->connecting = -1;
+            s->ctrl_sock = -1;
+            s->accepted = -1;
+        }
+    }
+    fclose(f);
+    /* Sessions don't move anymore, the epoll references can point at them */
+    for (int i = 0; i < srv->session_num; i++)
+    {
+        camera_session_t* s = &srv->sessions[i];
+        s->sock_ref.session = s;
+        s->ctrl_ref.session = s;
+        s->ctrl_ref.ctrl = 1;
+        arena_init(&s->arena, s->vmid);
+        s->desc.arena = &s->arena;
+        switch_mailbox_init(&s->switches);
+    }
+    return srv->session_num;
+}
+
+/**
+ * Read a file switch or preload from a control connection, from the epoll loop
+ */
+static void session_read_ctrl(camera_session_t* s)
+{
+    char buf[CONTROL_MESSAGE_SIZE];
+    pthread_mutex_lock(&s->server->mtx);
+    int sock = s->ctrl_sock;
+    pthread_mutex_unlock(&s->server->mtx);
+    if (sock == -1)
+        return;
+    ssize_t len = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len <= 0)
+    {
+        W("%s: control connection lost", s->vmid);
+        pthread_mutex_lock(&s->server->mtx);
+        epoll_ctl(s->server->epfd, EPOLL_CTL_DEL, sock, NULL);
+        close(sock);
+        s->ctrl_sock = -1;
+        pthread_mutex_unlock(&s->server->mtx);
+        return;
+    }
+    dispatch_cam_data(s->target, buf, len);
+}
+
+/**
+ * Hand the connections of the VMs over to their sessions, from the epoll loop
+ */
+static void session_accept(session_server_t* srv, session_fd_t* ref)
+{
+    int lsock = ref->ctrl ? srv->ctrl_listen_sock[ref->camera] : srv->listen_sock[ref->camera];
+    while (1)
+    {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int sock = accept(lsock, (struct sockaddr*) &addr, &len);
         if (sock == -1)
+            return;
+        camera_session_t* s = NULL;
+        for (int i = 0; i < srv->session_num && s == NULL; i++)
         {
-            C("Could not connect to the VM at %s", vmip);
-            sleep(1);
+            if (srv->sessions[i].camera == ref->camera &&
+                peer_matches(&srv->sessions[i].cam_peer, (struct sockaddr*) &addr))
+                s = &srv->sessions[i];
+        }
+        if (s == NULL)
+        {
+            W("Connection from a host out of the session list");
+            close(sock);
             continue;
         }
-        CameraServiceDesc desc;
-        _camera_service_init(&desc);
-        CameraClient* cc = _camera_client_create(&desc, "name=toto");
-        switch_device(cc->camera);
-        QemudClient qd = {sock};
+        int yes = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        pthread_mutex_lock(&srv->mtx);
+        if (ref->ctrl)
+            session_set_ctrl(s, sock);
+        else
+        {
+            if (s->accepted != -1)
+                close(s->accepted);
+            s->accepted = sock;
+            schedule_session(s);
+        }
+        pthread_mutex_unlock(&srv->mtx);
+    }
+}
+
+/**
+ * Listen for the VMs on the camera and control ports of every camera
+ */
+static int session_listen(session_server_t* srv)
+{
+    for (int i = 0; i < srv->camera_num; i++)
+    {
+        srv->listen_sock[i] = listen_socket(24800 + i);
+        srv->ctrl_listen_sock[i] = listen_socket(32600 + i);
+        if (srv->listen_sock[i] == -1 || srv->ctrl_listen_sock[i] == -1)
+            return -1;
+        fcntl(srv->listen_sock[i], F_SETFL, O_NONBLOCK);
+        fcntl(srv->ctrl_listen_sock[i], F_SETFL, O_NONBLOCK);
+        srv->listen_ref[i].camera = i;
+        srv->ctrl_listen_ref[i].camera = i;
+        srv->ctrl_listen_ref[i].ctrl = 1;
+    }
+    return 0;
+}
+
+/**
+ * Serve the cameras of every VM of the session list, never returns on success
+ */
+static int run_sessions(const char* path, int camera_num, int zerocopy_threshold)
+{
+    static session_server_t srv;
+    int workers = configvar_int_default("AIC_PLAYER_WORKERS", sysconf(_SC_NPROCESSORS_ONLN));
+
+    srv.camera_num = camera_num;
+    srv.zerocopy_threshold = zerocopy_threshold;
+    srv.warm_grace_ms = configvar_int_default("AIC_PLAYER_WARM_GRACE_MS", WARM_GRACE_MS);
+    for (int i = 0; i < MAX_CAMERA; i++)
+    {
+        srv.listen_sock[i] = -1;
+        srv.ctrl_listen_sock[i] = -1;
+    }
+    if (configvar_int_default("AIC_PLAYER_LISTEN", 0) && session_listen(&srv))
+        return -1;
+    int loaded = load_sessions(&srv, path);
+    if (loaded <= 0)
+    {
+        if (loaded == 0)
+            C("No session in %s", path);
+        return -1;
+    }
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_mutex_init(&srv.mtx, NULL);
+    if (srv.epfd == -1 || worker_pool_init(&srv.pool, workers > 0 ? workers : 1))
+        return -1;
+    for (int i = 0; i < camera_num && srv.listen_sock[i] != -1; i++)
+    {
+        struct epoll_event ev = {EPOLLIN, {.ptr = &srv.listen_ref[i]}};
+        epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listen_sock[i], &ev);
+        ev.data.ptr = &srv.ctrl_listen_ref[i];
+        epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.ctrl_listen_sock[i], &ev);
+    }
+    /* Decoding ahead of time shares the workers */
+    camera_capture_set_pool(&srv.pool);
+    /* VMs playing the same file share its decoding and scaling */
+    camera_capture_share_sources(configvar_int_default("AIC_PLAYER_SHARED_SOURCES", 1));
+    setup_media_caches();
+
+    srv.amqp_targets = calloc(srv.session_num, sizeof(amqp_target_t));
+    if (srv.amqp_targets == NULL)
+    {
+        C("Unable to allocate the control targets of %d sessions", srv.session_num);
+        return -1;
+    }
+    for (int i = 0; i < srv.session_num; i++)
+    {
+        srv.amqp_targets[i].vmid = srv.sessions[i].vmid;
+        srv.amqp_targets[i].camera = srv.sessions[i].camera;
+        srv.amqp_targets[i].switch_file = session_switch_file;
+        srv.amqp_targets[i].preload = preload_file;
+        srv.amqp_targets[i].opaque = &srv.sessions[i];
+        srv.sessions[i].target = &srv.amqp_targets[i];
+    }
+    /* Control connections are read by the epoll loop of the sessions */
+    start_control_thread(srv.amqp_targets, srv.session_num, NULL);
+    I("Serving %d cameras of %d VMs", srv.session_num, srv.session_num / camera_num);
+
+    while (1)
+    {
+        /* Connect whatever is disconnected, and push due frames */
+        uint64_t now = _get_timestamp();
+        uint64_t next = now + SESSION_TICK_US;
+        pthread_mutex_lock(&srv.mtx);
+        for (int i = 0; i < srv.session_num; i++)
+        {
+            camera_session_t* s = &srv.sessions[i];
+            uint64_t due = s->sock == -1 ? s->retry_at : s->stream_due;
+            if (s->busy || (s->sock != -1 && due == 0))
+                continue;
+            if (due <= now)
+                schedule_session(s);
+            else if (due < next)
+                next = due;
+        }
+        pthread_mutex_unlock(&srv.mtx);
+
+        struct epoll_event events[SESSION_MAX_EVENTS];
+        int n = epoll_wait(srv.epfd, events, SESSION_MAX_EVENTS, (next - now + 999) / 1000);
+        if (n < 0 && errno != EINTR)
+        {
+            C("epoll_wait failed: %s", strerror(errno));
+            return -1;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            session_fd_t* ref = events[i].data.ptr;
+            if (ref->session == NULL)
+            {
+                session_accept(&srv, ref);
+                continue;
+            }
+            if (ref->ctrl)
+            {
+                session_read_ctrl(ref->session);
+                continue;
+            }
+            pthread_mutex_lock(&srv.mtx);
+            schedule_session(ref->session);
+            pthread_mutex_unlock(&srv.mtx);
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * Single VM mode: every camera of AIC_PLAYER_VM_HOST on a thread of its own
+ ******************************************************************************/
+
+/**
+ * Camera of the VM, served on its own thread so that a heavy clip doesn't hold the other ones
+ */
+typedef struct vm_camera
+{
+    int index;
+    int camera_num;
+    pthread_t thread;
+    peer_t peer;
+    int zerocopy_threshold;
+    int warm_grace_ms;
+    amqp_target_t target;
+    /* Guards the fields below, and the device of the client against file switches from other
+     * threads; held while decoding, never around socket I/O */
+    pthread_mutex_t mtx;
+    /* Client of the connection, NULL while disconnected */
+    CameraClient* cc;
+    /* Allocations of the connection, released when it is closed */
+    arena_t arena;
+    /* File the camera plays, empty for the default one */
+    char filename[256];
+    /* Device kept open since the camera disconnected, or NULL, and until when */
+    CameraDevice* warm;
+    uint64_t warm_until;
+    /* Latest file switch received, applied by the thread of the camera at the next frame */
+    switch_mailbox_t switches;
+} vm_camera_t;
+
+/**
+ * Record a file switch for a camera, from the AMQP thread or its control connection
+ */
+static void vm_camera_switch_file(void* opaque, const char* filename)
+{
+    vm_camera_t* cam = opaque;
+    switch_mailbox_post(&cam->switches, filename);
+}
+
+/**
+ * Apply the latest file switch of the camera, if any, from its own thread
+ */
+static void vm_camera_apply_switch(vm_camera_t* cam)
+{
+    char filename[256];
+    if (!switch_mailbox_take(&cam->switches, filename, sizeof(filename)))
+        return;
+    int failed = 1;
+    pthread_mutex_lock(&cam->mtx);
+    if (access(filename, F_OK) == -1)
+    {
+        W("Camera %d: file %s not found, resetting to default", cam->index, filename);
+        cam->filename[0] = '\0';
+        warm_device_switch(&cam->warm, cam->filename);
+    }
+    else if (cam->cc != NULL && cam->cc->camera != NULL &&
+             camera_device_switch_file(cam->cc->camera, filename))
+        W("Camera %d: unable to play %s, keeping the previous file", cam->index, filename);
+    else
+    {
+        snprintf(cam->filename, sizeof(cam->filename), "%s", filename);
+        warm_device_switch(&cam->warm, cam->filename);
+        failed = 0;
+    }
+    pthread_mutex_unlock(&cam->mtx);
+    switch_mailbox_applied(&cam->switches, failed);
+}
+
+/**
+ * Answer the queries of a camera connection until it is closed
+ */
+static void vm_camera_serve(vm_camera_t* cam, int sock)
+{
+    char param[64];
+    CameraServiceDesc desc;
+    vm_camera_apply_switch(cam);
+    desc.arena = &cam->arena;
+    _camera_service_init(&desc, cam->camera_num);
+    snprintf(param, sizeof(param), "name=%s", desc.camera_info[cam->index].device_name);
+    CameraClient* cc = _camera_client_create(&desc, param);
+    if (cc == NULL)
+    {
+        arena_reset(&cam->arena);
+        return;
+    }
+    /* Opened on connect, with the file the camera plays then, unless still warm */
+    cc->video_file = cam->filename;
+    cc->warm_camera = cam->warm_grace_ms > 0 ? &cam->warm : NULL;
+    /* The lock is only held while decoding, a slow guest doesn't hold file switches back */
+    cc->device_lock = &cam->mtx;
+    cc->switches = &cam->switches;
+    pthread_mutex_lock(&cam->mtx);
+    cam->cc = cc;
+    pthread_mutex_unlock(&cam->mtx);
+
+    zerocopy_t zc;
+    zerocopy_init(&zc, sock, cam->zerocopy_threshold);
+    send_queue_t sendq;
+    send_queue_init(&sendq, sock, &zc);
+    QemudClient qd = {sock, &zc, &sendq};
+    query_reader_t reader;
+    if (query_reader_init(&reader, sock) == 0)
+    {
+        char* query;
+        int len;
         while (1)
         {
-            uint8_t buf[128];
-            int rec = recv(sock, buf, sizeof(buf), 0);
-            if (rec > 0)
+            /* Between two frames, whatever the control plane sent last is the file to play */
+            vm_camera_apply_switch(cam);
+            /* Replies go out as the socket takes them, without holding the decoder */
+            int unsent = send_queue_flush(&sendq);
+            if (unsent < 0)
+                break;
+            /* A full queue takes no more queries until the socket takes replies */
+            int full = send_queue_full(&sendq);
+            int timeout = _camera_client_stream_timeout(cc);
+            int due = timeout == 0 && !unsent && !full;
+            if (full || !query_reader_pending(&reader))
             {
-                pthread_mutex_lock(&dec_mtx);
-                _camera_client_recv(cc, buf, rec, &qd);
-                pthread_mutex_unlock(&dec_mtx);
+                /* Wait for a query, for a file switch, for the socket to take the rest of the
+                 * replies, or for the next frame to be due and the previous one to be out of the
+                 * send buffer */
+                struct pollfd pfd[2] = {{sock, full ? 0 : POLLIN, 0},
+                                        {cam->switches.wake_fd, POLLIN, 0}};
+                if (unsent || due)
+                    pfd[0].events |= POLLOUT;
+                if (timeout == 0)
+                    timeout = -1;
+                if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+                    break;
+                if (full || !(pfd[0].revents & (POLLIN | POLLHUP)))
+                {
+                    /* Zero-copy completions are reported as errors, reap them */
+                    if (pfd[0].revents & POLLERR)
+                        zerocopy_wait(&zc, zerocopy_token(&zc), 0);
+                    if (due && (pfd[0].revents & POLLOUT))
+                        _camera_client_stream_frame(cc, &qd);
+                    continue;
+                }
             }
-            else
+            if ((len = query_reader_next(&reader, &query)) <= 0)
                 break;
+            _camera_client_recv(cc, (uint8_t*) query, len, &qd);
+            /* Frame requests may have been switched to binary on connect */
+            query_reader_set_binary(&reader, FRAME_PROTO_MARKER,
+                                    cc->binary_frames ? FRAME_REQUEST_SIZE : 0);
         }
-        _camera_client_free(cc);
+        query_reader_free(&reader);
     }
+    /* Queued replies borrow the frame buffers of the client */
+    send_queue_free(&sendq);
+    pthread_mutex_lock(&cam->mtx);
+    cam->cc = NULL;
+    _camera_client_free(cc);
+    arena_reset(&cam->arena);
+    if (cam->warm != NULL)
+        cam->warm_until = _get_timestamp() + cam->warm_grace_ms * 1000ULL;
+    pthread_mutex_unlock(&cam->mtx);
+}
+
+static void* vm_camera_run(void* opaque)
+{
+    vm_camera_t* cam = opaque;
+    while (1)
+    {
+        int sock = peer_open(&cam->peer);
+        if (sock == -1)
+        {
+            D("Camera %d: could not connect to the VM at %s", cam->index, cam->peer.host);
+            vm_camera_apply_switch(cam);
+            pthread_mutex_lock(&cam->mtx);
+            warm_device_expire(&cam->warm, cam->warm_until, _get_timestamp());
+            pthread_mutex_unlock(&cam->mtx);
+            usleep(peer_backoff(&cam->peer) * 1000);
+            continue;
+        }
+        I("Camera %d: connected to the VM at %s", cam->index, cam->peer.host);
+        vm_camera_serve(cam, sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+/**
+ * Serve every camera of the VM, never returns on success
+ */
+static int run_vm(int camera_num, int zerocopy_threshold)
+{
+    char* vmip = configvar_string("AIC_PLAYER_VM_HOST");
+    int listen = configvar_int_default("AIC_PLAYER_LISTEN", 0);
+    int warm_grace_ms = configvar_int_default("AIC_PLAYER_WARM_GRACE_MS", WARM_GRACE_MS);
+    vm_camera_t* cams = calloc(camera_num, sizeof(vm_camera_t));
+    amqp_target_t* targets = calloc(camera_num, sizeof(amqp_target_t));
+    if (cams == NULL || targets == NULL)
+    {
+        C("Unable to allocate %d cameras", camera_num);
+        free(cams);
+        free(targets);
+        return -1;
+    }
+    /* A worker per camera decodes its next frame while the previous one is sent */
+    static worker_pool_t decode_pool;
+    if (worker_pool_init(&decode_pool, camera_num) == 0)
+        camera_capture_set_pool(&decode_pool);
+    setup_media_caches();
+
+    for (int i = 0; i < camera_num; i++)
+    {
+        vm_camera_t* cam = &cams[i];
+        cam->index = i;
+        cam->camera_num = camera_num;
+        cam->zerocopy_threshold = zerocopy_threshold;
+        cam->warm_grace_ms = warm_grace_ms;
+        pthread_mutex_init(&cam->mtx, NULL);
+        char name[16];
+        snprintf(name, sizeof(name), "camera %d", i);
+        arena_init(&cam->arena, name);
+        switch_mailbox_init(&cam->switches);
+        peer_init(&cam->peer, vmip, 24800 + i, listen ? listen_socket(24800 + i) : -1);
+        cam->target.vmid = configvar_string("AIC_PLAYER_VM_ID");
+        cam->target.camera = i;
+        cam->target.switch_file = vm_camera_switch_file;
+        cam->target.preload = preload_file;
+        cam->target.opaque = cam;
+    }
+    /* The queues and control ports of every camera are served on a single thread */
+    for (int i = 0; i < camera_num; i++)
+        targets[i] = cams[i].target;
+    start_control_thread(targets, camera_num, vmip);
+    for (int i = 1; i < camera_num; i++)
+        pthread_create(&cams[i].thread, NULL, vm_camera_run, &cams[i]);
+    I("Serving %d cameras", camera_num);
+    vm_camera_run(&cams[0]);
     return -1;
 }
+
+int main(int argc, char** argv)
+{
+    init_logger();
+    char* session_list = configvar_string_default("AIC_PLAYER_SESSION_LIST", NULL);
+    int zerocopy_threshold = configvar_int_default("AIC_PLAYER_ZEROCOPY_THRESHOLD", 0);
+    int camera_num = configvar_int_default("AIC_PLAYER_CAMERAS", 1);
+    if (zerocopy_threshold < 0)
+        zerocopy_threshold = 0;
+    if (camera_num < 1 || camera_num > MAX_CAMERA)
+    {
+        C("AIC_PLAYER_CAMERAS must be between 1 and %d", MAX_CAMERA);
+        return -1;
+    }
+
+    if (session_list != NULL)
+        return run_sessions(session_list, camera_num, zerocopy_threshold);
+    return run_vm(camera_num, zerocopy_threshold);
+}
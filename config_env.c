@@ -34,6 +34,31 @@ int configvar_int(char* varname)
     return ret;
 }
 
+/**
+ * Optional integer variable, def is used when it is unset or empty
+ */
+int configvar_int_default(char* varname, int def)
+{
+    int ret = def;
+    char* val = getenv(varname);
+    if (val != NULL && strlen(val) > 0)
+        ret = atoi(val);
+    LOG(G_LOG_LEVEL_DEBUG, "%s: %d", varname, ret);
+    return ret;
+}
+
+/**
+ * Optional string variable, def is used when it is unset or empty
+ */
+char* configvar_string_default(char* varname, char* def)
+{
+    char* val = getenv(varname);
+    if (val == NULL || strlen(val) == 0)
+        val = def;
+    LOG(G_LOG_LEVEL_DEBUG, "%s: %s", varname, val ? val : "(none)");
+    return val;
+}
+
 int configvar_bool(char* varname)
 {
     int ret = 0;
@@ -9,5 +9,7 @@ char* configvar_raw(char* varname);
 char* configvar_string(char* varname);
 int configvar_int(char* varname);
 int configvar_bool(char* varname);
+int configvar_int_default(char* varname, int def);
+char* configvar_string_default(char* varname, char* def);
 
 #endif
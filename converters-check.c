@@ -0,0 +1,459 @@
+/**
+ * Check of the high bit depth conversions against the 8-bit ones
+ * P010, YUV420P10 and YUV420P12 frames made from an 8-bit YUV420 frame must convert to exactly
+ * the same framebuffers as the 8-bit frame does, scaled or not, odd dimensions included.
+ * Scaling into two sizes in one pass must match scaling into each size on its own.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "camera-format-converters.h"
+
+/* Framebuffers are larger than any of the formats needs, the slack is checked too */
+#define FB_SIZE(w, h) ((size_t)(w) * (h) * 4 + 64)
+
+typedef struct frame16
+{
+    uint32_t pixel_format;
+    const char* name;
+    /* Bits the 8-bit samples are shifted left by */
+    int shift;
+    int interleaved;
+} frame16_t;
+
+static const frame16_t formats16[] = {
+    {V4L2_PIX_FMT_P010, "P010", 8, 1},
+    {V4L2_PIX_FMT_YUV420P10, "YUV420P10", 2, 0},
+    {V4L2_PIX_FMT_YUV420P12, "YUV420P12", 4, 0},
+};
+
+typedef struct fb_format
+{
+    uint32_t pixel_format;
+    const char* name;
+    /* Bytes per pixel of the RGB formats */
+    int bpp;
+} fb_format_t;
+
+static const fb_format_t dst_formats[] = {
+    {V4L2_PIX_FMT_YUV420, "YUV420", 0}, {V4L2_PIX_FMT_NV12, "NV12", 0},
+    {V4L2_PIX_FMT_NV21, "NV21", 0},     {V4L2_PIX_FMT_RGB32, "RGB32", 4},
+    {V4L2_PIX_FMT_RGB565, "RGB565", 2},
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+/* Framebuffers the converters take in a call */
+#define MAX_FBS 4
+#define CHROMA(dim) (((dim) + 1) / 2)
+
+/**
+ * 8-bit YUV420 frame, contiguous, with a pattern that varies across lines and columns
+ */
+static uint8_t* make_frame8(int w, int h)
+{
+    int cw = CHROMA(w), ch = CHROMA(h);
+    uint8_t* f = malloc(w * h + 2 * cw * ch);
+    for (int i = 0; i < w * h; i++)
+        f[i] = (i * 7 + i / w * 13) & 0xff;
+    for (int i = 0; i < 2 * cw * ch; i++)
+        f[w * h + i] = (i * 11 + 60) & 0xff;
+    return f;
+}
+
+/**
+ * The same frame in a high bit depth format, contiguous like convert_frame expects it
+ */
+static uint16_t* make_frame16(const uint8_t* f8, int w, int h, const frame16_t* fmt)
+{
+    int cw = CHROMA(w), ch = CHROMA(h);
+    uint16_t* f = malloc((w * h + 2 * cw * ch) * sizeof(uint16_t));
+    const uint8_t* u = f8 + w * h;
+    const uint8_t* v = u + cw * ch;
+    for (int i = 0; i < w * h; i++)
+        f[i] = f8[i] << fmt->shift;
+    for (int i = 0; i < cw * ch; i++)
+    {
+        if (fmt->interleaved)
+        {
+            f[w * h + 2 * i] = u[i] << fmt->shift;
+            f[w * h + 2 * i + 1] = v[i] << fmt->shift;
+        }
+        else
+        {
+            f[w * h + i] = u[i] << fmt->shift;
+            f[w * h + cw * ch + i] = v[i] << fmt->shift;
+        }
+    }
+    return f;
+}
+
+static void planar8(PlanarFrame* p, const uint8_t* f, int w, int h)
+{
+    int cw = CHROMA(w), ch = CHROMA(h);
+    p->pixel_format = V4L2_PIX_FMT_YUV420;
+    p->width = w;
+    p->height = h;
+    p->panes[0] = f;
+    p->panes[1] = f + w * h;
+    p->panes[2] = f + w * h + cw * ch;
+    p->linesize[0] = w;
+    p->linesize[1] = cw;
+    p->linesize[2] = cw;
+}
+
+static void planar16(PlanarFrame* p, const uint16_t* f, int w, int h, const frame16_t* fmt)
+{
+    int cw = CHROMA(w), ch = CHROMA(h);
+    p->pixel_format = fmt->pixel_format;
+    p->width = w;
+    p->height = h;
+    p->panes[0] = (const uint8_t*) f;
+    p->panes[1] = (const uint8_t*) (f + w * h);
+    p->panes[2] = (const uint8_t*) (f + w * h + cw * ch);
+    p->linesize[0] = w * 2;
+    p->linesize[1] = (fmt->interleaved ? 2 * cw : cw) * 2;
+    p->linesize[2] = cw * 2;
+}
+
+/**
+ * Convert a frame with the scaling converter into a framebuffer of each destination format
+ */
+static int scale(const PlanarFrame* p, int dw, int dh, uint8_t** fbs, float wb, float exp)
+{
+    ClientFrameBuffer cfb[ARRAY_SIZE(dst_formats)];
+    FrameScaler* sc = frame_scaler_get(NULL, p->width, p->height, dw, dh);
+    if (sc == NULL)
+        return -1;
+    for (size_t i = 0; i < ARRAY_SIZE(dst_formats); i++)
+    {
+        memset(fbs[i], 0xa5, FB_SIZE(dw, dh));
+        cfb[i].pixel_format = dst_formats[i].pixel_format;
+        cfb[i].framebuffer = fbs[i];
+        cfb[i].width = dw;
+        cfb[i].height = dh;
+    }
+    int res = 0;
+    for (size_t i = 0; !res && i < ARRAY_SIZE(dst_formats); i += MAX_FBS)
+    {
+        int num = ARRAY_SIZE(dst_formats) - i < MAX_FBS ? ARRAY_SIZE(dst_formats) - i : MAX_FBS;
+        res = frame_scaler_convert(sc, p, cfb + i, num, wb, 1.0f, 1.0f, exp);
+    }
+    frame_scaler_free(sc);
+    return res;
+}
+
+/**
+ * Convert a frame with convert_frame into a framebuffer of each destination format
+ */
+static int convert(const void* f, uint32_t format, int w, int h, uint8_t** fbs, float wb,
+                   float exp)
+{
+    ClientFrameBuffer cfb[ARRAY_SIZE(dst_formats)];
+    for (size_t i = 0; i < ARRAY_SIZE(dst_formats); i++)
+    {
+        memset(fbs[i], 0xa5, FB_SIZE(w, h));
+        cfb[i].pixel_format = dst_formats[i].pixel_format;
+        cfb[i].framebuffer = fbs[i];
+        cfb[i].width = 0;
+        cfb[i].height = 0;
+    }
+    int res = 0;
+    for (size_t i = 0; !res && i < ARRAY_SIZE(dst_formats); i += MAX_FBS)
+    {
+        int num = ARRAY_SIZE(dst_formats) - i < MAX_FBS ? ARRAY_SIZE(dst_formats) - i : MAX_FBS;
+        res = convert_frame(f, format, 0, w, h, cfb + i, num, wb, 1.0f, 1.0f, exp);
+    }
+    return res;
+}
+
+static int compare(const char* what, const frame16_t* fmt, uint8_t** ref, uint8_t** out,
+                   size_t size)
+{
+    int failed = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(dst_formats); i++)
+    {
+        if (memcmp(ref[i], out[i], size))
+        {
+            fprintf(stderr, "FAIL %s: %s to %s differs from the 8-bit conversion\n", what,
+                    fmt->name, dst_formats[i].name);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+static void alloc_fbs(uint8_t** fbs, size_t size)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(dst_formats); i++)
+        fbs[i] = malloc(size);
+}
+
+static void free_fbs(uint8_t** fbs)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(dst_formats); i++)
+        free(fbs[i]);
+}
+
+/**
+ * Compare the scaling conversions of a source size to a destination size
+ */
+static int check_scaled(int w, int h, int dw, int dh, float wb, float exp)
+{
+    char what[64];
+    uint8_t *ref[ARRAY_SIZE(dst_formats)], *out[ARRAY_SIZE(dst_formats)];
+    uint8_t* f8 = make_frame8(w, h);
+    PlanarFrame p;
+    int failed = 0;
+
+    snprintf(what, sizeof(what), "scaled %dx%d to %dx%d", w, h, dw, dh);
+    alloc_fbs(ref, FB_SIZE(dw, dh));
+    alloc_fbs(out, FB_SIZE(dw, dh));
+    planar8(&p, f8, w, h);
+    if (scale(&p, dw, dh, ref, wb, exp))
+    {
+        fprintf(stderr, "FAIL %s: 8-bit conversion failed\n", what);
+        failed = 1;
+    }
+    for (size_t f = 0; !failed && f < ARRAY_SIZE(formats16); f++)
+    {
+        uint16_t* f16 = make_frame16(f8, w, h, &formats16[f]);
+        planar16(&p, f16, w, h, &formats16[f]);
+        if (scale(&p, dw, dh, out, wb, exp))
+        {
+            fprintf(stderr, "FAIL %s: %s conversion failed\n", what, formats16[f].name);
+            failed = 1;
+        }
+        else
+            failed |= compare(what, &formats16[f], ref, out, FB_SIZE(dw, dh));
+        free(f16);
+    }
+    free_fbs(ref);
+    free_fbs(out);
+    free(f8);
+    return failed;
+}
+
+/**
+ * Compare the scaling of a frame into two destination sizes in one pass with the scaling into
+ * each of them on its own, 8-bit and high bit depth frames alike
+ */
+static int check_scaled_dims(int w, int h, int dw, int dh)
+{
+    char what[64];
+    uint8_t *ref[2][ARRAY_SIZE(dst_formats)], *out[2][ARRAY_SIZE(dst_formats)];
+    ClientFrameBuffer cfb[2][MAX_FBS];
+    ClientFrameBuffer* groups[2] = {cfb[0], cfb[1]};
+    FrameScaler* scalers[2];
+    int sizes[2][2] = {{w, h}, {dw, dh}};
+    int fbs_num[2] = {MAX_FBS, MAX_FBS};
+    uint8_t* f8 = make_frame8(w, h);
+    PlanarFrame p;
+    int failed = 0;
+
+    snprintf(what, sizeof(what), "scaled %dx%d to %dx%d in one pass", w, h, dw, dh);
+    for (int g = 0; g < 2; g++)
+    {
+        alloc_fbs(ref[g], FB_SIZE(sizes[g][0], sizes[g][1]));
+        alloc_fbs(out[g], FB_SIZE(sizes[g][0], sizes[g][1]));
+        scalers[g] = frame_scaler_get(NULL, w, h, sizes[g][0], sizes[g][1]);
+    }
+    for (size_t f = 0; !failed && f <= ARRAY_SIZE(formats16); f++)
+    {
+        const frame16_t* fmt = f ? &formats16[f - 1] : NULL;
+        uint16_t* f16 = NULL;
+        if (fmt == NULL)
+            planar8(&p, f8, w, h);
+        else
+        {
+            f16 = make_frame16(f8, w, h, fmt);
+            planar16(&p, f16, w, h, fmt);
+        }
+        for (int g = 0; !failed && g < 2; g++)
+        {
+            size_t size = FB_SIZE(sizes[g][0], sizes[g][1]);
+            failed = scale(&p, sizes[g][0], sizes[g][1], ref[g], 1.1f, 0.9f);
+            for (int i = 0; i < MAX_FBS; i++)
+            {
+                memset(out[g][i], 0xa5, size);
+                cfb[g][i].pixel_format = dst_formats[i].pixel_format;
+                cfb[g][i].framebuffer = out[g][i];
+                cfb[g][i].width = sizes[g][0];
+                cfb[g][i].height = sizes[g][1];
+            }
+        }
+        if (failed || frame_scalers_convert(scalers, &p, groups, fbs_num, 2, 1.1f, 1.0f, 1.0f,
+                                            0.9f))
+        {
+            fprintf(stderr, "FAIL %s: %s conversion failed\n", what, fmt ? fmt->name : "8-bit");
+            failed = 1;
+        }
+        for (int g = 0; !failed && g < 2; g++)
+        {
+            for (int i = 0; i < MAX_FBS; i++)
+            {
+                if (memcmp(ref[g][i], out[g][i], FB_SIZE(sizes[g][0], sizes[g][1])))
+                {
+                    fprintf(stderr, "FAIL %s: %s to %dx%d %s differs from the single scaling\n",
+                            what, fmt ? fmt->name : "8-bit", sizes[g][0], sizes[g][1],
+                            dst_formats[i].name);
+                    failed = 1;
+                }
+            }
+        }
+        free(f16);
+    }
+    for (int g = 0; g < 2; g++)
+    {
+        frame_scaler_free(scalers[g]);
+        free_fbs(ref[g]);
+        free_fbs(out[g]);
+    }
+    free(f8);
+    return failed;
+}
+
+/**
+ * Compare the conversions of convert_frame, without scaling
+ */
+static int check_converted(int w, int h, float wb, float exp)
+{
+    char what[64];
+    uint8_t *ref[ARRAY_SIZE(dst_formats)], *out[ARRAY_SIZE(dst_formats)];
+    uint8_t* f8 = make_frame8(w, h);
+    int failed = 0;
+
+    snprintf(what, sizeof(what), "converted %dx%d", w, h);
+    alloc_fbs(ref, FB_SIZE(w, h));
+    alloc_fbs(out, FB_SIZE(w, h));
+    if (convert(f8, V4L2_PIX_FMT_YUV420, w, h, ref, wb, exp))
+    {
+        fprintf(stderr, "FAIL %s: 8-bit conversion failed\n", what);
+        failed = 1;
+    }
+    for (size_t f = 0; !failed && f < ARRAY_SIZE(formats16); f++)
+    {
+        uint16_t* f16 = make_frame16(f8, w, h, &formats16[f]);
+        if (convert(f16, formats16[f].pixel_format, w, h, out, wb, exp))
+        {
+            fprintf(stderr, "FAIL %s: %s conversion failed\n", what, formats16[f].name);
+            failed = 1;
+        }
+        else
+            failed |= compare(what, &formats16[f], ref, out, FB_SIZE(w, h));
+        free(f16);
+    }
+    free_fbs(ref);
+    free_fbs(out);
+    free(f8);
+    return failed;
+}
+
+/**
+ * Compare the RGB conversions of convert_frame for an odd size with the 8-bit ones
+ * The 8-bit converters only take even sizes: the reference is the frame padded to even dimensions
+ * with its last column and line repeated, which keeps the chroma planes, cropped after conversion.
+ */
+static int check_converted_odd(int w, int h, float wb, float exp)
+{
+    static const fb_format_t rgb_formats[] = {
+        {V4L2_PIX_FMT_RGB32, "RGB32", 4},
+        {V4L2_PIX_FMT_RGB565, "RGB565", 2},
+    };
+    char what[64];
+    int pw = w + (w & 1), ph = h + (h & 1);
+    int cw = CHROMA(w), ch = CHROMA(h);
+    uint8_t* f8 = make_frame8(w, h);
+    uint8_t* padded = malloc(pw * ph + 2 * cw * ch);
+    uint8_t* ref = malloc(FB_SIZE(pw, ph));
+    uint8_t* out = malloc(FB_SIZE(w, h));
+    int failed = 0;
+
+    snprintf(what, sizeof(what), "converted %dx%d", w, h);
+    for (int y = 0; y < ph; y++)
+    {
+        const uint8_t* line = f8 + (y < h ? y : h - 1) * w;
+        memcpy(padded + y * pw, line, w);
+        padded[y * pw + pw - 1] = line[w - 1];
+    }
+    memcpy(padded + pw * ph, f8 + w * h, 2 * cw * ch);
+
+    for (size_t i = 0; !failed && i < ARRAY_SIZE(rgb_formats); i++)
+    {
+        ClientFrameBuffer cfb = {.pixel_format = rgb_formats[i].pixel_format,
+                                 .framebuffer = ref};
+        /* RGB lines are aligned to 16 bits, which the formats checked here always are */
+        size_t line = (size_t) w * rgb_formats[i].bpp;
+        size_t ref_line = (size_t) pw * rgb_formats[i].bpp;
+        /* RGB32 leaves the alpha bytes alone */
+        memset(ref, 0xa5, FB_SIZE(pw, ph));
+        if (convert_frame(padded, V4L2_PIX_FMT_YUV420, 0, pw, ph, &cfb, 1, wb, 1.0f, 1.0f, exp))
+        {
+            fprintf(stderr, "FAIL %s: 8-bit conversion failed\n", what);
+            failed = 1;
+            break;
+        }
+        for (size_t f = 0; f < ARRAY_SIZE(formats16); f++)
+        {
+            uint16_t* f16 = make_frame16(f8, w, h, &formats16[f]);
+            cfb.framebuffer = out;
+            memset(out, 0xa5, FB_SIZE(w, h));
+            if (convert_frame(f16, formats16[f].pixel_format, 0, w, h, &cfb, 1, wb, 1.0f, 1.0f,
+                              exp))
+            {
+                fprintf(stderr, "FAIL %s: %s conversion failed\n", what, formats16[f].name);
+                failed = 1;
+                free(f16);
+                continue;
+            }
+            for (int y = 0; y < h; y++)
+            {
+                if (memcmp(ref + y * ref_line, out + y * line, line))
+                {
+                    fprintf(stderr, "FAIL %s: %s to %s line %d differs from the 8-bit one\n",
+                            what, formats16[f].name, rgb_formats[i].name, y);
+                    failed = 1;
+                    break;
+                }
+            }
+            /* Nothing is written past the frame */
+            for (size_t o = line * h; o < FB_SIZE(w, h); o++)
+            {
+                if (out[o] != 0xa5)
+                {
+                    fprintf(stderr, "FAIL %s: %s to %s writes past the frame\n", what,
+                            formats16[f].name, rgb_formats[i].name);
+                    failed = 1;
+                    break;
+                }
+            }
+            free(f16);
+        }
+    }
+    free(padded);
+    free(ref);
+    free(out);
+    free(f8);
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+    failed |= check_scaled(64, 48, 64, 48, 1.0f, 1.0f);
+    failed |= check_scaled(640, 480, 320, 240, 1.0f, 1.0f);
+    failed |= check_scaled(320, 240, 640, 480, 1.2f, 0.8f);
+    failed |= check_scaled(63, 47, 63, 47, 1.0f, 1.0f);
+    failed |= check_scaled(63, 47, 31, 23, 0.9f, 1.1f);
+    failed |= check_scaled(64, 48, 33, 25, 1.0f, 1.0f);
+    failed |= check_scaled_dims(1280, 720, 640, 360);
+    failed |= check_scaled_dims(1920, 1080, 317, 179);
+    failed |= check_converted(64, 48, 1.0f, 1.0f);
+    failed |= check_converted(640, 480, 1.2f, 0.8f);
+    failed |= check_converted_odd(64, 48, 1.0f, 1.0f);
+    failed |= check_converted_odd(63, 47, 1.0f, 1.0f);
+    failed |= check_converted_odd(63, 47, 1.2f, 0.8f);
+    puts(failed ? "High bit depth conversions: FAILED" : "High bit depth conversions: OK");
+    return failed;
+}
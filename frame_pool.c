@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "config_env.h"
+#include "frame_pool.h"
+#include "logger.h"
+
+#define LOG_TAG "frame_pool"
+
+/* Size classes: powers of two from 4 KiB below a hugepage, whole hugepages from there on */
+#define SMALL_SHIFT 12
+#define SMALL_CLASSES 9
+#define HUGE_CLASSES 32
+#define CLASSES (SMALL_CLASSES + HUGE_CLASSES)
+
+enum hugepage_mode
+{
+    HUGEPAGES_OFF,
+    /* Transparent hugepages, when the kernel has them enabled for madvise */
+    HUGEPAGES_TRANSPARENT,
+    /* Reserved hugepages, falling back to transparent ones once they run out */
+    HUGEPAGES_RESERVED,
+};
+
+/* Idle buffers are chained through their first bytes */
+typedef struct idle_buf
+{
+    struct idle_buf* next;
+} idle_buf_t;
+
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static idle_buf_t* idle[CLASSES];
+static frame_pool_stats_t pool_stats;
+static int hugepages = -1;
+
+/**
+ * Size class of a buffer size, or -1 beyond the largest one
+ */
+static int size_class(size_t size)
+{
+    if (size > FRAME_POOL_HUGEPAGE / 2)
+    {
+        size_t pages = (size + FRAME_POOL_HUGEPAGE - 1) / FRAME_POOL_HUGEPAGE;
+        return pages <= HUGE_CLASSES ? (int) (SMALL_CLASSES + pages - 1) : -1;
+    }
+    int c = 0;
+    while (((size_t) 1 << (SMALL_SHIFT + c)) < size)
+        c++;
+    return c;
+}
+
+static size_t class_size(int c, size_t size)
+{
+    if (c < 0)
+        return (size + FRAME_POOL_HUGEPAGE - 1) / FRAME_POOL_HUGEPAGE * FRAME_POOL_HUGEPAGE;
+    if (c < SMALL_CLASSES)
+        return (size_t) 1 << (SMALL_SHIFT + c);
+    return (size_t)(c - SMALL_CLASSES + 1) * FRAME_POOL_HUGEPAGE;
+}
+
+/**
+ * Map a buffer of whole hugepages, on a hugepage boundary for the kernel to back it with them
+ */
+static void* map_huge(size_t size)
+{
+    void* p = MAP_FAILED;
+    if (hugepages == HUGEPAGES_RESERVED)
+    {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                 -1, 0);
+        if (p != MAP_FAILED)
+        {
+            pool_stats.huge_mapped++;
+            return p;
+        }
+    }
+
+    /* Mapped with a hugepage of slack, trimmed down to the aligned part */
+    uint8_t* area = mmap(NULL, size + FRAME_POOL_HUGEPAGE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        return NULL;
+    uint8_t* start = (uint8_t*) (((uintptr_t) area + FRAME_POOL_HUGEPAGE - 1) &
+                                 ~(uintptr_t)(FRAME_POOL_HUGEPAGE - 1));
+    if (start > area)
+        munmap(area, start - area);
+    if (area + FRAME_POOL_HUGEPAGE > start)
+        munmap(start + size, area + FRAME_POOL_HUGEPAGE - start);
+#ifdef MADV_HUGEPAGE
+    if (hugepages != HUGEPAGES_OFF && madvise(start, size, MADV_HUGEPAGE) == 0)
+        pool_stats.huge_mapped++;
+#endif
+    return start;
+}
+
+static void* buf_alloc(int c, size_t size)
+{
+    if (c < 0 || c >= SMALL_CLASSES)
+        return map_huge(size);
+    void* buf;
+    return posix_memalign(&buf, FRAME_POOL_ALIGN, size) ? NULL : buf;
+}
+
+static void buf_free(void* buf, int c, size_t size)
+{
+    if (c < 0 || c >= SMALL_CLASSES)
+        munmap(buf, size);
+    else
+        free(buf);
+}
+
+/**
+ * Get a frame buffer of at least the given size, aligned on FRAME_POOL_ALIGN
+ * Buffers of a hugepage and more are backed by hugepages if AIC_PLAYER_HUGEPAGES allows.
+ * Returns NULL when out of memory.
+ */
+void* frame_pool_get(size_t size)
+{
+    int c = size_class(size);
+    size_t csize = class_size(c, size);
+    void* buf = NULL;
+
+    pthread_mutex_lock(&pool_mtx);
+    if (hugepages < 0)
+        hugepages = configvar_int_default("AIC_PLAYER_HUGEPAGES", HUGEPAGES_TRANSPARENT);
+    if (c >= 0 && idle[c] != NULL)
+    {
+        buf = idle[c];
+        idle[c] = idle[c]->next;
+        pool_stats.idle--;
+        pool_stats.idle_bytes -= csize;
+        pool_stats.reused++;
+    }
+    else
+        buf = buf_alloc(c, csize);
+    if (buf != NULL)
+    {
+        pool_stats.used++;
+        pool_stats.used_bytes += csize;
+    }
+    pthread_mutex_unlock(&pool_mtx);
+    if (buf == NULL)
+        E("Unable to allocate a frame buffer of %zu bytes", csize);
+    return buf;
+}
+
+/**
+ * Give a buffer back to the pool, with the size it was asked for
+ */
+void frame_pool_put(void* buf, size_t size)
+{
+    if (buf == NULL)
+        return;
+    int c = size_class(size);
+    size_t csize = class_size(c, size);
+
+    pthread_mutex_lock(&pool_mtx);
+    pool_stats.used--;
+    pool_stats.used_bytes -= csize;
+    if (c >= 0 && pool_stats.idle_bytes + csize <= FRAME_POOL_MAX_IDLE)
+    {
+        idle_buf_t* ib = buf;
+        ib->next = idle[c];
+        idle[c] = ib;
+        pool_stats.idle++;
+        pool_stats.idle_bytes += csize;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_mtx);
+    if (buf != NULL)
+        buf_free(buf, c, csize);
+}
+
+void frame_pool_get_stats(frame_pool_stats_t* stats)
+{
+    pthread_mutex_lock(&pool_mtx);
+    *stats = pool_stats;
+    pthread_mutex_unlock(&pool_mtx);
+}
@@ -0,0 +1,33 @@
+#ifndef _FRAME_POOL_H_
+#define _FRAME_POOL_H_
+
+#include <stddef.h>
+
+/* Frame buffers are aligned for the widest vector loads */
+#define FRAME_POOL_ALIGN 64
+/* Size classes from this one on are whole hugepages, mapped rather than allocated */
+#define FRAME_POOL_HUGEPAGE (2 * 1024 * 1024)
+/* Free buffers kept for reuse at most, in bytes, beyond which returned ones are released */
+#define FRAME_POOL_MAX_IDLE (64 * 1024 * 1024)
+
+/**
+ * Occupancy of the frame buffer pool
+ */
+typedef struct frame_pool_stats
+{
+    /* Buffers handed out, and their bytes */
+    size_t used;
+    size_t used_bytes;
+    /* Buffers kept for reuse, and their bytes */
+    size_t idle;
+    size_t idle_bytes;
+    /* Buffers mapped with hugepages so far, including the ones released since */
+    size_t huge_mapped;
+    /* Buffers handed out from the pool rather than allocated so far */
+    size_t reused;
+} frame_pool_stats_t;
+
+void* frame_pool_get(size_t size);
+void frame_pool_put(void* buf, size_t size);
+void frame_pool_get_stats(frame_pool_stats_t* stats);
+#endif
@@ -0,0 +1,46 @@
+#ifndef _FRAME_PROTO_H_
+#define _FRAME_PROTO_H_
+
+/*
+ * Binary frame protocol
+ * A guest replying to 'connect version=<n>' with n >= FRAME_PROTO_BINARY may send frame requests
+ * as fixed size binary records instead of 'frame' text queries, and gets replies with a fixed
+ * size binary header. Every other query stays text. Records start with FRAME_PROTO_MARKER, which
+ * never starts a text query nor a text reply, and integers are in network byte order (see
+ * net_pack.h). Floats are IEEE-754 single precision.
+ *
+ * Request, FRAME_REQUEST_SIZE bytes:
+ *   0  u8   marker
+ *   1  u8   reserved (3 bytes)
+ *   4  u32  sequence number, echoed in the reply
+ *   8  u32  video frame size, 0 if not requested
+ *  12  u32  preview frame size, 0 if not requested
+ *  16  f32  white balance red, green, and blue scales
+ *  28  f32  exposure compensation
+ *
+ * Reply header, FRAME_REPLY_SIZE bytes, followed by the video frame and the preview frame (unless
+ * they are in a shared memory slot), then the error message:
+ *   0  u8   marker
+ *   1  u8   status, FRAME_STATUS_OK or FRAME_STATUS_KO
+ *   2  u8   reserved (2 bytes)
+ *   4  u32  sequence number of the request
+ *   8  u64  capture timestamp, in microseconds
+ *  16  u32  video frame size
+ *  20  u32  preview frame size
+ *  24  i32  shared memory slot holding the frames, or -1 if they follow the header
+ *  28  u32  error message size
+ */
+
+/* Protocol versions */
+#define FRAME_PROTO_TEXT 0
+#define FRAME_PROTO_BINARY 1
+#define FRAME_PROTO_VERSION FRAME_PROTO_BINARY
+
+#define FRAME_PROTO_MARKER 0xff
+
+#define FRAME_REQUEST_SIZE 32
+#define FRAME_REPLY_SIZE 32
+
+#define FRAME_STATUS_OK 0
+#define FRAME_STATUS_KO 1
+#endif
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config_env.h"
+#include "logger.h"
+#include "peer.h"
+
+#define LOG_TAG "peer"
+
+/* Failures don't resolve the host again before this delay, in microseconds */
+#define PEER_RESOLVE_TTL_US 10000000
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int resolve(peer_t* p)
+{
+    if (p->resolved_at != 0)
+        return 0;
+    char port[8];
+    struct addrinfo hints = {0};
+    struct addrinfo* result;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", p->port);
+    int error = getaddrinfo(p->host, port, &hints, &result);
+    if (error)
+    {
+        W("Unable to resolve %s: %s", p->host, gai_strerror(error));
+        return -1;
+    }
+    memcpy(&p->addr, result->ai_addr, result->ai_addrlen);
+    p->addr_len = result->ai_addrlen;
+    p->resolved_at = now_us();
+    freeaddrinfo(result);
+    return 0;
+}
+
+static void connect_failed(peer_t* p)
+{
+    /* The host may have moved, but not every failure while it boots is worth a lookup */
+    if (p->resolved_at != 0 && now_us() - p->resolved_at > PEER_RESOLVE_TTL_US)
+        p->resolved_at = 0;
+}
+
+static void connected(peer_t* p, int sock)
+{
+    int yes = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+    p->backoff_ms = PEER_BACKOFF_MIN_MS;
+}
+
+/**
+ * Listen on a port for the VMs to connect
+ */
+int listen_socket(int port)
+{
+    int yes = 1;
+    struct sockaddr_in addr = {0};
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) || listen(sock, SOMAXCONN))
+    {
+        E("Unable to listen on port %d: %s", port, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    I("Listening for the VMs on port %d", port);
+    return sock;
+}
+
+/**
+ * Set up the connection to a port of a host
+ * With a listening socket, the connections come from the VM instead.
+ */
+void peer_init(peer_t* p, const char* host, int port, int listen_sock)
+{
+    memset(p, 0, sizeof(*p));
+    snprintf(p->host, sizeof(p->host), "%s", host);
+    p->port = port;
+    p->timeout_ms =
+        configvar_int_default("AIC_PLAYER_CONNECT_TIMEOUT_MS", PEER_CONNECT_TIMEOUT_MS);
+    p->listen_sock = listen_sock;
+    p->backoff_ms = PEER_BACKOFF_MIN_MS;
+}
+
+/**
+ * Start a non-blocking connection
+ * Returns the socket, to wait on for POLLOUT and hand to peer_connect_finish, or -1 on failure.
+ */
+int peer_connect_start(peer_t* p)
+{
+    if (resolve(p))
+        return -1;
+    int sock = socket(p->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr*) &p->addr, p->addr_len) == 0)
+    {
+        connected(p, sock);
+        return sock;
+    }
+    if (errno != EINPROGRESS)
+    {
+        connect_failed(p);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Check on a connection started by peer_connect_start, without waiting
+ * Returns 0 once connected, back in blocking mode, 1 while in progress, or -1 on failure, in
+ * which case the socket is closed.
+ */
+int peer_connect_finish(peer_t* p, int sock)
+{
+    struct pollfd pfd = {sock, POLLOUT, 0};
+    if (poll(&pfd, 1, 0) == 0)
+        return 1;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) || error)
+    {
+        connect_failed(p);
+        close(sock);
+        return -1;
+    }
+    connected(p, sock);
+    return 0;
+}
+
+/**
+ * Give up on a connection started by peer_connect_start
+ */
+void peer_connect_abort(peer_t* p, int sock)
+{
+    connect_failed(p);
+    close(sock);
+}
+
+/**
+ * Get a connection, waiting at most the connect timeout for it
+ * Returns the socket, or -1 to try again after peer_backoff.
+ */
+int peer_open(peer_t* p)
+{
+    if (p->listen_sock != -1)
+    {
+        struct pollfd pfd = {p->listen_sock, POLLIN, 0};
+        if (poll(&pfd, 1, p->timeout_ms) != 1)
+            return -1;
+        int sock = accept4(p->listen_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock != -1)
+            connected(p, sock);
+        return sock;
+    }
+
+    int sock = peer_connect_start(p);
+    if (sock == -1)
+        return -1;
+    struct pollfd pfd = {sock, POLLOUT, 0};
+    if (poll(&pfd, 1, p->timeout_ms) == 1 && peer_connect_finish(p, sock) == 0)
+        return sock;
+    /* Timed out, or failed and already closed */
+    if (pfd.revents == 0)
+        peer_connect_abort(p, sock);
+    return -1;
+}
+
+/**
+ * Delay before the next attempt, in milliseconds
+ * Doubles on every call until a connection succeeds, with jitter so that VMs booting together
+ * don't retry in lockstep.
+ */
+int peer_backoff(peer_t* p)
+{
+    int base = p->backoff_ms;
+    p->backoff_ms = base * 2 < PEER_BACKOFF_MAX_MS ? base * 2 : PEER_BACKOFF_MAX_MS;
+    return base / 2 + random() % (base / 2 + 1);
+}
+
+/**
+ * Tell whether a connection accepted in listen mode comes from the host
+ */
+int peer_matches(peer_t* p, const struct sockaddr* addr)
+{
+    if (resolve(p) || addr->sa_family != p->addr.ss_family)
+        return 0;
+    if (addr->sa_family == AF_INET)
+        return ((const struct sockaddr_in*) addr)->sin_addr.s_addr ==
+               ((const struct sockaddr_in*) &p->addr)->sin_addr.s_addr;
+    if (addr->sa_family == AF_INET6)
+        return !memcmp(&((const struct sockaddr_in6*) addr)->sin6_addr,
+                       &((const struct sockaddr_in6*) &p->addr)->sin6_addr,
+                       sizeof(struct in6_addr));
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _PEER_H_
+#define _PEER_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Backoff between connection attempts, doubling from the min to the max, in milliseconds */
+#define PEER_BACKOFF_MIN_MS 5
+#define PEER_BACKOFF_MAX_MS 1000
+/* Default time given to a connection attempt, in milliseconds */
+#define PEER_CONNECT_TIMEOUT_MS 500
+
+/**
+ * Connection to a port of a VM
+ * Either connected to with non-blocking connects, or in listen mode, accepted from the VM.
+ */
+typedef struct peer
+{
+    char host[256];
+    int port;
+    /* Time given to a connection attempt, in milliseconds */
+    int timeout_ms;
+    /* Listening socket in listen mode, -1 otherwise */
+    int listen_sock;
+    /* Address of the host, resolved once and kept until connecting to it fails */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t resolved_at;
+    /* Delay before the next attempt, in milliseconds */
+    int backoff_ms;
+} peer_t;
+
+int listen_socket(int port);
+void peer_init(peer_t* p, const char* host, int port, int listen_sock);
+int peer_connect_start(peer_t* p);
+int peer_connect_finish(peer_t* p, int sock);
+void peer_connect_abort(peer_t* p, int sock);
+int peer_open(peer_t* p);
+int peer_backoff(peer_t* p);
+int peer_matches(peer_t* p, const struct sockaddr* addr);
+#endif
@@ -0,0 +1,251 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "probe_cache.h"
+
+#define LOG_TAG "probe_cache"
+
+/**
+ * Probe results of a file, valid as long as its size and modification time don't change
+ */
+typedef struct probe_entry
+{
+    struct probe_entry* next;
+    char filename[256];
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    probe_info_t info;
+} probe_entry_t;
+
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* Most recently used first */
+static probe_entry_t* entries = NULL;
+static int entry_num = 0;
+static probe_cache_stats_t cache_stats;
+/* Index on disk, empty to keep the cache in memory only */
+static char cache_path[256];
+
+/**
+ * Identity of the current version of a file
+ */
+static int file_key(const char* filename, probe_entry_t* e)
+{
+    struct stat st;
+    if (stat(filename, &st) == -1)
+        return -1;
+    e->size = st.st_size;
+    e->mtime_sec = st.st_mtim.tv_sec;
+    e->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+static probe_entry_t** find(const char* filename)
+{
+    for (probe_entry_t** e = &entries; *e != NULL; e = &(*e)->next)
+    {
+        if (!strcmp((*e)->filename, filename))
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * Add an entry in front, dropping the least recently used one beyond PROBE_CACHE_MAX
+ * Called with the cache lock held.
+ */
+static void insert(probe_entry_t* entry)
+{
+    probe_entry_t** old = find(entry->filename);
+    if (old != NULL)
+    {
+        probe_entry_t* e = *old;
+        *old = e->next;
+        free(e);
+        entry_num--;
+    }
+    entry->next = entries;
+    entries = entry;
+    if (++entry_num <= PROBE_CACHE_MAX)
+        return;
+    probe_entry_t** last = &entries;
+    while ((*last)->next != NULL)
+        last = &(*last)->next;
+    free(*last);
+    *last = NULL;
+    entry_num--;
+}
+
+/**
+ * Read the index, a line per file: its key, the stream parameters, the extradata in hex and
+ * the path, last so that it may contain spaces
+ */
+static void load(void)
+{
+    FILE* f = fopen(cache_path, "r");
+    if (f == NULL)
+        return;
+    char line[PROBE_EXTRADATA_MAX * 2 + 512];
+    char hex[PROBE_EXTRADATA_MAX * 2 + 2];
+    int loaded = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        probe_entry_t* e = calloc(1, sizeof(probe_entry_t));
+        if (e == NULL)
+            break;
+        probe_info_t* i = &e->info;
+        int path_at = 0;
+        if (sscanf(line, "%lld %lld %ld %d %d %d %d %d %d %d %d %d %d %2049s %n", &e->size,
+                   &e->mtime_sec, &e->mtime_nsec, &i->stream_index, &i->stream_id, &i->codec_id,
+                   &i->width, &i->height, &i->pix_fmt, &i->time_base_num, &i->time_base_den,
+                   &i->frame_rate_num, &i->frame_rate_den, hex, &path_at) != 14 ||
+            path_at == 0)
+        {
+            free(e);
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(e->filename, sizeof(e->filename), "%s", line + path_at);
+        /* "-" for no extradata */
+        size_t len = hex[0] == '-' ? 0 : strlen(hex) / 2;
+        if (len > PROBE_EXTRADATA_MAX)
+        {
+            free(e);
+            continue;
+        }
+        for (size_t b = 0; b < len; b++)
+            sscanf(hex + b * 2, "%2hhx", &i->extradata[b]);
+        i->extradata_size = len;
+        /* Later lines are more recent */
+        insert(e);
+        loaded++;
+    }
+    fclose(f);
+    I("Loaded the probe results of %d files from %s", loaded, cache_path);
+}
+
+/**
+ * Write the index again, from the least recently used entry so that it is loaded last
+ * Written aside and renamed, a crash leaves the previous index.
+ * Called with the cache lock held.
+ */
+static void save(void)
+{
+    char tmp[sizeof(cache_path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        W("Unable to write the probe cache to %s", tmp);
+        return;
+    }
+    probe_entry_t* order[PROBE_CACHE_MAX];
+    int n = 0;
+    for (probe_entry_t* e = entries; e != NULL && n < PROBE_CACHE_MAX; e = e->next)
+        order[n++] = e;
+    while (n-- > 0)
+    {
+        const probe_entry_t* e = order[n];
+        const probe_info_t* i = &e->info;
+        fprintf(f, "%lld %lld %ld %d %d %d %d %d %d %d %d %d %d ", e->size, e->mtime_sec,
+                e->mtime_nsec, i->stream_index, i->stream_id, i->codec_id, i->width, i->height,
+                i->pix_fmt, i->time_base_num, i->time_base_den, i->frame_rate_num,
+                i->frame_rate_den);
+        if (i->extradata_size == 0)
+            fputc('-', f);
+        for (int b = 0; b < i->extradata_size; b++)
+            fprintf(f, "%02x", i->extradata[b]);
+        fprintf(f, " %s\n", e->filename);
+    }
+    if (fclose(f) != 0 || rename(tmp, cache_path) != 0)
+        W("Unable to write the probe cache to %s", cache_path);
+}
+
+/**
+ * Keep the probe results in an index at path too, and load the ones it has
+ * Without a path, they are only kept in memory.
+ */
+void probe_cache_init(const char* path)
+{
+    pthread_mutex_lock(&cache_mtx);
+    snprintf(cache_path, sizeof(cache_path), "%s", path != NULL ? path : "");
+    if (cache_path[0] != '\0')
+        load();
+    pthread_mutex_unlock(&cache_mtx);
+}
+
+/**
+ * Get the probe results of a file, if it didn't change since they were put
+ * Returns 0 on a hit, -1 on a miss.
+ */
+int probe_cache_get(const char* filename, probe_info_t* info)
+{
+    probe_entry_t key;
+    int hit = 0;
+    int known = file_key(filename, &key) == 0;
+
+    pthread_mutex_lock(&cache_mtx);
+    probe_entry_t** found = known ? find(filename) : NULL;
+    if (found != NULL)
+    {
+        probe_entry_t* e = *found;
+        hit = e->size == key.size && e->mtime_sec == key.mtime_sec &&
+              e->mtime_nsec == key.mtime_nsec;
+        if (hit)
+        {
+            *info = e->info;
+            /* Used the most recently now */
+            *found = e->next;
+            e->next = entries;
+            entries = e;
+        }
+    }
+    if (hit)
+        cache_stats.hits++;
+    else
+        cache_stats.misses++;
+    probe_cache_stats_t stats = cache_stats;
+    pthread_mutex_unlock(&cache_mtx);
+
+    if (hit)
+        D("Probe cache hit for %s (%llu hits, %llu misses)", filename,
+          (unsigned long long) stats.hits, (unsigned long long) stats.misses);
+    else
+        I("Probe cache miss for %s (%llu hits, %llu misses)", filename,
+          (unsigned long long) stats.hits, (unsigned long long) stats.misses);
+    return hit ? 0 : -1;
+}
+
+/**
+ * Keep the probe results of a file, replacing the previous ones
+ */
+void probe_cache_put(const char* filename, const probe_info_t* info)
+{
+    probe_entry_t* e = calloc(1, sizeof(probe_entry_t));
+    if (e == NULL)
+        return;
+    if (file_key(filename, e) || strlen(filename) >= sizeof(e->filename))
+    {
+        free(e);
+        return;
+    }
+    snprintf(e->filename, sizeof(e->filename), "%s", filename);
+    e->info = *info;
+
+    pthread_mutex_lock(&cache_mtx);
+    insert(e);
+    if (cache_path[0] != '\0')
+        save();
+    pthread_mutex_unlock(&cache_mtx);
+}
+
+void probe_cache_get_stats(probe_cache_stats_t* stats)
+{
+    pthread_mutex_lock(&cache_mtx);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_mtx);
+}
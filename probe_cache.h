@@ -0,0 +1,41 @@
+#ifndef _PROBE_CACHE_H_
+#define _PROBE_CACHE_H_
+
+#include <stdint.h>
+
+/* Files whose probe results are kept at most, the least recently used ones go first */
+#define PROBE_CACHE_MAX 256
+/* Codec extradata kept at most, streams with more are probed every time */
+#define PROBE_EXTRADATA_MAX 1024
+
+/**
+ * Parameters of the video stream of a file, as probed by libavformat
+ */
+typedef struct probe_info
+{
+    /* Index and identifier of the stream in its container */
+    int stream_index;
+    int stream_id;
+    int codec_id;
+    int width;
+    int height;
+    int pix_fmt;
+    int time_base_num;
+    int time_base_den;
+    int frame_rate_num;
+    int frame_rate_den;
+    int extradata_size;
+    uint8_t extradata[PROBE_EXTRADATA_MAX];
+} probe_info_t;
+
+typedef struct probe_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+} probe_cache_stats_t;
+
+void probe_cache_init(const char* path);
+int probe_cache_get(const char* filename, probe_info_t* info);
+void probe_cache_put(const char* filename, const probe_info_t* info);
+void probe_cache_get_stats(probe_cache_stats_t* stats);
+#endif
@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "query_reader.h"
+
+#define LOG_TAG "query_reader"
+
+/* Room for a bunch of pipelined queries, read with a single recv */
+#define QUERY_READER_INITIAL_SIZE 4096
+/* Largest query accepted before the connection is considered broken */
+#define QUERY_READER_MAX_SIZE (64 * 1024)
+
+int query_reader_init(query_reader_t* qr, int sock)
+{
+    qr->sock = sock;
+    qr->size = QUERY_READER_INITIAL_SIZE;
+    qr->start = 0;
+    qr->end = 0;
+    qr->binary_marker = 0;
+    qr->binary_size = 0;
+    qr->buf = malloc(qr->size);
+    return qr->buf == NULL ? -1 : 0;
+}
+
+void query_reader_free(query_reader_t* qr)
+{
+    free(qr->buf);
+    qr->buf = NULL;
+}
+
+/**
+ * Make room at the end of the buffer for the next recv
+ * Moves the pending partial query to the front, and grows the buffer when it is full.
+ */
+static int make_room(query_reader_t* qr)
+{
+    if (qr->start > 0)
+    {
+        memmove(qr->buf, qr->buf + qr->start, qr->end - qr->start);
+        qr->end -= qr->start;
+        qr->start = 0;
+    }
+    if (qr->end < qr->size)
+        return 0;
+    if (qr->size >= QUERY_READER_MAX_SIZE)
+    {
+        E("Query larger than %d bytes, dropping the connection", QUERY_READER_MAX_SIZE);
+        return -1;
+    }
+    char* buf = realloc(qr->buf, qr->size * 2);
+    if (buf == NULL)
+        return -1;
+    qr->buf = buf;
+    qr->size *= 2;
+    return 0;
+}
+
+/**
+ * Have queries starting with the marker byte read as fixed size binary records
+ * A size of 0 goes back to NUL-terminated queries only.
+ */
+void query_reader_set_binary(query_reader_t* qr, int marker, size_t size)
+{
+    qr->binary_marker = marker;
+    qr->binary_size = size;
+}
+
+/**
+ * Length of the query at the front of the buffer, or 0 if it is not complete yet
+ * Text queries are only searched for their NUL from scanned on.
+ */
+static size_t front_query_len(const query_reader_t* qr, size_t scanned)
+{
+    if (qr->binary_size && qr->end > qr->start &&
+        (unsigned char) qr->buf[qr->start] == qr->binary_marker)
+        return qr->end - qr->start >= qr->binary_size ? qr->binary_size : 0;
+    char* nul = memchr(qr->buf + scanned, '\0', qr->end - scanned);
+    return nul == NULL ? 0 : nul + 1 - (qr->buf + qr->start);
+}
+
+/**
+ * Whether a complete query is already buffered, so that query_reader_next won't block
+ */
+int query_reader_pending(const query_reader_t* qr)
+{
+    return front_query_len(qr, qr->start) != 0;
+}
+
+/**
+ * Read whatever the connection has for us, without blocking
+ * For event loops: once this returns -1 with errno EAGAIN, queries are available to
+ * query_reader_next as long as query_reader_pending says so.
+ * Returns the number of bytes read, 0 if the connection is closed, or -1 on error.
+ */
+int query_reader_fill(query_reader_t* qr)
+{
+    if (make_room(qr))
+        return -1;
+    ssize_t rec;
+    do
+        rec = recv(qr->sock, qr->buf + qr->end, qr->size - qr->end, MSG_DONTWAIT);
+    while (rec < 0 && errno == EINTR);
+    if (rec > 0)
+        qr->end += rec;
+    return rec;
+}
+
+/**
+ * Get the next complete query from the connection
+ * Queries already buffered are returned without any syscall, otherwise as much as fits in the
+ * buffer is read at once. *query points inside the buffer, and stays valid until the next call.
+ * Returns the query length including its NUL terminator (the record size for binary ones), 0 if
+ * the connection is closed, or -1 on error.
+ */
+int query_reader_next(query_reader_t* qr, char** query)
+{
+    size_t scanned = qr->start;
+    while (1)
+    {
+        int len = front_query_len(qr, scanned);
+        if (len != 0)
+        {
+            *query = qr->buf + qr->start;
+            qr->start += len;
+            return len;
+        }
+        size_t pending = qr->end - qr->start;
+        if (make_room(qr))
+            return -1;
+        scanned = pending;
+
+        ssize_t rec = recv(qr->sock, qr->buf + qr->end, qr->size - qr->end, 0);
+        if (rec < 0 && errno == EINTR)
+            continue;
+        if (rec <= 0)
+            return rec;
+        qr->end += rec;
+    }
+}
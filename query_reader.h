@@ -0,0 +1,27 @@
+#ifndef _QUERY_READER_H_
+#define _QUERY_READER_H_
+
+#include <stddef.h>
+
+/**
+ * Buffered reader splitting the guest connection stream into NUL-terminated queries
+ */
+typedef struct query_reader
+{
+    int sock;
+    char* buf;
+    size_t size;
+    size_t start;
+    size_t end;
+    /* Queries starting with binary_marker are binary_size bytes records, when binary_size != 0 */
+    int binary_marker;
+    size_t binary_size;
+} query_reader_t;
+
+int query_reader_init(query_reader_t* qr, int sock);
+void query_reader_free(query_reader_t* qr);
+int query_reader_next(query_reader_t* qr, char** query);
+int query_reader_pending(const query_reader_t* qr);
+int query_reader_fill(query_reader_t* qr);
+void query_reader_set_binary(query_reader_t* qr, int marker, size_t size);
+#endif
@@ -1,57 +1,100 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
 
 #include <amqp.h>
 #include <amqp_framing.h>
 #include <amqp_tcp_socket.h>
-#include <netdb.h>
+#include <errno.h>
 #include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <sys/select.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 
 #include "remote_command.h"
-#include "camera-capture-ffmpeg.h"
 #include "config_env.h"
 #include "logger.h"
 #include "net_pack.h"
+#include "peer.h"
 
 #define LOG_TAG "remote_control"
 #define BUFFER_SIZE 256
 
-static CameraDevice* dev = NULL;
+/* Heartbeat asked to the broker, in seconds: a broker silent for two of them is dead */
+#define AMQP_HEARTBEAT_S 10
+/* Time given to the connection to the broker, in milliseconds */
+#define AMQP_CONNECT_TIMEOUT_MS 2000
+/* Time given to the broker to answer a request, such as the login or a consume, in milliseconds */
+#define AMQP_RPC_TIMEOUT_MS 2000
+/* Backoff between connections to the broker, doubling from the min to the max, in milliseconds */
+#define AMQP_BACKOFF_MIN_MS 500
+#define AMQP_BACKOFF_MAX_MS 30000
 
-static pthread_mutex_t static_device_mtx;
+enum control_kind
+{
+    CONTROL_AMQP,
+    CONTROL_VM,
+    CONTROL_VM_LISTEN,
+};
 
-static pthread_t amqp_listen;
-static pthread_t socket_listen;
+struct vm_control;
 
-int connect_socket(const char* ip, short port)
+/* What an epoll event is about */
+typedef struct control_ref
 {
-    struct addrinfo* result;
-    int sock, error, yes = 1;
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-        return -1;
-    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    enum control_kind kind;
+    struct vm_control* vm;
+} control_ref_t;
 
-    if (getaddrinfo(ip, NULL, NULL, &result))
-    {
-        perror("getaddrinfo()");
-        return -1;
-    }
+/**
+ * Control connection of a camera to its VM
+ */
+typedef struct vm_control
+{
+    const amqp_target_t* target;
+    peer_t peer;
+    /* Connection, -1 while disconnected, and whether it is still being established */
+    int sock;
+    int connecting;
+    /* When to connect again, or to give up on the connection in progress */
+    uint64_t retry_at;
+    control_ref_t ref;
+    control_ref_t listen_ref;
+} vm_control_t;
 
-    ((struct sockaddr_in*) result->ai_addr)->sin_port = htons(port);
-    ((struct sockaddr_in*) result->ai_addr)->sin_family = AF_INET;
+/**
+ * Control sources of the daemon, multiplexed on a single thread
+ */
+typedef struct control_loop
+{
+    pthread_t thread;
+    int epfd;
+    /* Queues consumed on the AMQP connection, the consumer tag is the index in there */
+    amqp_target_t* targets;
+    int target_num;
+    amqp_connection_state_t conn;
+    /* Socket of the AMQP connection, -1 while disconnected */
+    int amqp_sock;
+    uint64_t amqp_retry_at;
+    int amqp_backoff_ms;
+    control_ref_t amqp_ref;
+    /* Control connections to the VM, if any */
+    vm_control_t* vms;
+    int vm_num;
+} control_loop_t;
 
-    error = connect(sock, result->ai_addr, sizeof(struct sockaddr));
-    freeaddrinfo(result);
-    return (error == -1 ? error : sock);
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
 }
 
-static void unpack_cam_data(char* cam_filename, void* envelope_bytes, size_t envelope_len)
+void unpack_cam_data(char* cam_filename, void* envelope_bytes, size_t envelope_len)
 {
     if (envelope_len > BUFFER_SIZE)
     {
@@ -63,14 +106,65 @@ static void unpack_cam_data(char* cam_filename, void* envelope_bytes, size_t env
     unpack(buf, "s", cam_filename);
 }
 
+/**
+ * Unpack a string of a control message into s, of BUFFER_SIZE bytes
+ * Returns the bytes it took in the message, or 0 if it doesn't fit in there or in s.
+ */
+static size_t unpack_string(const unsigned char* buf, size_t len, char* s)
+{
+    if (len < 2)
+        return 0;
+    size_t n = unpacku16((unsigned char*) buf);
+    if (n + 2 > len || n >= BUFFER_SIZE)
+        return 0;
+    memcpy(s, buf + 2, n);
+    s[n] = '\0';
+    return n + 2;
+}
+
+/**
+ * Hand a control message over to its target
+ * A message is either the file to switch to, or PRELOAD_COMMAND followed by the files to preload,
+ * every one of them a net_pack string.
+ */
+void dispatch_cam_data(const amqp_target_t* target, void* bytes, size_t len)
+{
+    char filename[BUFFER_SIZE] = {0};
+    size_t used = unpack_string(bytes, len, filename);
+    if (used != 0 && used < len && !strcmp(filename, PRELOAD_COMMAND))
+    {
+        while (used < len)
+        {
+            size_t n = unpack_string((unsigned char*) bytes + used, len - used, filename);
+            if (n == 0)
+            {
+                W("%s: malformed preload for camera %d", target->vmid, target->camera);
+                return;
+            }
+            used += n;
+            I("%s: received file name %s to preload for camera %d", target->vmid, filename,
+              target->camera);
+            if (target->preload != NULL)
+                target->preload(target->opaque, filename);
+        }
+        return;
+    }
+    unpack_cam_data(filename, bytes, len);
+    I("%s: received file name %s for camera %d", target->vmid, filename, target->camera);
+    target->switch_file(target->opaque, filename);
+}
+
 static int check_amqp_error(amqp_rpc_reply_t x, char const* context)
 {
     switch (x.reply_type)
     {
     case AMQP_RESPONSE_NORMAL:
         return 0;
+    case AMQP_RESPONSE_LIBRARY_EXCEPTION:
+        E("Error: %s %s", amqp_error_string2(x.library_error), context);
+        return 1;
     default:
-        C("Error: %d %s", x.reply_type, context);
+        E("Error: %d %s", x.reply_type, context);
         return 1;
     }
 }
@@ -82,6 +176,8 @@ static int amqp_connect(amqp_connection_state_t* conn, const char* const usernam
     int status;
     amqp_socket_t* socket;
     amqp_rpc_reply_t reply_status;
+    struct timeval timeout = {AMQP_CONNECT_TIMEOUT_MS / 1000,
+                              AMQP_CONNECT_TIMEOUT_MS % 1000 * 1000};
 
     *conn = amqp_new_connection();
     socket = amqp_tcp_socket_new(*conn);
@@ -90,14 +186,29 @@ static int amqp_connect(amqp_connection_state_t* conn, const char* const usernam
         E("Unable to create socket");
         return 1;
     }
-    status = amqp_socket_open(socket, hostname, port);
+    status = amqp_socket_open_noblock(socket, hostname, port, &timeout);
     if (status)
     {
-        E("Unable to open socket");
+        E("Unable to open socket: %s", amqp_error_string2(status));
         return 1;
     }
-    reply_status =
-        amqp_login(*conn, vhost, 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, username, password);
+    /* The login and the requests after it block the control loop until the broker answers, an
+     * unresponsive one fails them instead */
+    struct timeval rpc_timeout = {AMQP_RPC_TIMEOUT_MS / 1000, AMQP_RPC_TIMEOUT_MS % 1000 * 1000};
+#if AMQP_VERSION >= AMQP_VERSION_CODE(0, 9, 0, 0)
+    amqp_set_handshake_timeout(*conn, &rpc_timeout);
+    amqp_set_rpc_timeout(*conn, &rpc_timeout);
+#else
+    /* Older librabbitmq has blocking sockets and no timeouts of its own */
+    int sock = amqp_socket_get_sockfd(socket);
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &rpc_timeout, sizeof(rpc_timeout)) ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &rpc_timeout, sizeof(rpc_timeout)))
+        W("Unable to bound the requests to the broker: %s", strerror(errno));
+#endif
+    /* Heartbeats are exchanged while consuming, which the control loop does at least twice as
+     * often */
+    reply_status = amqp_login(*conn, vhost, 0, 131072, AMQP_HEARTBEAT_S, AMQP_SASL_METHOD_PLAIN,
+                              username, password);
     if (check_amqp_error(reply_status, "login"))
         return 1;
     amqp_channel_open(*conn, 1);
@@ -107,9 +218,10 @@ static int amqp_connect(amqp_connection_state_t* conn, const char* const usernam
     return 0;
 }
 
-static int amqp_run_consume(amqp_connection_state_t* conn, const char* const queue)
+static int amqp_run_consume(amqp_connection_state_t* conn, const char* const queue,
+                            const char* const tag)
 {
-    amqp_basic_consume(*conn, 1, amqp_cstring_bytes(queue), amqp_empty_bytes, 0, 0, 0,
+    amqp_basic_consume(*conn, 1, amqp_cstring_bytes(queue), amqp_cstring_bytes(tag), 0, 0, 0,
                        amqp_empty_table);
     if (check_amqp_error(amqp_get_rpc_reply(*conn), "consume"))
         return 1;
@@ -117,113 +229,304 @@ static int amqp_run_consume(amqp_connection_state_t* conn, const char* const que
     return 0;
 }
 
-static void* dispatch_amqp(void* ignored)
+/**
+ * Connect to the broker and consume the queues of every target
+ * Returns 0 once consuming, -1 to try again later.
+ */
+static int amqp_open(control_loop_t* cl)
 {
-    amqp_connection_state_t conn;
-    int status;
     const char* const username = configvar_string("AIC_PLAYER_AMQP_USERNAME");
     const char* const password = configvar_string("AIC_PLAYER_AMQP_PASSWORD");
     const char* const host = configvar_string("AIC_PLAYER_AMQP_HOST");
-    const char* const vmid = configvar_string("AIC_PLAYER_VM_ID");
-    char queue[256];
-    snprintf(queue, sizeof(queue), "android-events.%s.camera", vmid);
 
-    status = amqp_connect(&conn, username, password, "/", host, 5672);
-    if (status)
-        ERR("Failed to connect to AMQP");
-    status = amqp_run_consume(&conn, queue);
-    if (status)
-        ERR("Failed to consume AMQP messages");
+    if (amqp_connect(&cl->conn, username, password, "/", host, 5672))
+    {
+        amqp_destroy_connection(cl->conn);
+        return -1;
+    }
+    /* Every queue is consumed on the same channel, the consumer tag tells them apart */
+    for (int i = 0; i < cl->target_num; i++)
+    {
+        char queue[256], tag[16];
+        /* Cameras past the first one have their index appended */
+        if (cl->targets[i].camera > 0)
+            snprintf(queue, sizeof(queue), "android-events.%s.camera%d", cl->targets[i].vmid,
+                     cl->targets[i].camera);
+        else
+            snprintf(queue, sizeof(queue), "android-events.%s.camera", cl->targets[i].vmid);
+        snprintf(tag, sizeof(tag), "%d", i);
+        if (amqp_run_consume(&cl->conn, queue, tag))
+        {
+            amqp_connection_close(cl->conn, AMQP_REPLY_SUCCESS);
+            amqp_destroy_connection(cl->conn);
+            return -1;
+        }
+    }
+    cl->amqp_sock = amqp_get_sockfd(cl->conn);
+    struct epoll_event ev = {EPOLLIN, {.ptr = &cl->amqp_ref}};
+    epoll_ctl(cl->epfd, EPOLL_CTL_ADD, cl->amqp_sock, &ev);
+    cl->amqp_backoff_ms = AMQP_BACKOFF_MIN_MS;
+    return 0;
+}
 
-    char filename[BUFFER_SIZE] = {0};
+static void amqp_lost(control_loop_t* cl)
+{
+    epoll_ctl(cl->epfd, EPOLL_CTL_DEL, cl->amqp_sock, NULL);
+    amqp_destroy_connection(cl->conn);
+    cl->amqp_sock = -1;
+    cl->amqp_retry_at = now_ms();
+}
+
+/**
+ * Dispatch the messages received from the broker, without waiting for more
+ * Also sends the heartbeats that are due, and notices a broker that stopped sending its own.
+ */
+static void amqp_dispatch(control_loop_t* cl)
+{
+    struct timeval no_wait = {0, 0};
     while (1)
     {
         amqp_envelope_t env;
-        amqp_rpc_reply_t reply = amqp_consume_message(conn, &env, NULL, 0);
-        if (reply.reply_type == AMQP_RESPONSE_NORMAL)
+        amqp_maybe_release_buffers(cl->conn);
+        amqp_rpc_reply_t reply = amqp_consume_message(cl->conn, &env, &no_wait, 0);
+        if (reply.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION &&
+            reply.library_error == AMQP_STATUS_TIMEOUT)
+            return;
+        if (reply.reply_type != AMQP_RESPONSE_NORMAL)
         {
-            unpack_cam_data(filename, env.message.body.bytes, env.message.body.len);
-            I("Received file id %s", filename);
-            pthread_mutex_lock(&static_device_mtx);
-            switch_video_files(dev, (const char* const) filename);
-            pthread_mutex_unlock(&static_device_mtx);
+            /* Whatever came in instead of a message, the broker is closing the channel or gone */
+            check_amqp_error(reply, "consume, reconnecting");
+            amqp_lost(cl);
+            return;
         }
+        char tag[16] = {0};
+        memcpy(tag, env.consumer_tag.bytes,
+               env.consumer_tag.len < sizeof(tag) ? env.consumer_tag.len : sizeof(tag) - 1);
+        int target = atoi(tag);
+        if (target >= 0 && target < cl->target_num)
+            dispatch_cam_data(&cl->targets[target], env.message.body.bytes,
+                              env.message.body.len);
+        /* Acknowledged, so that switches aren't played again after a reconnection */
+        amqp_basic_ack(cl->conn, env.channel, env.delivery_tag, 0);
         amqp_destroy_envelope(&env);
     }
-    return 0;
 }
 
-pthread_t* start_amqp_thread()
+/** Remote control from the VM
+ *
+ * We connect to the control port of the camera on the virtual machine (32600, plus the index of
+ * the camera), or it connects to us in listen mode, and we then receive video file switch
+ * instructions from the VM
+ */
+
+static void vm_control_close(control_loop_t* cl, vm_control_t* vm)
 {
-    pthread_mutex_init(&static_device_mtx, NULL);
-    pthread_create(&amqp_listen, NULL, &dispatch_amqp, NULL);
-    return &amqp_listen;
+    epoll_ctl(cl->epfd, EPOLL_CTL_DEL, vm->sock, NULL);
+    close(vm->sock);
+    vm->sock = -1;
+    vm->connecting = 0;
 }
 
-/** Remote control from the VM
- *
- * We connect to the port 32500 on the virtual machine,
- * and we then receive video file switch instructions from the VM
+/**
+ * Use a connection to the VM, replacing the previous one
  */
+static void vm_control_set(control_loop_t* cl, vm_control_t* vm, int sock)
+{
+    struct epoll_event ev = {EPOLLIN, {.ptr = &vm->ref}};
+    if (vm->sock != -1)
+        vm_control_close(cl, vm);
+    vm->sock = sock;
+    epoll_ctl(cl->epfd, EPOLL_CTL_ADD, sock, &ev);
+}
 
-static void* socket_dispatch_thread(void* args)
+static void vm_control_connect(control_loop_t* cl, vm_control_t* vm, uint64_t now)
 {
-    const char* const vmip = configvar_string("AIC_PLAYER_VM_HOST");
-    while (1)
+    int sock = peer_connect_start(&vm->peer);
+    if (sock == -1)
+    {
+        vm->retry_at = now + peer_backoff(&vm->peer);
+        return;
+    }
+    struct epoll_event ev = {EPOLLOUT, {.ptr = &vm->ref}};
+    vm->sock = sock;
+    vm->connecting = 1;
+    vm->retry_at = now + vm->peer.timeout_ms;
+    epoll_ctl(cl->epfd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+static void vm_control_event(control_loop_t* cl, vm_control_t* vm)
+{
+    char buf[CONTROL_MESSAGE_SIZE];
+    if (vm->connecting)
     {
-        int sock = connect_socket(vmip, 32600);
-        if (sock <= 0)
+        int status = peer_connect_finish(&vm->peer, vm->sock);
+        if (status == 1)
+            return;
+        if (status == -1)
         {
-            sleep(1);
-            continue;
+            /* Already closed */
+            epoll_ctl(cl->epfd, EPOLL_CTL_DEL, vm->sock, NULL);
+            vm->sock = -1;
+            vm->connecting = 0;
+            vm->retry_at = now_ms() + peer_backoff(&vm->peer);
+            return;
         }
-        while (1)
-        {
-            struct timeval timeout = {5, 0};
-            char buf[BUFFER_SIZE];
+        struct epoll_event ev = {EPOLLIN, {.ptr = &vm->ref}};
+        vm->connecting = 0;
+        epoll_ctl(cl->epfd, EPOLL_CTL_MOD, vm->sock, &ev);
+        I("Control connection of camera %d established", vm->target->camera);
+        return;
+    }
+
+    ssize_t len = recv(vm->sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len <= 0)
+    {
+        W("Error received from the VM, reconnecting");
+        vm_control_close(cl, vm);
+        vm->retry_at = now_ms();
+        return;
+    }
+    dispatch_cam_data(vm->target, buf, len);
+}
+
+static void vm_control_accept(control_loop_t* cl, vm_control_t* vm)
+{
+    int sock = accept4(vm->peer.listen_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1)
+        return;
+    /* The latest connection from the VM wins, the previous one is most likely dead */
+    vm_control_set(cl, vm, sock);
+    I("Control connection of camera %d accepted", vm->target->camera);
+}
 
-            fd_set fd_read;
-            FD_ZERO(&fd_read);
-            FD_SET(sock, &fd_read);
+/**
+ * Reconnect whatever is disconnected, and tell how long the loop can wait, in milliseconds
+ */
+static int control_timers(control_loop_t* cl)
+{
+    uint64_t now = now_ms();
+    uint64_t next = now + AMQP_HEARTBEAT_S * 1000 / 2;
+
+    if (cl->amqp_sock == -1 && cl->amqp_retry_at <= now)
+    {
+        if (amqp_open(cl) == 0)
+            I("Connected to the AMQP broker");
+        else
+        {
+            int base = cl->amqp_backoff_ms;
+            cl->amqp_backoff_ms =
+                base * 2 < AMQP_BACKOFF_MAX_MS ? base * 2 : AMQP_BACKOFF_MAX_MS;
+            cl->amqp_retry_at = now_ms() + base;
+        }
+    }
+    if (cl->amqp_sock == -1 && cl->amqp_retry_at < next)
+        next = cl->amqp_retry_at;
 
-            if (select(sock + 1, &fd_read, 0, 0, &timeout) == -1)
-                break;
-            if (FD_ISSET(sock, &fd_read))
+    for (int i = 0; i < cl->vm_num; i++)
+    {
+        vm_control_t* vm = &cl->vms[i];
+        /* In listen mode, the VM connects it */
+        if (vm->peer.listen_sock != -1 || (vm->sock != -1 && !vm->connecting))
+            continue;
+        if (vm->retry_at <= now)
+        {
+            if (vm->connecting)
             {
-                ssize_t len = recv(sock, buf, sizeof(buf), 0);
-                if (len <= 0)
-                {
-                    W("Error received from the VM, reconnecting");
-                    break;
-                }
-                else
-                {
-                    char filename[BUFFER_SIZE] = {0};
-                    unpack_cam_data(filename, buf, len);
-                    I("Received file name %s", filename);
-                    pthread_mutex_lock(&static_device_mtx);
-                    switch_video_files(dev, (const char* const) filename);
-                    pthread_mutex_unlock(&static_device_mtx);
-                }
+                peer_connect_abort(&vm->peer, vm->sock);
+                epoll_ctl(cl->epfd, EPOLL_CTL_DEL, vm->sock, NULL);
+                vm->sock = -1;
+                vm->connecting = 0;
+                vm->retry_at = now + peer_backoff(&vm->peer);
             }
+            else
+                vm_control_connect(cl, vm, now);
         }
-        close(sock);
+        if (vm->retry_at < next)
+            next = vm->retry_at;
     }
-    return NULL;
+    now = now_ms();
+    return next > now ? next - now : 0;
 }
 
-pthread_t* start_socket_thread()
+static void* control_loop_run(void* opaque)
 {
-    pthread_create(&socket_listen, NULL, &socket_dispatch_thread, NULL);
-    return &socket_listen;
+    control_loop_t* cl = opaque;
+    struct epoll_event events[16];
+    while (1)
+    {
+        int timeout = control_timers(cl);
+        /* Frames the library read ahead of time don't show up on the socket */
+        if (cl->amqp_sock != -1 &&
+            (amqp_frames_enqueued(cl->conn) || amqp_data_in_buffer(cl->conn)))
+            timeout = 0;
+        int n = epoll_wait(cl->epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            C("Control loop failed: %s", strerror(errno));
+            return NULL;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            control_ref_t* ref = events[i].data.ptr;
+            if (ref->kind == CONTROL_VM)
+                vm_control_event(cl, ref->vm);
+            else if (ref->kind == CONTROL_VM_LISTEN)
+                vm_control_accept(cl, ref->vm);
+        }
+        /* Run on every turn, whether the broker sent something or heartbeats are due */
+        if (cl->amqp_sock != -1)
+            amqp_dispatch(cl);
+    }
+    return NULL;
 }
 
 /**
- * Update the camera device pointer
+ * Receive the file switches of the targets, from their AMQP queues and, with a host, from the
+ * control ports of its cameras, all on a single thread
+ * The targets must outlive the thread.
  */
-void switch_device(CameraDevice* new_dev)
+pthread_t* start_control_thread(amqp_target_t* targets, int num, const char* host)
 {
-    pthread_mutex_lock(&static_device_mtx);
-    dev = new_dev;
-    pthread_mutex_unlock(&static_device_mtx);
+    control_loop_t* cl = calloc(1, sizeof(control_loop_t));
+    if (cl == NULL)
+        return NULL;
+    cl->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (cl->epfd == -1)
+    {
+        free(cl);
+        return NULL;
+    }
+    cl->targets = targets;
+    cl->target_num = num;
+    cl->amqp_sock = -1;
+    cl->amqp_backoff_ms = AMQP_BACKOFF_MIN_MS;
+    cl->amqp_ref.kind = CONTROL_AMQP;
+
+    if (host != NULL)
+    {
+        int listen = configvar_int_default("AIC_PLAYER_LISTEN", 0);
+        cl->vms = calloc(num, sizeof(vm_control_t));
+        cl->vm_num = cl->vms != NULL ? num : 0;
+        for (int i = 0; i < cl->vm_num; i++)
+        {
+            vm_control_t* vm = &cl->vms[i];
+            int port = 32600 + targets[i].camera;
+            vm->target = &targets[i];
+            vm->sock = -1;
+            vm->ref.kind = CONTROL_VM;
+            vm->ref.vm = vm;
+            vm->listen_ref.kind = CONTROL_VM_LISTEN;
+            vm->listen_ref.vm = vm;
+            peer_init(&vm->peer, host, port, listen ? listen_socket(port) : -1);
+            if (vm->peer.listen_sock != -1)
+            {
+                struct epoll_event ev = {EPOLLIN, {.ptr = &vm->listen_ref}};
+                epoll_ctl(cl->epfd, EPOLL_CTL_ADD, vm->peer.listen_sock, &ev);
+            }
+        }
+    }
+    pthread_create(&cl->thread, NULL, &control_loop_run, cl);
+    return &cl->thread;
 }
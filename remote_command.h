@@ -4,8 +4,27 @@
 #include <pthread.h>
 #include "camera-common.h"
 
-int connect_socket(const char* ip, short port);
-void switch_device(CameraDevice* new_dev);
-pthread_t* start_amqp_thread(void);
-pthread_t* start_socket_thread(void);
+/* Largest control message, a file switch or a list of files to preload */
+#define CONTROL_MESSAGE_SIZE 4096
+/* First string of a message listing files to preload */
+#define PRELOAD_COMMAND "preload"
+
+/**
+ * Camera of a VM, and what to do with the files received for it
+ * Its AMQP queue is android-events.<vmid>.camera, with the index of the camera appended past the
+ * first one.
+ */
+typedef struct amqp_target
+{
+    const char* vmid;
+    int camera;
+    void (*switch_file)(void* opaque, const char* filename);
+    /* Read a file ahead of a switch to it, NULL to ignore preloads */
+    void (*preload)(void* opaque, const char* filename);
+    void* opaque;
+} amqp_target_t;
+
+void unpack_cam_data(char* cam_filename, void* envelope_bytes, size_t envelope_len);
+void dispatch_cam_data(const amqp_target_t* target, void* bytes, size_t len);
+pthread_t* start_control_thread(amqp_target_t* targets, int num, const char* host);
 #endif
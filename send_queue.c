@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "logger.h"
+#include "send_queue.h"
+
+#define LOG_TAG "send_queue"
+
+/* How long to wait for the kernel to release the copies of a reply sent without copy */
+#define SEND_QUEUE_ZEROCOPY_WAIT_MS 1000
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void free_item(send_item_t* item)
+{
+    free(item->copy);
+    free(item->released);
+    item->copy = NULL;
+    item->released = NULL;
+}
+
+/**
+ * Free the retired copies the kernel is done with
+ */
+static void reap_retired(send_queue_t* q)
+{
+    int n = 0;
+    while (n < q->retired_num && !zerocopy_wait(q->zc, q->retired[n].zc_token, 0))
+        free(q->retired[n++].buf);
+    q->retired_num -= n;
+    memmove(q->retired, q->retired + n, q->retired_num * sizeof(q->retired[0]));
+}
+
+/**
+ * Keep the copies of an item the kernel still reads until it is done with them, the item gets new
+ * ones
+ */
+static void retire_item(send_queue_t* q, send_item_t* item)
+{
+    uint8_t* bufs[2] = {item->copy, item->released};
+    for (int i = 0; i < 2; i++)
+    {
+        if (bufs[i] == NULL)
+            continue;
+        q->retired[q->retired_num].buf = bufs[i];
+        q->retired[q->retired_num++].zc_token = item->zc_token;
+    }
+    item->copy = NULL;
+    item->released = NULL;
+    item->inline_busy = 1;
+    item->inline_token = item->zc_token;
+}
+
+void send_queue_init(send_queue_t* q, int sock, zerocopy_t* zc)
+{
+    memset(q, 0, sizeof(*q));
+    q->sock = sock;
+    q->zc = zc;
+}
+
+/**
+ * Drop the replies not sent yet
+ * The copies of the replies sent without copy are only freed once the kernel is done with them,
+ * and left to it if it doesn't release them in time.
+ */
+void send_queue_free(send_queue_t* q)
+{
+    if (q->zc != NULL && zerocopy_wait(q->zc, zerocopy_token(q->zc), SEND_QUEUE_ZEROCOPY_WAIT_MS))
+    {
+        W("Reply buffers still in flight, leaving them to the kernel");
+        for (int i = 0; i < SEND_QUEUE_SIZE; i++)
+            q->items[i].copy = q->items[i].released = NULL;
+        q->retired_num = 0;
+    }
+    for (int i = 0; i < SEND_QUEUE_SIZE; i++)
+        free_item(&q->items[i]);
+    for (int i = 0; i < q->retired_num; i++)
+        free(q->retired[i].buf);
+    q->retired_num = 0;
+    q->head = q->tail;
+    q->pending = 0;
+}
+
+/**
+ * Whether the queue refuses replies, until the socket takes the oldest one, or the kernel releases
+ * the copies it still reads
+ */
+int send_queue_full(send_queue_t* q)
+{
+    if (q->tail - q->head == SEND_QUEUE_SIZE)
+        return 1;
+    if (q->zc == NULL || q->tail < SEND_QUEUE_SIZE)
+        return 0;
+    reap_retired(q);
+    /* The next slot can't reuse copies still in flight, nor keep them aside */
+    return q->retired_num + 2 > SEND_QUEUE_RETIRED &&
+           zerocopy_wait(q->zc, q->items[q->tail % SEND_QUEUE_SIZE].zc_token, 0);
+}
+
+/**
+ * Queue a reply, and send as much of the queue as the socket takes
+ * The last borrowed parts of iov must be left untouched until the token of the reply is done, the
+ * other ones are copied. Returns 0 on success, or -1 if the connection is unusable, or with errno
+ * set to EAGAIN if the queue is full: a producer that doesn't wait for send_queue_full to clear
+ * loses the reply.
+ */
+int send_queue_push(send_queue_t* q, const struct iovec* iov, int iovcnt, int borrowed)
+{
+    if (iovcnt > SEND_ITEM_IOV || borrowed > iovcnt || q->error)
+        return -1;
+    if (send_queue_full(q))
+    {
+        W("Queue full, dropping a reply");
+        errno = EAGAIN;
+        return -1;
+    }
+
+    send_item_t* item = &q->items[q->tail % SEND_QUEUE_SIZE];
+    /* The copies of the previous reply of the slot may still be in flight: the kernel keeps
+     * them, and the reply gets new ones. There is room for them, the queue isn't full. */
+    if (q->zc != NULL)
+    {
+        /* Copies are released in order, the older ones of the slot are done too */
+        if (q->tail < SEND_QUEUE_SIZE || !zerocopy_wait(q->zc, item->zc_token, 0))
+            item->inline_busy = 0;
+        else
+            retire_item(q, item);
+    }
+    free_item(item);
+
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt - borrowed; i++)
+        copied += iov[i].iov_len;
+    uint8_t* copy = item->inline_copy;
+    if (copied > SEND_ITEM_INLINE || (item->inline_busy && copied > 0))
+    {
+        item->copy = malloc(copied);
+        if (item->copy == NULL)
+            return -1;
+        copy = item->copy;
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        item->iov[i] = iov[i];
+        q->pending += iov[i].iov_len;
+        if (i >= iovcnt - borrowed)
+            continue;
+        memcpy(copy, iov[i].iov_base, iov[i].iov_len);
+        item->iov[i].iov_base = copy;
+        copy += iov[i].iov_len;
+    }
+    item->iovcnt = iovcnt;
+    item->cur = 0;
+    item->borrowed = iovcnt - borrowed;
+    item->zc_token = 0;
+    q->tail++;
+    return send_queue_flush(q) < 0 ? -1 : 0;
+}
+
+/**
+ * Send as much of the queue as the socket takes, without blocking
+ * Returns 0 once empty, 1 if the rest has to wait for the socket to be writable, or -1 if the
+ * connection is unusable.
+ */
+int send_queue_flush(send_queue_t* q)
+{
+    while (q->head != q->tail)
+    {
+        if (q->error)
+            return -1;
+        send_item_t* item = &q->items[q->head % SEND_QUEUE_SIZE];
+        struct msghdr msg;
+        size_t len = 0;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = item->iov + item->cur;
+        msg.msg_iovlen = item->iovcnt - item->cur;
+        for (int i = item->cur; i < item->iovcnt; i++)
+            len += item->iov[i].iov_len;
+
+        /* Large replies go out without copy when enabled for the connection */
+        ssize_t sent = q->zc != NULL
+                           ? zerocopy_sendmsg(q->zc, &msg, len, MSG_NOSIGNAL | MSG_DONTWAIT)
+                           : sendmsg(q->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            E("Unable to send a reply: %s", strerror(errno));
+            q->error = 1;
+            return -1;
+        }
+        q->pending -= sent;
+        /* Skip what has been sent, and resume from there on a short write */
+        while (item->cur < item->iovcnt && (size_t) sent >= item->iov[item->cur].iov_len)
+            sent -= item->iov[item->cur++].iov_len;
+        if (item->cur < item->iovcnt)
+        {
+            item->iov[item->cur].iov_base = (uint8_t*) item->iov[item->cur].iov_base + sent;
+            item->iov[item->cur].iov_len -= sent;
+            continue;
+        }
+        /* Copies are kept until the slot is reused, zero-copy sends may still read them */
+        item->zc_token = q->zc != NULL ? zerocopy_token(q->zc) : 0;
+        q->head++;
+    }
+    return q->error ? -1 : 0;
+}
+
+/**
+ * Token to wait on for the replies queued so far
+ */
+uint32_t send_queue_token(const send_queue_t* q)
+{
+    return q->tail;
+}
+
+/**
+ * Zero-copy token of what the replies queued before the token sent so far
+ */
+static uint32_t sent_zc_token(const send_queue_t* q, uint32_t token)
+{
+    /* Partly sent: whatever went out last may belong to them */
+    if ((int32_t)(token - q->head) > 0)
+        return zerocopy_token(q->zc);
+    /* The zero-copy token of the last reply, if its slot hasn't been reused since */
+    uint32_t last = token - 1;
+    return q->tail - last <= SEND_QUEUE_SIZE ? q->items[last % SEND_QUEUE_SIZE].zc_token
+                                             : zerocopy_token(q->zc);
+}
+
+/**
+ * Wait until the replies queued before the token are sent, and the buffers they borrow are
+ * released; a negative timeout waits forever
+ * Returns 0 once done, or -1 on timeout or error.
+ */
+int send_queue_wait(send_queue_t* q, uint32_t token, int timeout_ms)
+{
+    int64_t deadline = now_ms() + timeout_ms;
+    while ((int32_t)(token - q->head) > 0)
+    {
+        if (send_queue_flush(q) < 0)
+            return -1;
+        if ((int32_t)(token - q->head) <= 0)
+            break;
+        int left = timeout_ms < 0 ? -1 : deadline - now_ms();
+        if (timeout_ms >= 0 && left <= 0)
+            return -1;
+        struct pollfd pfd = {q->sock, POLLOUT, 0};
+        if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+            return -1;
+    }
+    if (q->zc == NULL || token == 0)
+        return 0;
+
+    int left = timeout_ms < 0 ? SEND_QUEUE_ZEROCOPY_WAIT_MS : deadline - now_ms();
+    return zerocopy_wait(q->zc, sent_zc_token(q, token), left > 0 ? left : 0);
+}
+
+/**
+ * Copy what the replies queued before the token and not sent yet borrow, so that the buffers can
+ * be reused right away
+ * Returns 0 if they can, or -1 while the kernel still reads what was sent of them without copy.
+ */
+int send_queue_release(send_queue_t* q, uint32_t token)
+{
+    for (uint32_t seq = q->head; (int32_t)(token - seq) > 0; seq++)
+    {
+        send_item_t* item = &q->items[seq % SEND_QUEUE_SIZE];
+        int first = item->cur > item->borrowed ? item->cur : item->borrowed;
+        size_t size = 0;
+        if (item->released != NULL)
+            continue;
+        for (int i = first; i < item->iovcnt; i++)
+            size += item->iov[i].iov_len;
+        if (size == 0)
+            continue;
+        if ((item->released = malloc(size)) == NULL)
+            return -1;
+        uint8_t* copy = item->released;
+        for (int i = first; i < item->iovcnt; i++)
+        {
+            memcpy(copy, item->iov[i].iov_base, item->iov[i].iov_len);
+            item->iov[i].iov_base = copy;
+            copy += item->iov[i].iov_len;
+        }
+    }
+    if (q->zc == NULL || token == 0)
+        return 0;
+    return zerocopy_wait(q->zc, sent_zc_token(q, token), 0);
+}
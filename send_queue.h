@@ -0,0 +1,75 @@
+#ifndef _SEND_QUEUE_H_
+#define _SEND_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "zerocopy.h"
+
+/* Replies queued at most, beyond which the queue is full until the oldest one goes out */
+#define SEND_QUEUE_SIZE 16
+#define SEND_ITEM_IOV 4
+/* Copied parts of a reply up to this size are kept in the item itself */
+#define SEND_ITEM_INLINE 64
+/* Copies given up while the kernel still reads them, beyond which the queue is full */
+#define SEND_QUEUE_RETIRED (2 * SEND_QUEUE_SIZE)
+
+typedef struct send_item
+{
+    struct iovec iov[SEND_ITEM_IOV];
+    int iovcnt;
+    /* First part not fully sent */
+    int cur;
+    /* First borrowed part */
+    int borrowed;
+    /* Copy of the parts that aren't borrowed when too large to be inline, and copy of the
+     * borrowed ones once released, or NULL */
+    uint8_t* copy;
+    uint8_t* released;
+    uint8_t inline_copy[SEND_ITEM_INLINE];
+    /* Zero-copy token once fully sent */
+    uint32_t zc_token;
+    /* The inline copy may still be read by the kernel until this zero-copy token is done */
+    int inline_busy;
+    uint32_t inline_token;
+} send_item_t;
+
+/**
+ * Replies of a connection waiting to be sent
+ * They go out in order with non-blocking sends, as fast as the socket takes them, so that whoever
+ * produces them never waits on the peer: once the queue is full, the producer stops taking queries
+ * until the socket is writable. Small parts of a reply are copied, large ones are borrowed until
+ * the token of the reply is done.
+ */
+typedef struct send_queue
+{
+    int sock;
+    zerocopy_t* zc;
+    send_item_t items[SEND_QUEUE_SIZE];
+    /* Sequence numbers of the next reply to send, and of the next reply queued */
+    uint32_t head;
+    uint32_t tail;
+    /* Bytes queued, not sent yet */
+    size_t pending;
+    /* A send failed, the connection is unusable */
+    int error;
+    /* Copies of replies whose slot was reused before the kernel released them, freed once it
+     * does, oldest first */
+    struct
+    {
+        uint8_t* buf;
+        uint32_t zc_token;
+    } retired[SEND_QUEUE_RETIRED];
+    int retired_num;
+} send_queue_t;
+
+void send_queue_init(send_queue_t* q, int sock, zerocopy_t* zc);
+void send_queue_free(send_queue_t* q);
+int send_queue_full(send_queue_t* q);
+int send_queue_push(send_queue_t* q, const struct iovec* iov, int iovcnt, int borrowed);
+int send_queue_flush(send_queue_t* q);
+uint32_t send_queue_token(const send_queue_t* q);
+int send_queue_wait(send_queue_t* q, uint32_t token, int timeout_ms);
+int send_queue_release(send_queue_t* q, uint32_t token);
+#endif
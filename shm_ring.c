@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "shm_ring.h"
+
+#define LOG_TAG "shm_ring"
+
+static size_t page_align(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+/**
+ * Create a ring of slot_num slots large enough for frame_size bytes each
+ */
+shm_ring_t* shm_ring_create(int slot_num, size_t frame_size)
+{
+    shm_ring_t* ring = calloc(1, sizeof(shm_ring_t));
+    if (ring == NULL)
+        return NULL;
+    ring->slot_num = slot_num;
+    ring->slot_size = page_align(frame_size);
+    size_t data_offset =
+        page_align(sizeof(shm_ring_header_t) + slot_num * sizeof(shm_slot_header_t));
+    ring->map_size = data_offset + slot_num * ring->slot_size;
+    ring->cur = -1;
+
+    ring->fd = memfd_create("camera-frames", MFD_CLOEXEC);
+    if (ring->fd == -1)
+    {
+        E("memfd_create failed: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    if (ftruncate(ring->fd, ring->map_size) == -1)
+    {
+        E("Unable to size the frame ring to %zu bytes: %s", ring->map_size, strerror(errno));
+        shm_ring_destroy(ring);
+        return NULL;
+    }
+    ring->base = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->base == MAP_FAILED)
+    {
+        E("Unable to map the frame ring: %s", strerror(errno));
+        ring->base = NULL;
+        shm_ring_destroy(ring);
+        return NULL;
+    }
+
+    shm_ring_header_t* hdr = (shm_ring_header_t*) ring->base;
+    hdr->magic = SHM_RING_MAGIC;
+    hdr->version = SHM_RING_VERSION;
+    hdr->slot_num = slot_num;
+    hdr->slot_size = ring->slot_size;
+    hdr->data_offset = data_offset;
+    snprintf(ring->path, sizeof(ring->path), "/proc/%d/fd/%d", getpid(), ring->fd);
+    I("Frame ring of %d slots of %zu bytes at %s", slot_num, ring->slot_size, ring->path);
+    return ring;
+}
+
+void shm_ring_destroy(shm_ring_t* ring)
+{
+    if (ring == NULL)
+        return;
+    if (ring->base != NULL)
+        munmap(ring->base, ring->map_size);
+    close(ring->fd);
+    free(ring);
+}
+
+static shm_slot_header_t* slot_header(const shm_ring_t* ring, int slot)
+{
+    return (shm_slot_header_t*) (ring->base + sizeof(shm_ring_header_t)) + slot;
+}
+
+uint8_t* shm_ring_slot(const shm_ring_t* ring, int slot)
+{
+    const shm_ring_header_t* hdr = (const shm_ring_header_t*) ring->base;
+    return ring->base + hdr->data_offset + slot * ring->slot_size;
+}
+
+/**
+ * Get the slot to write the next frame into
+ * Its seq is odd until the frame is published, a client still reading the previous frame of the
+ * slot can tell it has been rewritten meanwhile.
+ */
+int shm_ring_next(shm_ring_t* ring)
+{
+    int slot = (ring->cur + 1) % ring->slot_num;
+    __atomic_store_n(&slot_header(ring, slot)->seq, ring->seq * 2 + 1, __ATOMIC_RELAXED);
+    /* The odd seq is visible before anything written to the slot */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return slot;
+}
+
+/**
+ * Hand a written slot over to the client
+ */
+void shm_ring_publish(shm_ring_t* ring, int slot, size_t video_size, size_t preview_size)
+{
+    shm_slot_header_t* sh = slot_header(ring, slot);
+    sh->video_size = video_size;
+    sh->preview_size = preview_size;
+    __atomic_store_n(&sh->seq, ++ring->seq * 2, __ATOMIC_RELEASE);
+    ring->cur = slot;
+}
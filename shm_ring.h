@@ -0,0 +1,65 @@
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory frame transport
+ * Frames are written into a ring of slots in a memfd that the client maps through
+ * /proc/<pid>/fd/<fd>, and only the slot index goes over the connection. A slot is rewritten
+ * after slot_num - 1 more frames, so a client may hold on to that many frames.
+ *
+ * Layout: shm_ring_header_t, slot_num shm_slot_header_t, then slot_num page aligned slots of
+ * slot_size bytes, from data_offset on. A slot holds the video frame followed by the preview one.
+ *
+ * The seq of a slot is a sequence lock: odd while the slot is written, twice the number of its
+ * frame once published. A client loads seq (acquire), copies the frame out if seq is even and not
+ * 0, then loads seq again after an acquire fence: the copy is torn if seq changed, which only
+ * happens to a client more frames behind than that.
+ */
+
+#define SHM_RING_MAGIC 0x52534341 /* "ACSR" */
+#define SHM_RING_VERSION 2
+
+typedef struct shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_num;
+    uint32_t slot_size;
+    uint64_t data_offset;
+    uint8_t pad[40];
+} shm_ring_header_t;
+
+/**
+ * One cache line per slot, seq turns odd before the slot is written, and even again (release)
+ * once its content is complete
+ */
+typedef struct shm_slot_header
+{
+    uint32_t seq;
+    uint32_t video_size;
+    uint32_t preview_size;
+    uint8_t pad[52];
+} shm_slot_header_t;
+
+typedef struct shm_ring
+{
+    int fd;
+    uint8_t* base;
+    size_t map_size;
+    int slot_num;
+    size_t slot_size;
+    int cur;
+    /* Frames published so far */
+    uint32_t seq;
+    char path[64];
+} shm_ring_t;
+
+shm_ring_t* shm_ring_create(int slot_num, size_t frame_size);
+void shm_ring_destroy(shm_ring_t* ring);
+uint8_t* shm_ring_slot(const shm_ring_t* ring, int slot);
+int shm_ring_next(shm_ring_t* ring);
+void shm_ring_publish(shm_ring_t* ring, int slot, size_t video_size, size_t preview_size);
+#endif
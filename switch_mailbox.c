@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "switch_mailbox.h"
+
+#define LOG_TAG "switch_mailbox"
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void switch_mailbox_init(switch_mailbox_t* mb)
+{
+    pthread_mutex_init(&mb->mtx, NULL);
+    mb->filename[0] = '\0';
+    mb->pending = 0;
+    mb->posted_at = 0;
+    mb->taken_posted_at = 0;
+    mb->posted = 0;
+    mb->superseded = 0;
+    mb->applied = 0;
+    mb->failed = 0;
+    mb->latency_us = 0;
+    mb->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->wake_fd == -1)
+        W("No wake up on file switches (%s), they wait for the next frame", strerror(errno));
+}
+
+/**
+ * Post a file switch, replacing the one not applied yet if any
+ */
+void switch_mailbox_post(switch_mailbox_t* mb, const char* filename)
+{
+    pthread_mutex_lock(&mb->mtx);
+    if (mb->pending)
+    {
+        mb->superseded++;
+        D("Switch to %s superseded by %s", mb->filename, filename);
+    }
+    snprintf(mb->filename, sizeof(mb->filename), "%s", filename);
+    mb->pending = 1;
+    mb->posted_at = now_us();
+    mb->posted++;
+    if (mb->wake_fd != -1)
+        eventfd_write(mb->wake_fd, 1);
+    pthread_mutex_unlock(&mb->mtx);
+}
+
+/**
+ * Take the latest file switch, returns 1 if there was one, 0 otherwise
+ */
+int switch_mailbox_take(switch_mailbox_t* mb, char* filename, size_t size)
+{
+    pthread_mutex_lock(&mb->mtx);
+    int pending = mb->pending;
+    if (pending)
+    {
+        snprintf(filename, size, "%s", mb->filename);
+        mb->taken_posted_at = mb->posted_at;
+    }
+    mb->pending = 0;
+    if (mb->wake_fd != -1)
+    {
+        eventfd_t count;
+        eventfd_read(mb->wake_fd, &count);
+    }
+    pthread_mutex_unlock(&mb->mtx);
+    return pending;
+}
+
+/**
+ * Record that the switch taken last is applied, the file it names is the one played from now on
+ * unless it failed
+ */
+void switch_mailbox_applied(switch_mailbox_t* mb, int failed)
+{
+    pthread_mutex_lock(&mb->mtx);
+    mb->applied++;
+    if (failed)
+        mb->failed++;
+    mb->latency_us = now_us() - mb->taken_posted_at;
+    pthread_mutex_unlock(&mb->mtx);
+}
+
+void switch_mailbox_get_stats(switch_mailbox_t* mb, switch_mailbox_stats_t* stats)
+{
+    pthread_mutex_lock(&mb->mtx);
+    stats->posted = mb->posted;
+    stats->superseded = mb->superseded;
+    stats->applied = mb->applied;
+    stats->failed = mb->failed;
+    stats->latency_us = mb->latency_us;
+    pthread_mutex_unlock(&mb->mtx);
+}
+
+void switch_mailbox_free(switch_mailbox_t* mb)
+{
+    if (mb->wake_fd != -1)
+        close(mb->wake_fd);
+    pthread_mutex_destroy(&mb->mtx);
+}
@@ -0,0 +1,49 @@
+#ifndef _SWITCH_MAILBOX_H_
+#define _SWITCH_MAILBOX_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * File switch of a camera, posted by the control plane and applied by the frame pipeline
+ * Only the latest switch is kept: a burst of them costs a single file open, at the next frame.
+ * Posting never waits on the decoder, only on the lock of the mailbox itself.
+ */
+typedef struct switch_mailbox
+{
+    pthread_mutex_t mtx;
+    /* Latest file posted, whether it was taken already, and when it was posted */
+    char filename[256];
+    int pending;
+    uint64_t posted_at;
+    /* When the switch taken last was posted */
+    uint64_t taken_posted_at;
+    /* Switches posted, replaced by a later one before being applied, applied, and applied but
+     * to a file that couldn't be played */
+    uint64_t posted;
+    uint64_t superseded;
+    uint64_t applied;
+    uint64_t failed;
+    /* Time from posting to applying of the last switch applied, in microseconds */
+    uint64_t latency_us;
+    /* Readable while a switch is pending, for the thread applying them to wait on, or -1 */
+    int wake_fd;
+} switch_mailbox_t;
+
+typedef struct switch_mailbox_stats
+{
+    uint64_t posted;
+    uint64_t superseded;
+    uint64_t applied;
+    uint64_t failed;
+    uint64_t latency_us;
+} switch_mailbox_stats_t;
+
+void switch_mailbox_init(switch_mailbox_t* mb);
+void switch_mailbox_post(switch_mailbox_t* mb, const char* filename);
+int switch_mailbox_take(switch_mailbox_t* mb, char* filename, size_t size);
+void switch_mailbox_applied(switch_mailbox_t* mb, int failed);
+void switch_mailbox_get_stats(switch_mailbox_t* mb, switch_mailbox_stats_t* stats);
+void switch_mailbox_free(switch_mailbox_t* mb);
+#endif
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+
+#include "logger.h"
+#include "worker_pool.h"
+
+#define LOG_TAG "worker_pool"
+
+static void* worker_loop(void* opaque)
+{
+    worker_pool_t* pool = opaque;
+    pthread_mutex_lock(&pool->mtx);
+    while (1)
+    {
+        while (pool->head == NULL)
+            pthread_cond_wait(&pool->cond, &pool->mtx);
+        worker_job_t* job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        job->queued = 0;
+        pthread_mutex_unlock(&pool->mtx);
+        job->run(job);
+        pthread_mutex_lock(&pool->mtx);
+    }
+    return NULL;
+}
+
+/**
+ * Start thread_num workers
+ * The pool lives as long as the process.
+ */
+int worker_pool_init(worker_pool_t* pool, int thread_num)
+{
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->thread_num = 0;
+    pool->threads = calloc(thread_num, sizeof(pthread_t));
+    if (pool->threads == NULL)
+        return -1;
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int i = 0; i < thread_num; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, worker_loop, pool))
+            break;
+        pool->thread_num++;
+    }
+    if (pool->thread_num == 0)
+    {
+        E("Unable to start any worker");
+        return -1;
+    }
+    I("%d workers started", pool->thread_num);
+    return 0;
+}
+
+void worker_pool_submit(worker_pool_t* pool, worker_job_t* job)
+{
+    pthread_mutex_lock(&pool->mtx);
+    job->next = NULL;
+    job->queued = 1;
+    if (pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mtx);
+}
+
+/**
+ * Take a job out of the queue, if no worker has picked it up yet
+ * Returns 1 if it was removed, 0 if it is running, or has already run.
+ */
+int worker_pool_cancel(worker_pool_t* pool, worker_job_t* job)
+{
+    int removed = 0;
+    pthread_mutex_lock(&pool->mtx);
+    if (job->queued)
+    {
+        worker_job_t* prev = NULL;
+        for (worker_job_t* cur = pool->head; cur != NULL; prev = cur, cur = cur->next)
+        {
+            if (cur != job)
+                continue;
+            if (prev != NULL)
+                prev->next = cur->next;
+            else
+                pool->head = cur->next;
+            if (pool->tail == cur)
+                pool->tail = prev;
+            break;
+        }
+        job->queued = 0;
+        removed = 1;
+    }
+    pthread_mutex_unlock(&pool->mtx);
+    return removed;
+}
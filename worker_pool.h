@@ -0,0 +1,34 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include <pthread.h>
+
+/**
+ * Job to run on a worker pool
+ * Embedded in the structure it works on, so that submitting doesn't allocate. A job is queued at
+ * most once at a time.
+ */
+typedef struct worker_job
+{
+    void (*run)(struct worker_job* job);
+    struct worker_job* next;
+    int queued;
+} worker_job_t;
+
+/**
+ * Fixed set of threads running jobs in submission order
+ */
+typedef struct worker_pool
+{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    worker_job_t* head;
+    worker_job_t* tail;
+    pthread_t* threads;
+    int thread_num;
+} worker_pool_t;
+
+int worker_pool_init(worker_pool_t* pool, int thread_num);
+void worker_pool_submit(worker_pool_t* pool, worker_job_t* job);
+int worker_pool_cancel(worker_pool_t* pool, worker_job_t* job);
+#endif
@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+/* Needs struct timespec */
+#include <linux/errqueue.h>
+
+#include "logger.h"
+#include "zerocopy.h"
+
+#define LOG_TAG "zerocopy"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+/**
+ * Enable zero-copy sends on the socket for payloads of at least threshold bytes
+ * Falls back to regular sends when the kernel doesn't support it. Returns 1 if enabled.
+ */
+int zerocopy_init(zerocopy_t* zc, int sock, size_t threshold)
+{
+    int one = 1;
+    memset(zc, 0, sizeof(*zc));
+    zc->sock = sock;
+    if (threshold == 0)
+        return 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+    {
+        W("SO_ZEROCOPY not supported (%s), using regular sends", strerror(errno));
+        return 0;
+    }
+    zc->threshold = threshold;
+    I("Zero-copy sends enabled from %zu bytes", threshold);
+    return 1;
+}
+
+/**
+ * sendmsg, without copy if the payload is large enough
+ */
+ssize_t zerocopy_sendmsg(zerocopy_t* zc, const struct msghdr* msg, size_t len, int flags)
+{
+    if (zc->threshold == 0 || len < zc->threshold)
+        return sendmsg(zc->sock, msg, flags);
+    ssize_t sent = sendmsg(zc->sock, msg, flags | MSG_ZEROCOPY);
+    if (sent >= 0)
+        zc->next_seq++;
+    return sent;
+}
+
+/**
+ * Token to wait on for the buffers of the sends issued so far to be released
+ */
+uint32_t zerocopy_token(const zerocopy_t* zc)
+{
+    return zc->next_seq;
+}
+
+/**
+ * Record the release of the sends lo to hi (inclusive)
+ * Ranges released ahead of older sends are kept aside until the gap is filled.
+ */
+static void complete_range(zerocopy_t* zc, uint32_t lo, uint32_t hi)
+{
+    if ((int32_t)(lo - zc->done) > 0)
+    {
+        if (zc->early_num < ZEROCOPY_MAX_EARLY)
+        {
+            zc->early[zc->early_num].lo = lo;
+            zc->early[zc->early_num].hi = hi;
+            zc->early_num++;
+            return;
+        }
+        W("Too many out of order completions, assuming %u..%u released", zc->done, lo);
+    }
+    if ((int32_t)(hi + 1 - zc->done) > 0)
+        zc->done = hi + 1;
+    for (int i = 0; i < zc->early_num; i++)
+    {
+        if ((int32_t)(zc->early[i].lo - zc->done) <= 0)
+        {
+            if ((int32_t)(zc->early[i].hi + 1 - zc->done) > 0)
+                zc->done = zc->early[i].hi + 1;
+            zc->early[i] = zc->early[--zc->early_num];
+            /* done moved, earlier entries may now follow it */
+            i = -1;
+        }
+    }
+}
+
+/**
+ * Read the completion notifications pending on the socket error queue
+ */
+static int reap_completions(zerocopy_t* zc)
+{
+    while (1)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zc->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err* serr = (struct sock_extended_err*) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zc->threshold)
+            {
+                /* The kernel had to copy anyway (e.g. loopback), pinning pages is pure cost */
+                I("Zero-copy sends are copied on this route, disabling them");
+                zc->threshold = 0;
+            }
+            complete_range(zc, serr->ee_info, serr->ee_data);
+        }
+    }
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Wait until the kernel releases the buffers of the sends issued before the token
+ * Returns 0 once they are released, or -1 on timeout or error.
+ */
+int zerocopy_wait(zerocopy_t* zc, uint32_t token, int timeout_ms)
+{
+    int64_t deadline = now_ms() + timeout_ms;
+    while (1)
+    {
+        if (reap_completions(zc))
+            return -1;
+        if ((int32_t)(zc->done - token) >= 0)
+            return 0;
+        int left = deadline - now_ms();
+        if (left <= 0)
+            return -1;
+        /* A pending error queue is reported as POLLERR, whatever the requested events */
+        struct pollfd pfd = {zc->sock, 0, 0};
+        if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+            return -1;
+    }
+}
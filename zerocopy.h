@@ -0,0 +1,39 @@
+#ifndef _ZEROCOPY_H_
+#define _ZEROCOPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define ZEROCOPY_MAX_EARLY 32
+
+/**
+ * MSG_ZEROCOPY state of a connection
+ * Every zero-copy sendmsg gets a sequence number, and the kernel reports on the socket error
+ * queue when it is done with the pages of a range of them. Buffers handed to a zero-copy send
+ * must be left untouched until then.
+ */
+typedef struct zerocopy
+{
+    int sock;
+    /* Payloads from this size on are sent without copy, 0 when disabled */
+    size_t threshold;
+    /* Sequence number of the next zero-copy send */
+    uint32_t next_seq;
+    /* Every send before this sequence number has been released by the kernel */
+    uint32_t done;
+    /* Released ranges reported ahead of older ones */
+    struct
+    {
+        uint32_t lo;
+        uint32_t hi;
+    } early[ZEROCOPY_MAX_EARLY];
+    int early_num;
+} zerocopy_t;
+
+int zerocopy_init(zerocopy_t* zc, int sock, size_t threshold);
+ssize_t zerocopy_sendmsg(zerocopy_t* zc, const struct msghdr* msg, size_t len, int flags);
+uint32_t zerocopy_token(const zerocopy_t* zc);
+int zerocopy_wait(zerocopy_t* zc, uint32_t token, int timeout_ms);
+#endif